@@ -0,0 +1,524 @@
+// Builds the suffix array a block at a time, for when there isn't the memory
+// for all of it (Karkkainen, "Fast BWT in small space by blockwise suffix
+// sorting", 2007; Bowtie builds its index the same way). A sample of the
+// suffixes is sorted first, and every so many of those are taken as
+// splitters. Each block is then the suffixes between two splitters, which
+// are found by going through the whole sequence, and sorted on their own.
+// What keeps the sorting from taking forever on repeats is a difference
+// cover: a set of offsets mod BW_V such that for any i and j there's a
+// d < BW_V with i + d and j + d both in the set. The sample is every position
+// whose offset is in it, so once the sample is sorted, comparing two suffixes
+// never takes more than BW_V bases; if they're the same that far, the ranks
+// of the samples at i + d and j + d decide it.
+
+#include <stdlib.h>
+#include <string.h>
+#include "blockwise.h"
+
+// The cover is {0, ..., BW_K - 1} and the multiples of BW_K (mod BW_V = BW_K
+// squared), which is 2 * BW_K - 1 offsets: a difference of a * BW_K + b is
+// (a + 1) * BW_K - (BW_K - b) if b > 0, and a * BW_K - 0 if not. So the
+// sample is about 1/16 of the suffixes.
+#define BW_K 32
+#define BW_V (BW_K * BW_K)
+#define BW_D (2 * BW_K - 1)
+
+// Bases per key in bw_mkqs() (the rest of the 64 bits say how many there
+// are, for a suffix which ends sooner)
+#define BW_STEP 29
+
+// Buckets at least this big are split with a radix sort first (bw_radix())
+#define BW_RADIX_MIN 65536
+
+static inline unsigned char getbase(const char *str, bwtint_t idx) {
+  // Gets the base at the appropriate index
+  return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
+}
+
+typedef struct {
+  const char *str;
+  bwtint_t len;
+  bwtint_t *rank; // Of each sample suffix, indexed by bw_sidx()
+  short dpos[BW_V]; // Where each offset is in the cover (-1 if it isn't)
+  short dtab[BW_V]; // An offset x in the cover such that x + d is too
+} bw_ctx;
+
+typedef struct {
+  bwtint_t key, idx;
+} bw_pair;
+
+static inline bwtint_t bw_sidx(const bw_ctx *c, bwtint_t p) {
+  return p / BW_V * BW_D + c->dpos[p % BW_V];
+}
+
+// The 32 bases from p on, the first in the top two bits, with A's for
+// anything past the end. The A's can't make two suffixes look the wrong way
+// round: if they're what one differs from another by, it's the one which
+// ended first, and that comes first anyway.
+static inline unsigned long long bw_word(const bw_ctx *c, bwtint_t p) {
+  const unsigned char *s = (const unsigned char *)c->str;
+  bwtint_t b = p >> 2, left = c->len - p, nbytes = (c->len + 3) >> 2;
+  unsigned long long w = 0;
+  int i, sh = 2 * (p & 3);
+  if (left <= 0)
+    return 0;
+  if (left >= 36) {
+    // All 9 bytes the bases could be in are in the sequence
+    memcpy(&w, s + b, 8);
+    w = __builtin_bswap64(w);
+    return sh ? w << sh | s[b+8] >> (8 - sh) : w;
+  }
+  for (i = 0; i < 8; ++i)
+    w = w << 8 | (b + i < nbytes ? s[b+i] : 0);
+  if (sh)
+    w = w << sh | (b + 8 < nbytes ? s[b+8] >> (8 - sh) : 0);
+  if (left < 32)
+    w &= ~0ULL << (2 * (32 - left));
+  return w;
+}
+
+// Compares the suffixes at i and j on (at most) their first n bases; a
+// suffix which ends first comes first
+static int bw_cmp(const bw_ctx *c, bwtint_t i, bwtint_t j, bwtint_t n) {
+  bwtint_t li = c->len - i, lj = c->len - j, m = li < lj ? li : lj, off;
+  unsigned long long a, b;
+  if (m > n)
+    m = n;
+  for (off = 0; off < m; off += 32) {
+    a = bw_word(c, i + off);
+    b = bw_word(c, j + off);
+    if (m - off < 32) {
+      a >>= 2 * (32 - (m - off));
+      b >>= 2 * (32 - (m - off));
+    }
+    if (a != b)
+      return a < b ? -1 : 1;
+  }
+  if (m == n)
+    return 0;
+  return li < lj ? -1 : li > lj;
+}
+
+// Compares two suffixes which are the same for at least BW_V bases (so
+// neither ends that soon, and the samples after them are there to look at)
+static int bw_cmp_rank(const bw_ctx *c, bwtint_t i, bwtint_t j) {
+  bwtint_t d = (c->dtab[(j - i) & (BW_V - 1)] - i) & (BW_V - 1);
+  return c->rank[bw_sidx(c, i + d)] < c->rank[bw_sidx(c, j + d)] ? -1 : 1;
+}
+
+// Compares two whole suffixes which are known to be the same for their
+// first depth bases (once the sample's sorted; before that, suffixes which
+// are the same for BW_V bases are ties)
+static int bw_cmp_from(const bw_ctx *c, bwtint_t i, bwtint_t j,
+		       bwtint_t depth, int sample) {
+  int r;
+  if (i == j)
+    return 0;
+  if (depth < BW_V && (r = bw_cmp(c, i + depth, j + depth, BW_V - depth)))
+    return r;
+  return sample ? 0 : bw_cmp_rank(c, i, j);
+}
+
+typedef int (*bw_cmp_fn)(const bw_ctx *, bwtint_t, bwtint_t);
+
+// Quicksort (median of three, Hoare's partition) of the suffixes at a, with
+// insertion sort for the small pieces. The library's qsort() would do, but
+// the comparisons need c.
+static void bw_sort(const bw_ctx *c, bwtint_t *a, bwtint_t n, bw_cmp_fn cmp) {
+  bwtint_t i, j, m, p, t;
+  while (n > 16) {
+    m = (n - 1) / 2;
+    if (cmp(c, a[m], a[0]) < 0) {
+      t = a[m]; a[m] = a[0]; a[0] = t;
+    }
+    if (cmp(c, a[n-1], a[m]) < 0) {
+      t = a[m]; a[m] = a[n-1]; a[n-1] = t;
+      if (cmp(c, a[m], a[0]) < 0) {
+	t = a[m]; a[m] = a[0]; a[0] = t;
+      }
+    }
+    p = a[m];
+    for (i = -1, j = n;;) {
+      while (cmp(c, a[++i], p) < 0)
+	;
+      while (cmp(c, p, a[--j]) < 0)
+	;
+      if (i >= j)
+	break;
+      t = a[i]; a[i] = a[j]; a[j] = t;
+    }
+    // a[0..j] are no bigger than p and the rest no smaller; recurse on the
+    // smaller side, so the stack stays shallow
+    if (j + 1 < n - j - 1) {
+      bw_sort(c, a, j + 1, cmp);
+      a += j + 1;
+      n -= j + 1;
+    }
+    else {
+      bw_sort(c, a + j + 1, n - j - 1, cmp);
+      n = j + 1;
+    }
+  }
+  for (i = 1; i < n; ++i) {
+    t = a[i];
+    for (j = i; j > 0 && cmp(c, t, a[j-1]) < 0; --j)
+      a[j] = a[j-1];
+    a[j] = t;
+  }
+}
+
+// The bucket mkqs() puts the suffix at p in: its first BW_STEP bases, and
+// how many of those there are (if it ends that soon). If two suffixes are
+// the same that far and one ends, it's the one which comes first.
+static inline unsigned long long bw_key(const bw_ctx *c, bwtint_t p) {
+  bwtint_t left = c->len - p;
+  return (bw_word(c, p) & ~63ULL) |
+    (left < BW_STEP ? (left < 0 ? 0 : left) : BW_STEP);
+}
+
+static void bw_mkqs_keys(const bw_ctx *c, bwtint_t *a, unsigned long long *k,
+			 bwtint_t n, bwtint_t depth, int sample);
+static void bw_radix(const bw_ctx *c, bwtint_t *a, unsigned long long *k,
+		     bwtint_t n, bwtint_t depth, int sample);
+
+// A big bucket is split on the first 8 bases of the keys first, in place
+// (see hh_radix() in histsortcomp.c), which takes a lot fewer passes over it
+// than the quicksort would to get that far
+static void bw_radix(const bw_ctx *c, bwtint_t *a, unsigned long long *k,
+		     bwtint_t n, bwtint_t depth, int sample) {
+  bwtint_t *lens = calloc(2 << 16, sizeof(bwtint_t)), *ptrs = lens + (1 << 16);
+  bwtint_t p, v, t;
+  unsigned long long kv, kt;
+  int b;
+  for (p = 0; p < n; ++p)
+    lens[k[p] >> 48]++;
+  for (p = 0, b = 0; b < 1 << 16; ++b) {
+    ptrs[b] = p;
+    p += lens[b];
+  }
+  for (p = 0, b = 0; b < 1 << 16; p += lens[b++]) {
+    while (ptrs[b] < p + lens[b]) {
+      v = a[ptrs[b]];
+      kv = k[ptrs[b]];
+      while ((int)(kv >> 48) != b) {
+	t = a[ptrs[kv >> 48]];
+	kt = k[ptrs[kv >> 48]];
+	a[ptrs[kv >> 48]] = v;
+	k[ptrs[kv >> 48]++] = kv;
+	v = t;
+	kv = kt;
+      }
+      a[ptrs[b]] = v;
+      k[ptrs[b]++] = kv;
+    }
+  }
+  for (b = 0; b < 1 << 16; ++b)
+    if (lens[b] > 1)
+      bw_mkqs_keys(c, a + ptrs[b] - lens[b], k + ptrs[b] - lens[b], lens[b],
+		   depth, sample);
+  free(lens);
+}
+
+// Multikey quicksort (Bentley and Sedgewick, "Fast algorithms for sorting and
+// searching strings", 1997) of the n suffixes at a, which are known to share
+// their first depth bases; k is room for their keys. Each suffix's key is
+// worked out once per level rather than once per comparison, which saves a
+// cache miss every time. Once they're the same for BW_V bases, the ranks of
+// the samples decide (or, for the sample itself, they're ties).
+static void bw_mkqs(const bw_ctx *c, bwtint_t *a, unsigned long long *k,
+		    bwtint_t n, bwtint_t depth, int sample) {
+  bwtint_t i;
+  if (n <= 1)
+    return;
+  if (depth >= BW_V) {
+    if (!sample)
+      bw_sort(c, a, n, bw_cmp_rank);
+    return;
+  }
+  for (i = 0; i < n; ++i)
+    k[i] = bw_key(c, a[i] + depth);
+  if (n >= BW_RADIX_MIN)
+    bw_radix(c, a, k, n, depth, sample);
+  else
+    bw_mkqs_keys(c, a, k, n, depth, sample);
+}
+
+static void bw_mkqs_keys(const bw_ctx *c, bwtint_t *a, unsigned long long *k,
+			 bwtint_t n, bwtint_t depth, int sample) {
+  unsigned long long pv, x, y, z, tk;
+  bwtint_t i, j, lt, gt, t;
+  while (n > 16) {
+    x = k[0];
+    y = k[n/2];
+    z = k[n-1];
+    pv = x < y ? (y < z ? y : x < z ? z : x) : (x < z ? x : y < z ? z : y);
+    // Three-way partition: [0, lt) are less than the pivot, [gt, n) more
+    for (lt = 0, i = 0, gt = n; i < gt;) {
+      if (k[i] < pv) {
+	tk = k[i]; k[i] = k[lt]; k[lt] = tk;
+	t = a[i]; a[i] = a[lt]; a[lt++] = t;
+	++i;
+      }
+      else if (k[i] > pv) {
+	--gt;
+	tk = k[i]; k[i] = k[gt]; k[gt] = tk;
+	t = a[i]; a[i] = a[gt]; a[gt] = t;
+      }
+      else
+	++i;
+    }
+    // If the pivot's suffix ended, it's the only one with its key
+    if ((pv & 63) == BW_STEP)
+      bw_mkqs(c, a + lt, k + lt, gt - lt, depth + BW_STEP, sample);
+    if (lt < n - gt) {
+      bw_mkqs_keys(c, a, k, lt, depth, sample);
+      a += gt;
+      k += gt;
+      n -= gt;
+    }
+    else {
+      bw_mkqs_keys(c, a + gt, k + gt, n - gt, depth, sample);
+      n = lt;
+    }
+  }
+  for (i = 1; i < n; ++i) {
+    t = a[i];
+    tk = k[i];
+    for (j = i; j > 0 && (tk < k[j-1] || (tk == k[j-1] &&
+		  bw_cmp_from(c, t, a[j-1], depth + BW_STEP, sample) < 0)); --j) {
+      a[j] = a[j-1];
+      k[j] = k[j-1];
+    }
+    a[j] = t;
+    k[j] = tk;
+  }
+}
+
+// How many bases the suffixes at i and j have in common, up to BW_V
+static bwtint_t bw_lcp(const bw_ctx *c, bwtint_t i, bwtint_t j) {
+  bwtint_t l, li = c->len - i, lj = c->len - j, m = li < lj ? li : lj;
+  unsigned long long x;
+  if (m > BW_V)
+    m = BW_V;
+  for (l = 0; l < m; l += 32)
+    if ((x = bw_word(c, i + l) ^ bw_word(c, j + l)))
+      return l + __builtin_clzll(x) / 2 < m ? l + __builtin_clzll(x) / 2 : m;
+  return m;
+}
+
+// Sorts pairs by key: a quicksort which splits three ways, since most of a
+// group's keys are the same when it's a tandem repeat (the same as
+// hs_sort_keys() in histsortcomp.c)
+static void bw_sort_pairs(bw_pair *p, bwtint_t n) {
+  bwtint_t i, j, lt, gt;
+  bw_pair x;
+  while (n > 16) {
+    bwtint_t a = p[0].key, b = p[n/2].key, c = p[n-1].key, v;
+    v = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+    for (lt = i = 0, gt = n; i < gt; ) {
+      if (p[i].key < v) {
+	x = p[i];
+	p[i++] = p[lt];
+	p[lt++] = x;
+      }
+      else if (p[i].key > v) {
+	x = p[i];
+	p[i] = p[--gt];
+	p[gt] = x;
+      }
+      else
+	++i;
+    }
+    if (lt < n - gt) {
+      bw_sort_pairs(p, lt);
+      p += gt;
+      n -= gt;
+    }
+    else {
+      bw_sort_pairs(p + gt, n - gt);
+      n = lt;
+    }
+  }
+  for (i = 1; i < n; ++i) {
+    x = p[i];
+    for (j = i; j > 0 && p[j-1].key > x.key; --j)
+      p[j] = p[j-1];
+    p[j] = x;
+  }
+}
+
+// Sorts the m sample suffixes at sa and works out their ranks (the row of
+// the first of any ties). They're sorted on their first BW_V bases, then
+// the ties are sorted out by prefix doubling, the same as in psort.c: the
+// suffix h bases on from a sample is in the sample too, since h is a
+// multiple of BW_V.
+static void bw_sort_sample(bw_ctx *c, bwtint_t *sa, bwtint_t m) {
+  bwtint_t *groups = NULL, *ng, i, j, g, r, h, tot;
+  size_t n = 0, nn, cap = 0, k;
+  unsigned long long *keys = malloc(m * sizeof(unsigned long long));
+  bw_pair *pairs;
+  bw_mkqs(c, sa, keys, m, 0, 1);
+  free(keys);
+  for (g = 0, i = 1; i <= m; ++i) {
+    if (i < m && !bw_cmp(c, sa[i-1], sa[i], BW_V))
+      continue;
+    for (r = g; r < i; ++r)
+      c->rank[bw_sidx(c, sa[r])] = g;
+    if (i - g > 1) {
+      if (2 * n + 2 > cap) {
+	cap = cap ? 2 * cap : 1024;
+	groups = realloc(groups, cap * sizeof(bwtint_t));
+      }
+      groups[2*n] = g;
+      groups[2*n+1] = i;
+      ++n;
+    }
+    g = i;
+  }
+  for (h = BW_V; n; h *= 2) {
+    // The keys all have to be looked up before any of the ranks change
+    for (tot = 0, k = 0; k < n; ++k)
+      tot += groups[2*k+1] - groups[2*k];
+    pairs = malloc(tot * sizeof(bw_pair));
+    for (j = 0, k = 0; k < n; ++k)
+      for (r = groups[2*k]; r < groups[2*k+1]; ++r, ++j) {
+	pairs[j].key = c->rank[bw_sidx(c, sa[r] + h)];
+	pairs[j].idx = sa[r];
+      }
+    ng = malloc(tot * sizeof(bwtint_t)); // Never more than half as many
+    for (nn = 0, j = 0, k = 0; k < n; ++k) {
+      bw_pair *q = pairs + j;
+      bwtint_t st = groups[2*k], e = groups[2*k+1];
+      bw_sort_pairs(q, e - st);
+      for (r = st; r < e; ++r)
+	sa[r] = q[r - st].idx;
+      for (g = r = st; r < e; g = r) {
+	for (++r; r < e && q[r - st].key == q[g - st].key; ++r)
+	  ;
+	if (r - g > 1) {
+	  ng[2*nn] = g;
+	  ng[2*nn+1] = r;
+	  ++nn;
+	}
+	for (i = g; i < r; ++i)
+	  c->rank[bw_sidx(c, sa[i])] = g;
+      }
+      j += e - st;
+    }
+    free(pairs);
+    free(groups);
+    groups = ng;
+    n = nn;
+    if (!n)
+      break; // (Before h can overflow)
+  }
+  free(groups);
+}
+
+// Room for a block: the blocks are only about the same size, so a bit more
+// than the average (it's made bigger if that isn't enough)
+static size_t bw_block_cap(bwtint_t len, int nblocks) {
+  return (size_t)(len / nblocks) / 4 * 5 + 1024;
+}
+
+size_t bsuff_memory(bwtint_t len, int nblocks) {
+  size_t w = sizeof(bwtint_t), m = (size_t)(len / BW_V + 1) * BW_D;
+  size_t sample, block;
+  // Sorting the sample takes the sample, its ranks and either the keys or
+  // the pairs and groups for the prefix doubling; after that there's just
+  // the ranks, the splitters and the block and its keys
+  sample = 2 * m * w + (8 > 3 * w ? 8 : 3 * w) * m;
+  block = m * w + nblocks * w + bw_block_cap(len, nblocks) * (w + 8);
+  return (sample > block ? sample : block) + sizeof(bw_ctx) +
+    (2 << 16) * w;
+}
+
+int bsuff_blocks(bwtint_t len, size_t budget) {
+  int lo = 1, hi = BSUFF_MAX_BLOCKS, mid;
+  if (bsuff_memory(len, hi) > budget)
+    return 0;
+  // More blocks never take more memory, so find the fewest which fit
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (bsuff_memory(len, mid) <= budget)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
+void bsuff_arr(const char *str, bwtint_t len, int nblocks, bsa_sink fn,
+	       void *arg) {
+  bw_ctx *c = malloc(sizeof(bw_ctx));
+  bwtint_t *sa, *split, *buf = NULL, m, p, lo, hi, row, nb;
+  unsigned long long w, lw = 0, hw = 0, *keys = NULL;
+  size_t cap = 0;
+  int k;
+  c->str = str;
+  c->len = len;
+  for (p = 0; p < BW_V; ++p)
+    c->dpos[p] = -1;
+  for (k = 0; k < BW_K; ++k) {
+    c->dpos[k] = k;
+    if (k)
+      c->dpos[k * BW_K] = BW_K - 1 + k;
+  }
+  for (p = 0; p < BW_V; ++p)
+    c->dtab[p] = p % BW_K ? BW_K - p % BW_K : 0;
+  // The sample is every position up to and including len (the '$') whose
+  // offset is in the cover
+  for (m = 0, p = 0; p <= len; ++p)
+    m += c->dpos[p % BW_V] >= 0;
+  sa = malloc(m * sizeof(bwtint_t));
+  for (m = 0, p = 0; p <= len; ++p)
+    if (c->dpos[p % BW_V] >= 0)
+      sa[m++] = p;
+  c->rank = malloc((len / BW_V + 1) * BW_D * sizeof(bwtint_t));
+  bw_sort_sample(c, sa, m);
+  // The sample is spread evenly over the suffix array (near enough), so
+  // evenly spaced samples make for blocks of about the same size
+  if (nblocks > m)
+    nblocks = m;
+  if (nblocks < 1)
+    nblocks = 1;
+  split = malloc(nblocks * sizeof(bwtint_t));
+  for (k = 1; k < nblocks; ++k)
+    split[k] = sa[(long long)k * m / nblocks];
+  free(sa);
+  cap = bw_block_cap(len, nblocks);
+  buf = malloc(cap * sizeof(bwtint_t));
+  for (row = 0, k = 0; k < nblocks; ++k) {
+    // Block k is the suffixes from split[k] (inclusive) to split[k+1]; the
+    // first 32 bases are enough to rule out nearly all the rest
+    lo = k ? split[k] : -1;
+    hi = k + 1 < nblocks ? split[k+1] : -1;
+    if (lo >= 0)
+      lw = bw_word(c, lo);
+    if (hi >= 0)
+      hw = bw_word(c, hi);
+    w = bw_word(c, 0);
+    for (nb = 0, p = 0; p <= len;
+	 w = w << 2 | (p + 32 < len ? getbase(str, p + 32) : 0), ++p) {
+      if (lo >= 0 && (w < lw || (w == lw && bw_cmp_from(c, p, lo, 0, 0) < 0)))
+	continue;
+      if (hi >= 0 && (w > hw || (w == hw && bw_cmp_from(c, p, hi, 0, 0) >= 0)))
+	continue;
+      if (nb == cap) {
+	cap += cap / 2;
+	buf = realloc(buf, cap * sizeof(bwtint_t));
+      }
+      buf[nb++] = p;
+    }
+    // Everything in the block has as much in common as the splitters do
+    keys = realloc(keys, cap * sizeof(unsigned long long));
+    bw_mkqs(c, buf, keys, nb, lo >= 0 && hi >= 0 ? bw_lcp(c, lo, hi) : 0, 0);
+    fn(arg, buf, row, nb);
+    row += nb;
+  }
+  free(keys);
+  free(buf);
+  free(split);
+  free(c->rank);
+  free(c);
+}
@@ -0,0 +1,29 @@
+#ifndef _BLOCKWISE_H
+#define _BLOCKWISE_H
+#include <stddef.h>
+#include "bwtint.h"
+
+// Called with each block of the suffix array in turn: n entries, the first
+// of which is row row
+typedef void (*bsa_sink)(void *arg, const bwtint_t *sa, bwtint_t row,
+			 bwtint_t n);
+
+// Works out the suffix array of a packed sequence of len bases (exactly what
+// csuff_arr() gives) about (len + 1) / nblocks rows at a time, and hands the
+// rows to fn in order. Only one block is ever in memory, along with a sorted
+// sample of about 1/16 of the suffixes, so this takes well under a word per
+// base; but each block takes a pass over the whole sequence to find.
+void bsuff_arr(const char *str, bwtint_t len, int nblocks, bsa_sink fn,
+	       void *arg);
+
+// Most blocks bsuff_arr() is any use with (each takes a pass over the
+// sequence, and there have to be enough samples to split it into them)
+#define BSUFF_MAX_BLOCKS 65536
+
+// About the most memory bsuff_arr() takes with nblocks blocks (not counting
+// the sequence or whatever fn does), and the fewest blocks it can use in
+// budget bytes (0 if it can't)
+size_t bsuff_memory(bwtint_t len, int nblocks);
+int bsuff_blocks(bwtint_t len, size_t budget);
+
+#endif /* _BLOCKWISE_H */
@@ -7,101 +7,197 @@
 #include "seqindex.h"
 #include "csacak.h"
 #include "fileio.h"
+#include "blockwise.h"
+
+// seqfile is either the sequence as plain text or a FASTA file; with several
+// records (chromosomes, say), they're indexed one after the other, and the
+// index keeps a table of where each one starts and its name, so that
+// single_align and search_reads can say where matches are in terms of them
+// (see fmi_contig()).
 
 // Command line switches:
-// Currently disabled pending a patch to bucket sort to avoid O(n) stack
-// depth
+// -s rate: keep every rate-th entry of the suffix array (a power of 2; the
+// default is 32). Lower rates make locating matches faster at the cost of a
+// bigger index: each sample takes about log2(sequence length) bits, so
+// for the human genome rate 4 is ~3.1GB of samples, rate 32 ~390MB and rate
+// 128 ~100MB.
+// -t: sample every rate-th position of the sequence rather than every rate-th
+// row of the suffix array. Locating a match then never takes more than rate-1
+// LF() steps (with row sampling it's rate-1 on average, but there's no limit),
+// at the cost of a bitvector of sampled rows (one more bit per base).
+// -k k: store the interval of every k-mer (k up to 14), so that searches can
+// skip their first k steps. The table has 4^k entries of about
+// log2(sequence length) + 4 bits, i.e. 3.8MB for k = 10 and a 20Mbp
+// chromosome, or 75MB for k = 12 and the human genome (and 4 times that for
+// each extra base of k).
+// -b: also index the reversed sequence, for bidirectional search
+// (extend_left() and extend_right()); this doubles the size of the
+// occurrence table.
+// -f: index the sequence followed by its reverse complement (an FMD index;
+// see fmd_seq()), so that one search finds matches on both strands and
+// single_align only has to try each read once. This doubles the size of
+// everything, but bidirectional search works without -b.
+// -l: store the LCP array (one byte per base), which lets a search that has
+// given up on a match try again from a bit further along the pattern without
+// starting all over again (see mms_shift()).
+// -j threads: build the suffix arrays with that many threads (see
+// psuff_arr()). The index is exactly the same, but building it takes about
+// three times as much memory as the default single-threaded SACA-K (which
+// needs about one word per base).
+// -h: build the suffix arrays with the (multithreaded) histogram sort rather
+// than SACA-K. This is usually faster, and takes about the same memory (one
+// word per base, plus a little for any long repeats). With -j it uses that
+// many threads rather than one per core. The index is the same either way.
+// -B blocks: don't build the suffix arrays at all, but go through them in
+// that many blocks, each sorted on its own (see bsuff_arr()), keeping just
+// the BWT and the samples. The index is the same again; building it takes
+// a few times as long, but only about a byte and a half per base at most
+// with 16 blocks (more blocks take less), where SACA-K takes a word per base
+// for the suffix array alone. -l still builds the whole suffix array.
+// -M mb: build the index in about mb megabytes (plus the sequence itself, a
+// quarter of a byte per base), for sequences too big to build any other
+// way. The suffix arrays are gone through in as few blocks as fit (as with
+// -B), and the index is built in scratch files (see fmi_set_build_tmpdir())
+// which the kernel writes out as they're filled in, then copied into the
+// index file. Can't be used with -l.
+// -T dir: where -M (or anything else) puts its scratch files; the default
+// with -M is the directory the index is going in.
 
 int main(int argc, char **argv) {
-  int mode = 0, len, i;
+  int sa_shift = SA_SHIFT, sa_mode = SA_ROWS, kmer_k = 0, bidir = 0;
+  int fmd = 0, lcp = 0, i;
+  size_t budget = 0;
+  char *tmpdir = NULL;
+  bwtint_t len;
   char *seqfile, *indexfile;
   char *seq;
+  long long *contigs;
   fm_index *fmi;
-  char c;
   
   if (argc < 3) {
-    fprintf(stderr, "Usage: %s seqfile indexfile\n", argv[0]);
+    fprintf(stderr, "Usage: %s seqfile indexfile [-s rate] [-t] [-k k] [-b] "
+	    "[-f] [-l] [-j threads] [-h] [-B blocks] [-M mb] [-T dir]\n",
+	    argv[0]);
     exit(1);
   }
   seqfile = argv[1];
   indexfile = argv[2];
-  /*
-  // Parse last argument if present
-  if (argc > 3)
-    if (argv[3][0] == '-') {
-      if (argv[3][1] == 'h')
-	mode = 1;
-      else if (argv[3][1] == 'c')
-	mode = -1;
-      else
-	printf("Invalid switch\n");
-	}*/
-  FILE *ifp, *ofp;
-  ifp = fopen(seqfile, "rb");
-  if (ifp == 0) {
-    fprintf(stderr, "Couldn't open index file\n");
-    exit(1);
+  for (i = 3; i < argc; ++i) {
+    if (!strcmp(argv[i], "-s") && i+1 < argc) {
+      int rate = atoi(argv[++i]);
+      for (sa_shift = 0; (1 << sa_shift) < rate && sa_shift < 20; ++sa_shift)
+	;
+      if (rate < 1 || (1 << sa_shift) != rate) {
+	fprintf(stderr, "SA sampling rate must be a power of 2 between 1 and "
+		"%d\n", 1 << 20);
+	exit(1);
+      }
+    }
+    else if (!strcmp(argv[i], "-t"))
+      sa_mode = SA_TEXT;
+    else if (!strcmp(argv[i], "-b"))
+      bidir = 1;
+    else if (!strcmp(argv[i], "-f"))
+      fmd = 1;
+    else if (!strcmp(argv[i], "-l"))
+      lcp = 1;
+    else if (!strcmp(argv[i], "-h"))
+      fmi_set_build_histsort(1);
+    else if (!strcmp(argv[i], "-j") && i+1 < argc) {
+      int threads = atoi(argv[++i]);
+      if (threads < 1) {
+	fprintf(stderr, "Number of threads must be at least 1\n");
+	exit(1);
+      }
+      fmi_set_build_threads(threads);
+    }
+    else if (!strcmp(argv[i], "-B") && i+1 < argc) {
+      int blocks = atoi(argv[++i]);
+      if (blocks < 1) {
+	fprintf(stderr, "Number of blocks must be at least 1\n");
+	exit(1);
+      }
+      fmi_set_build_blocks(blocks);
+    }
+    else if (!strcmp(argv[i], "-M") && i+1 < argc) {
+      long mb = atol(argv[++i]);
+      if (mb < 1) {
+	fprintf(stderr, "Memory budget must be at least 1 MB\n");
+	exit(1);
+      }
+      budget = (size_t)mb << 20;
+    }
+    else if (!strcmp(argv[i], "-T") && i+1 < argc)
+      tmpdir = argv[++i];
+    else if (!strcmp(argv[i], "-k") && i+1 < argc) {
+      kmer_k = atoi(argv[++i]);
+      if (kmer_k < 1 || kmer_k > KMER_MAX) {
+	fprintf(stderr, "k-mer length must be between 1 and %d\n", KMER_MAX);
+	exit(1);
+      }
+    }
+    else {
+      fprintf(stderr, "Invalid switch %s\n", argv[i]);
+      exit(1);
+    }
   }
-  ofp = fopen(indexfile, "w"); // wx may be better, but that's a C2011 thing
-  if (ofp == 0) {
-    fprintf(stderr, "Couldn't write to output file\n");
+  FILE *ofp;
+  seq = read_seq_contigs(seqfile, &len, &contigs);
+  if (seq == 0)
     exit(1);
-  }
-  fseek(ifp, 0L, SEEK_END);
-  len = ftell(ifp);
-  rewind(ifp);
-  seq = malloc(len/4+1);
-  for (i = 0; i < len/4 + 1; ++i) {
-    switch(fgetc(ifp)) {
-    case 'C': c = 64; break;
-    case 'G': c = 128; break;
-    case 'T': c = 192; break;
-    default: c = 0;
+  if (fmd) {
+    char *both;
+    if (len >= BWTINT_MAX / 2) {
+      fprintf(stderr, "Sequence is too long for -f in this build (rebuild "
+	      "with make LONG=1)\n");
+      exit(1);
     }
-    switch(fgetc(ifp)) {
-    case 'C': c ^= 16; break;
-    case 'G': c ^= 32; break;
-    case 'T': c ^= 48;
+    both = fmd_seq(seq, len);
+    free(seq);
+    seq = both;
+    len *= 2;
+    bidir = 0; // Not needed
+  }
+  if (budget) {
+    if (lcp) {
+      fprintf(stderr, "-l needs the whole suffix array, so it can't be used "
+	      "with -M\n");
+      exit(1);
     }
-    switch(fgetc(ifp)) {
-    case 'C': c ^= 4; break;
-    case 'G': c ^= 8; break;
-    case 'T': c ^= 12;
+    if (!bsuff_blocks(len, budget)) {
+      fprintf(stderr, "A sequence this long needs -M %zu or more\n",
+	      (bsuff_memory(len, BSUFF_MAX_BLOCKS) >> 20) + 1);
+      exit(1);
     }
-    switch(fgetc(ifp)) {
-    case 'C': c ^= 1; break;
-    case 'G': c ^= 2; break;
-    case 'T': c ^= 3;
+    fmi_set_build_budget(budget);
+    if (!tmpdir) {
+      // The index's directory
+      char *slash = strrchr(indexfile, '/');
+      tmpdir = slash ? strndup(indexfile, slash - indexfile + 1) : ".";
     }
-    seq[i] = c;
   }
-  // Handle the last character (which is at seq[len/4]
-  c = 0;
-  for (i = 0; i < len&3; ++i) {
-    switch(fgetc(ifp)) {
-    case 'C': c ^= 64 >> (2 * i); break;
-    case 'G': c ^= 128 >> (2 * i); break;
-    case 'T': c ^= 192 >> (2 * i);
-    }
-    seq[len/4] = c;
+  if (tmpdir)
+    fmi_set_build_tmpdir(tmpdir);
+  ofp = fopen(indexfile, "w"); // wx may be better, but that's a C2011 thing
+  if (ofp == 0) {
+    fprintf(stderr, "Couldn't write to output file\n");
+    exit(1);
   }
-  fclose(ifp);
 
   printf("Finished reading sequence from file\n");
-  /*
-  // Make the fmi
-  if (mode == 1)
-    fmi = make_fmi(seq, len);
-  else if (mode == -1)
-    fmi = make_fmi_sacak(seq, len);
-  else if (len > 500000000)
-    fmi = make_fmi_sacak(seq, len);
-  else
-  fmi = make_fmi(seq, len); */
-  fmi = make_fmi_sacak(seq, len);
-  write_index(fmi, ofp);
+  fmi = make_fmi_sacak(seq, len, sa_shift, sa_mode);
+  fmi->fmd = fmd;
+  fmi->contigs = contigs;
+  if (kmer_k)
+    fmi_build_kmers(fmi, kmer_k);
+  if (bidir)
+    fmi_build_rev(fmi, seq);
+  if (lcp)
+    fmi_build_lcp(fmi, seq);
+  write_index(fmi, seq, ofp);
   fclose(ofp);
   destroy_fmi(fmi);
+  free(contigs);
   free(seq);
   return 0;
 }
@@ -0,0 +1,18 @@
+#ifndef _BWTINT_H
+#define _BWTINT_H
+
+// The type used for positions on the sequence and rows of the BWT. By
+// default this is an int, which limits us to sequences of 2^31 - 2 bases (the
+// human genome only just fits); build with make LONG=1 (i.e. -DBWT_LONG) for
+// anything bigger. Even then the index itself keeps 32-bit storage wherever
+// the values fit (see rank_block and the SA samples in seqindex.h), so small
+// genomes don't get any bigger.
+#ifdef BWT_LONG
+typedef long long bwtint_t;
+#define BWTINT_MAX 0x7FFFFFFFFFFFFFFFLL
+#else
+typedef int bwtint_t;
+#define BWTINT_MAX 0x7FFFFFFF
+#endif
+
+#endif /* _BWTINT_H */
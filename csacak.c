@@ -9,11 +9,23 @@
 // A draft for this article can be retrieved from http://code.google.com/p/ge-nong/.
 
 #include <stdlib.h>
+#include "bwtint.h"
+
+// The SA entries are the same width as bwtint_t, so the 64-bit build can
+// sort sequences of more than 2^31 bases; uint_t and sint_t are the unsigned
+// and signed versions (the reduced problems use the signed one)
+#ifdef BWT_LONG
+typedef unsigned long long uint_t;
+typedef long long sint_t;
+#else
+typedef unsigned int uint_t;
+typedef int sint_t;
+#endif
 
 // set only the highest bit as 1, i.e. 1000...
-const unsigned int EMPTY=((unsigned int)1)<<(sizeof(unsigned int)*8-1); 
+const uint_t EMPTY=((uint_t)1)<<(sizeof(uint_t)*8-1); 
 
-static __inline__ unsigned char getbase(unsigned char *str, unsigned int idx) {
+static __inline__ unsigned char getbase(unsigned char *str, uint_t idx) {
   return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
 }
 
@@ -27,12 +39,12 @@ typedef char bool;
 // -- Yichi Zhang
 
 // get getbase(s,i) at a certain level
-#define chr(i) ((level==0)?(getbase((unsigned char *)s,i)):((int *)s)[i])
+#define chr(i) ((level==0)?(getbase((unsigned char *)s,i)):((sint_t *)s)[i])
 
 void getBuckets(unsigned char *s, 
-		unsigned int *bkt, unsigned int n,
-		unsigned int K, bool end) { 
-  unsigned int i, sum=0;
+		uint_t *bkt, uint_t n,
+		uint_t K, bool end) { 
+  uint_t i, sum=0;
   
   // clear all buckets .
   for(i=0; i<K; i++) bkt[i]=0; 
@@ -46,10 +58,10 @@ void getBuckets(unsigned char *s,
   }
 }
 
-void putSuffix0(unsigned int *SA, 
-		unsigned char *s, unsigned int *bkt, 
-		unsigned int n, unsigned int K, int n1) {
-  unsigned int i, j;
+void putSuffix0(uint_t *SA, 
+		unsigned char *s, uint_t *bkt, 
+		uint_t n, uint_t K, sint_t n1) {
+  uint_t i, j;
   
   // find the end of each bucket.
   getBuckets(s, bkt, n, K, true);
@@ -62,10 +74,10 @@ void putSuffix0(unsigned int *SA,
   SA[0]=n-1; // set the single sentinel suffix.
 }
 
-void induceSAl0(unsigned int *SA,
-		unsigned char *s, unsigned int *bkt,
-		unsigned int n, unsigned int K, bool suffix) {
-  unsigned int i, j;
+void induceSAl0(uint_t *SA,
+		unsigned char *s, uint_t *bkt,
+		uint_t n, uint_t K, bool suffix) {
+  uint_t i, j;
 
   // find the head of each bucket.
   getBuckets(s, bkt, n, K, false);
@@ -82,10 +94,10 @@ void induceSAl0(unsigned int *SA,
     }
 }
 
-void induceSAs0(unsigned int *SA,
-		unsigned char *s, unsigned int *bkt,
-		unsigned int n, unsigned int K, bool suffix) {
-  unsigned int i, j;
+void induceSAs0(uint_t *SA,
+		unsigned char *s, uint_t *bkt,
+		uint_t n, uint_t K, bool suffix) {
+  uint_t i, j;
 
   // find the end of each bucket.
   getBuckets(s, bkt, n, K, true);
@@ -101,10 +113,10 @@ void induceSAs0(unsigned int *SA,
     }
 }
 
-void putSubstr0(unsigned int *SA,
-		unsigned char *s, unsigned int *bkt,
-		unsigned int n, unsigned int K) {
-  unsigned int i, cur_t, succ_t;
+void putSubstr0(uint_t *SA,
+		unsigned char *s, uint_t *bkt,
+		uint_t n, uint_t K) {
+  uint_t i, cur_t, succ_t;
 
   // find the end of each bucket.
   getBuckets(s, bkt, n, K, true);
@@ -125,8 +137,8 @@ void putSubstr0(unsigned int *SA,
   SA[0]=n-1;
 }
 
-void putSuffix1(int *SA, int *s, int n1) {
-  int i, j, pos, cur, pre=-1;
+void putSuffix1(sint_t *SA, sint_t *s, sint_t n1) {
+  sint_t i, j, pos, cur, pre=-1;
   
   for(i=n1-1; i>0; i--) {
     j=SA[i]; SA[i]=EMPTY;
@@ -138,26 +150,26 @@ void putSuffix1(int *SA, int *s, int n1) {
   }
 }
 
-void induceSAl1(int *SA, int *s, 
-		int n, bool suffix) {
-  int h, i, j, step=1;
+void induceSAl1(sint_t *SA, sint_t *s, 
+		sint_t n, bool suffix) {
+  sint_t h, i, j, step=1;
   
   for(i=0; i<n; i+=step) {
     step=1; j=SA[i]-1;
     if(SA[i]<=0) continue;
-    int c=s[j], c1=s[j+1];
+    sint_t c=s[j], c1=s[j+1];
     bool isL=c>=c1;
     if(!isL) continue;
 
     // getbase(s,j) is L-type.
 
-    int d=SA[c];
+    sint_t d=SA[c];
     if(d>=0) {
       // SA[c] is borrowed by the left
       //   neighbor bucket.
       // shift-left the items in the
       //   left neighbor bucket.
-      int foo, bar;
+      sint_t foo, bar;
       foo=SA[c];
       for(h=c-1; SA[h]>=0||SA[h]==EMPTY; h--)
       { bar=SA[h]; SA[h]=foo; foo=bar; }
@@ -176,7 +188,7 @@ void induceSAl1(int *SA, int *s,
         SA[c]=j; // a size-1 bucket.
     }
     else { // SA[c] is reused as a counter.
-        int pos=c-d+1;
+        sint_t pos=c-d+1;
         if(pos>n-1 || SA[pos]!=EMPTY) {
           // we are running into the right
           //   neighbor bucket.
@@ -193,10 +205,10 @@ void induceSAl1(int *SA, int *s,
         SA[pos]=j;
     }
 
-    int c2;
+    sint_t c2;
     bool isL1=(j+1<n-1) && (c1>(c2=s[j+2]) || (c1==c2 && c1<i));  // is s[SA[i]] L-type?
     if((!suffix || !isL1) && i>0) {
-      int i1=(step==0)?i-1:i;
+      sint_t i1=(step==0)?i-1:i;
       SA[i1]=EMPTY;
     }
   }
@@ -213,26 +225,26 @@ void induceSAl1(int *SA, int *s,
   }
 }
 
-void induceSAs1(int *SA, int *s, 
-		int n, bool suffix) {
-  int h, i, j, step=1;
+void induceSAs1(sint_t *SA, sint_t *s, 
+		sint_t n, bool suffix) {
+  sint_t h, i, j, step=1;
   
   for(i=n-1; i>0; i-=step) {
     step=1; j=SA[i]-1;
     if(SA[i]<=0) continue;
-    int c=s[j], c1=s[j+1];
+    sint_t c=s[j], c1=s[j+1];
     bool isS=(c<c1) || (c==c1 && c>i);
     if(!isS) continue;
 
     // getbase(s,j) is S-type
 
-    int d=SA[c];
+    sint_t d=SA[c];
     if(d>=0) {
       // SA[c] is borrowed by the right
       //   neighbor bucket.
       // shift-right the items in the
       //   right neighbor bucket.
-      int foo, bar;
+      sint_t foo, bar;
       foo=SA[c];
       for(h=c+1; SA[h]>=0||SA[h]==EMPTY; h++)
       { bar=SA[h]; SA[h]=foo; foo=bar; }
@@ -251,7 +263,7 @@ void induceSAs1(int *SA, int *s,
         SA[c]=j; // a size-1 bucket.
     }
     else { // SA[c] is reused as a counter.
-        int pos=c+d-1;
+        sint_t pos=c+d-1;
         if(SA[pos]!=EMPTY) {
           // we are running into the left
           //   neighbor bucket.
@@ -269,7 +281,7 @@ void induceSAs1(int *SA, int *s,
     }
 
     if(!suffix) {
-      int i1=(step==0)?i+1:i;
+      sint_t i1=(step==0)?i+1:i;
       SA[i1]=EMPTY;
     }
   }
@@ -287,12 +299,12 @@ void induceSAs1(int *SA, int *s,
     }
 }
 
-void putSubstr1(int *SA, int *s, int n) {
-  int h, i, j;
+void putSubstr1(sint_t *SA, sint_t *s, sint_t n) {
+  sint_t h, i, j;
 
   for(i=0; i<n; i++) SA[i]=EMPTY;
 
-  int c, c1, t, t1;
+  sint_t c, c1, t, t1;
   c1=s[n-2];
   t1=0; 
   for(i=n-2; i>0; i--) {
@@ -305,7 +317,7 @@ void putSubstr1(int *SA, int *s, int n) {
         //   neighbor bucket.
         // shift-right the items in the
         //   right neighbor bucket.
-        int foo, bar;
+        sint_t foo, bar;
         foo=SA[c];
         for(h=c+1; SA[h]>=0; h++)
         { bar=SA[h]; SA[h]=foo; foo=bar; }
@@ -314,7 +326,7 @@ void putSubstr1(int *SA, int *s, int n) {
         SA[c]=EMPTY;
       }
 
-      int d=SA[c];
+      sint_t d=SA[c];
       if(d==EMPTY) { // SA[c] is empty.
         if(SA[c-1]==EMPTY) {
           SA[c]=-1; // init the counter.
@@ -324,7 +336,7 @@ void putSubstr1(int *SA, int *s, int n) {
           SA[c]=i; // a size-1 bucket.
       }
       else { // SA[c] is reused as a counter
-          int pos=c+d-1;
+          sint_t pos=c+d-1;
           if(SA[pos]!=EMPTY) {
             // we are running into the left
             //   neighbor bucket.
@@ -357,11 +369,11 @@ void putSubstr1(int *SA, int *s, int n) {
   SA[0]=n-1;
 }
 
-unsigned int getLengthOfLMS(unsigned char *s, 
-			    unsigned int n, int level, unsigned int x) {
+uint_t getLengthOfLMS(unsigned char *s, 
+			    uint_t n, int level, uint_t x) {
   if(x==n-1) return 1;  
   
-  unsigned int dist, i=1;  
+  uint_t dist, i=1;  
   while(1) {
     if(chr(x+i)<chr(x+i-1)) break;
     i++;
@@ -375,25 +387,25 @@ unsigned int getLengthOfLMS(unsigned char *s,
   return dist+1;
 }
 
-unsigned int nameSubstr(unsigned int *SA, 
-			unsigned char *s, unsigned int *s1, unsigned int n, 
-			unsigned int m, unsigned int n1, int level) {
-  unsigned int i, j, cur_t, succ_t;
+uint_t nameSubstr(uint_t *SA, 
+			unsigned char *s, uint_t *s1, uint_t n, 
+			uint_t m, uint_t n1, int level) {
+  uint_t i, j, cur_t, succ_t;
 
   // init the name array buffer
   for(i=n1; i<n; i++) SA[i]=EMPTY;
 
   // scan to compute the interim s1
-  unsigned int name, name_ctr=0;
-  unsigned int pre_pos, pre_len=0;
+  uint_t name, name_ctr=0;
+  uint_t pre_pos, pre_len=0;
   for(i=0; i<n1; i++) {
     bool diff=false;
-    unsigned int len, pos=SA[i];
+    uint_t len, pos=SA[i];
 
     len=getLengthOfLMS(s, n, level, pos);
     if(len!=pre_len) diff=true;
     else
-      for(unsigned int d=0; d<len; d++)
+      for(uint_t d=0; d<len; d++)
         if(pos+d==n-1 || pre_pos+d==n-1 ||
            chr(pos+d)!=chr(pre_pos+d)) {
           diff=true; break;
@@ -420,7 +432,7 @@ unsigned int nameSubstr(unsigned int *SA,
   //   to produce the final s1.
   succ_t=1;
   for(i=n1-1; i>0; i--) {
-    int ch=s1[i], ch1=s1[i-1];
+    sint_t ch=s1[i], ch1=s1[i-1];
     cur_t=(ch1< ch || (ch1==ch && succ_t==1))?1:0;
     if(cur_t==1) {
       s1[i-1]+=SA[s1[i-1]]-1;
@@ -431,11 +443,11 @@ unsigned int nameSubstr(unsigned int *SA,
   return name_ctr;
 }
 
-void getSAlms(unsigned int *SA, 
+void getSAlms(uint_t *SA, 
   unsigned char *s, 
-  unsigned int *s1, unsigned int n, 
-  unsigned int n1, int level ) {
-  unsigned int i, j, cur_t, succ_t;
+  uint_t *s1, uint_t n, 
+  uint_t n1, int level ) {
+  uint_t i, j, cur_t, succ_t;
 
   j=n1-1; s1[j--]=n-1;
   succ_t=0; // getbase(s,n-2) must be L-type
@@ -453,24 +465,24 @@ void getSAlms(unsigned int *SA,
 }
 
 
-void SACA_K(unsigned char *s, unsigned int *SA,
-	    unsigned int n, unsigned int K,
-	    unsigned int m, int level) {
-  unsigned int i;
-  unsigned int *bkt=NULL;
+void SACA_K(unsigned char *s, uint_t *SA,
+	    uint_t n, uint_t K,
+	    uint_t m, int level) {
+  uint_t i;
+  uint_t *bkt=NULL;
 
   // stage 1: reduce the problem by at least 1/2.
 
   if(level==0) {
-    bkt=(unsigned int *)malloc(sizeof(int)*K);
+    bkt=(uint_t *)malloc(sizeof(uint_t)*K);
     putSubstr0(SA, s, bkt, n, K);
     induceSAl0(SA, s, bkt, n, K, false);
     induceSAs0(SA, s, bkt, n, K, false);
   }
   else {
-    putSubstr1((int *)SA, (int *)s,(int)n);
-    induceSAl1((int *)SA, (int *)s, n ,false);
-    induceSAs1((int *)SA, (int *)s, n, false);
+    putSubstr1((sint_t *)SA, (sint_t *)s,(sint_t)n);
+    induceSAl1((sint_t *)SA, (sint_t *)s, n ,false);
+    induceSAs1((sint_t *)SA, (sint_t *)s, n, false);
   }
 
   // now, all the LMS-substrings are sorted and 
@@ -479,13 +491,13 @@ void SACA_K(unsigned char *s, unsigned int *SA,
   // compact all the sorted substrings into
   //   the first n1 items of SA.
   // 2*n1 must be not larger than n.
-  unsigned int n1=0;
+  uint_t n1=0;
   for(i=0; i<n; i++) 
-    if((!level&&SA[i]>0) || (level&&((int *)SA)[i]>0))
+    if((!level&&SA[i]>0) || (level&&((sint_t *)SA)[i]>0))
       SA[n1++]=SA[i];
 
-  unsigned int *SA1=SA, *s1=SA+m-n1;
-  unsigned int name_ctr;
+  uint_t *SA1=SA, *s1=SA+m-n1;
+  uint_t name_ctr;
   name_ctr=nameSubstr(SA,s,s1,n,m,n1,level);
 
   // stage 2: solve the reduced problem.
@@ -507,22 +519,21 @@ void SACA_K(unsigned char *s, unsigned int *SA,
     free(bkt);
   }
   else {
-    putSuffix1((int *)SA, (int *)s, n1);
-    induceSAl1((int *)SA, (int *)s, n, true);
-    induceSAs1((int *)SA, (int *)s, n, true);
+    putSuffix1((sint_t *)SA, (sint_t *)s, n1);
+    induceSAl1((sint_t *)SA, (sint_t *)s, n, true);
+    induceSAs1((sint_t *)SA, (sint_t *)s, n, true);
   }
 }
 
 
-// TODO: Replace int with long long a lot (via defines?)
 // This function is a drop-in replacement for histsort() (except
 // that it expects a 0 bp after the sequence :]), which, while
 // slower for len<10^9, also uses a lot less memory
-unsigned int *csuff_arr(const char *seq, unsigned int len) {
+bwtint_t *csuff_arr(const char *seq, bwtint_t len) {
   // seq is assumed to be given in compressed form form and be
   // null-terminated (having an internal zero byte is fine)
   // Testing, ahoy!
-  unsigned int *SA = malloc((len+1) * sizeof(int));
+  uint_t *SA = malloc((len+1) * sizeof(uint_t));
   SACA_K((unsigned char *)seq, SA, len+1, 4 /* Not 256*/, len+1, 0);
-  return SA;
+  return (bwtint_t *)SA;
 }
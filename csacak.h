@@ -1,6 +1,8 @@
 #ifndef _CSACAK_H
 #define _CSACAK_H
-unsigned int *csuff_arr(const char *, unsigned int);
+#include "bwtint.h"
+
+bwtint_t *csuff_arr(const char *, bwtint_t);
 // Other functions not declared here, because we're never going to want to use
 // them outside the suffix array construction :)
 // Also because there are two copies of them floating around and we don't
@@ -1,65 +1,425 @@
 // Functions to write an index to file and read it back
-// Does not actually store the original sequence; that seems pointless
+
+// The index file is laid out so that it can be mmap()ed and used as is: a
+// header, then a table of sections, then the sections themselves (each one
+// starting on a page boundary). The sections are exactly the arrays an
+// fm_index points to (the occurrence table, its superblock counts, the SA
+// samples, the bitvector of sampled rows if the samples are by text position
+// and, optionally, the k-mer table, the occurrence table of the index of the
+// reversed sequence, the LCP array, the contig table and the packed
+// reference), so loading an index is just a matter of pointing at the right
+// places in the mapping; nothing is copied or rebuilt, and every process
+// using the same index shares the same pages of the page cache.
+// The file is in the machine's byte order (this code isn't exactly portable
+// to anything but x86 anyway).
 
 #include "seqindex.h"
+#include "fileio.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define INDEX_MAGIC "BWTFMIDX"
+#define INDEX_VERSION 7
+#define INDEX_ALIGN 4096
+
+enum { SEC_OCC = 1, SEC_OCC_SUPER, SEC_SA, SEC_REF, SEC_SA_MARK, SEC_KMER,
+       SEC_REV_OCC, SEC_REV_OCC_SUPER, SEC_LCP, SEC_CONTIGS, SEC_MAX };
+
+struct index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nsections;
+  int64_t len;
+  int64_t endloc;
+  int64_t C[5];
+  uint32_t occ_shift;
+  uint32_t super_shift;
+  uint32_t sa_shift; // The SA sampling rate is 1 << sa_shift
+  uint32_t sa_bits;
+  uint32_t sa_mode; // SA_ROWS or SA_TEXT
+  uint32_t kmer_k; // 0 if there's no k-mer table
+  uint32_t kmer_bits;
+  uint32_t has_rev; // 1 if there's an index of the reversed sequence
+  uint32_t fmd; // 1 if the sequence is followed by its reverse complement
+  uint32_t pad;
+  int64_t rev_endloc;
+  int64_t rev_C[5];
+};
+
+struct index_section {
+  uint32_t id;
+  uint32_t pad;
+  uint64_t offset;
+  uint64_t size;
+};
+
+// Pads the file out with zeros from pos to off
+static void pad_to(FILE *f, uint64_t *pos, uint64_t off) {
+  for (; *pos < off; ++*pos)
+    fputc(0, f);
+}
 
-void write_index(const fm_index *fmi, FILE *f) {
+void write_index(const fm_index *fmi, const char *seq, FILE *f) {
   // Writes the FM-index to file... well, the parts that take
-  // time to actually generate.
-  fwrite(&fmi->len, sizeof(int), 1, f);
-  fwrite(fmi->C, sizeof(int), 5, f);
-  fwrite(&fmi->endloc, sizeof(int), 1, f);
-  fwrite(fmi->idxs, sizeof(int), (1+(fmi->len)/32), f);
-  fwrite(fmi->bwt, 1, (fmi->len+3)/4, f);
-  // C standard guarantees sizeof(char) to be 1
-  return;
+  // time to actually generate (and the sequence, if we're given one)
+  struct index_header h;
+  struct index_section secs[SEC_MAX];
+  const void *data[SEC_MAX];
+  char *zeros = NULL;
+  uint64_t pos, off;
+  int n = 0, i;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, INDEX_MAGIC, 8);
+  h.version = INDEX_VERSION;
+  h.len = fmi->len;
+  h.endloc = fmi->endloc;
+  for (i = 0; i < 5; ++i)
+    h.C[i] = fmi->C[i];
+  h.occ_shift = fmi->occ_shift;
+  h.super_shift = OCC_SUPER_SHIFT;
+  h.sa_shift = fmi->sa_shift;
+  h.sa_bits = fmi->sa_bits;
+  h.sa_mode = fmi->sa_mode;
+  h.kmer_k = fmi->kmer_k;
+  h.kmer_bits = fmi->kmer_bits;
+  h.fmd = fmi->fmd;
+  if (fmi->rev) {
+    h.has_rev = 1;
+    h.rev_endloc = fmi->rev->endloc;
+    for (i = 0; i < 5; ++i)
+      h.rev_C[i] = fmi->rev->C[i];
+  }
+
+  // The superblock counts are all zero if this isn't a BWT_LONG build
+  zeros = calloc(1, occ_super_size(fmi->len));
+  secs[n].id = SEC_OCC;
+  secs[n].size = occ_size(fmi->len, fmi->occ_shift);
+  data[n++] = fmi->occ;
+  secs[n].id = SEC_OCC_SUPER;
+  secs[n].size = occ_super_size(fmi->len);
+  data[n++] = fmi->occ_super ? (const void *)fmi->occ_super : zeros;
+  secs[n].id = SEC_SA;
+  secs[n].size = sa_size(fmi->len, fmi->sa_shift, fmi->sa_bits);
+  data[n++] = fmi->idxs;
+  if (fmi->sa_mode == SA_TEXT) {
+    secs[n].id = SEC_SA_MARK;
+    secs[n].size = sa_mark_size(fmi->len);
+    data[n++] = fmi->sa_mark;
+  }
+  if (fmi->kmer_k) {
+    secs[n].id = SEC_KMER;
+    secs[n].size = kmer_size(fmi->len, fmi->kmer_k);
+    data[n++] = fmi->kmer;
+  }
+  if (fmi->rev) {
+    secs[n].id = SEC_REV_OCC;
+    secs[n].size = occ_size(fmi->len, fmi->occ_shift);
+    data[n++] = fmi->rev->occ;
+    secs[n].id = SEC_REV_OCC_SUPER;
+    secs[n].size = occ_super_size(fmi->len);
+    data[n++] = fmi->rev->occ_super ? (const void *)fmi->rev->occ_super :
+      zeros;
+  }
+  if (fmi->lcp) {
+    secs[n].id = SEC_LCP;
+    secs[n].size = lcp_size(fmi->len);
+    data[n++] = fmi->lcp;
+  }
+  if (fmi->contigs) {
+    secs[n].id = SEC_CONTIGS;
+    secs[n].size = contig_size(fmi->contigs);
+    data[n++] = fmi->contigs;
+  }
+  if (seq) {
+    secs[n].id = SEC_REF;
+    secs[n].size = (fmi->len+3)/4;
+    data[n++] = seq;
+  }
+  h.nsections = n;
+
+  off = sizeof(h) + n * sizeof(struct index_section);
+  for (i = 0; i < n; ++i) {
+    off = (off + INDEX_ALIGN - 1) & ~(uint64_t)(INDEX_ALIGN - 1);
+    secs[i].pad = 0;
+    secs[i].offset = off;
+    off += secs[i].size;
+  }
+  fwrite(&h, sizeof(h), 1, f);
+  fwrite(secs, sizeof(struct index_section), n, f);
+  pos = sizeof(h) + n * sizeof(struct index_section);
+  for (i = 0; i < n; ++i) {
+    pad_to(f, &pos, secs[i].offset);
+    fwrite(data[i], 1, secs[i].size, f);
+    pos += secs[i].size;
+  }
+  free(zeros);
+}
+
+// Checks that a contig table of size bytes makes sense for a sequence of len
+// bases (so that fmi_contig() and fmi_contig_name() can trust it)
+static int contigs_ok(const long long *t, uint64_t size, long long len) {
+  long long i, n;
+  const char *names;
+  if (size < 3 * sizeof(long long))
+    return 0;
+  n = t[0];
+  if (n < 1 || (uint64_t)n > (size / sizeof(long long) - 3) / 2 ||
+      t[2 * n + 2] < 1 ||
+      size != (2 * n + 3) * sizeof(long long) + (uint64_t)t[2 * n + 2] ||
+      t[1] != 0 || t[n + 1] != len)
+    return 0;
+  names = (const char *)(t + 2 * n + 3);
+  for (i = 0; i < n; ++i)
+    if (t[i + 2] < t[i + 1] || t[n + 2 + i] < 0 ||
+	t[n + 2 + i] >= t[2 * n + 2])
+      return 0;
+  return !names[t[2 * n + 2] - 1];
 }
 
-// Reads the BWT from file and reconstructs the FM-index
-// Returns a newly allocated FM-index.
-// Doesn't check for running out of memory; expect segfaults if that happens.
-// If it returns NULL, reading from file failed
+// Maps the index file open as f and points a new FM-index at its sections
+// Returns NULL (after printing something) if the file isn't a valid index
+// for this build.
 fm_index *read_index(const char *seq, FILE *f) {
-  int sz;
-  int err = 0;
+  struct index_header h;
+  struct index_section secs[SEC_MAX];
+  const char *sec[SEC_MAX] = {0};
+  uint64_t secsize[SEC_MAX] = {0};
+  struct stat st;
+  void *map;
+  fm_index *fmi;
+  int i;
 
-  fm_index *fmi = calloc(1, sizeof(fm_index));
-  sz = fread(&fmi->len, sizeof(int), 1, f);
-  if (sz != 1) {
-    fprintf(stderr, "Error reading index from file\n");
-    err = 1;
-  }
-  sz = fread(fmi->C, sizeof(int), 5, f);
-  if (sz != 5) {
-    fprintf(stderr, "Error reading index from file\n");
-    err = 1;
+  if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, INDEX_MAGIC, 8)) {
+    fprintf(stderr, "Not an index file (or one from an older version; "
+	    "rebuild it with build_index)\n");
+    return NULL;
   }
-  sz = fread(&fmi->endloc, sizeof(int), 1, f);
-  if (sz != 1) {
-    fprintf(stderr, "Error reading index from file\n");
-    err = 1;
+  if (h.version != INDEX_VERSION) {
+    fprintf(stderr, "Index file is version %u, but this program reads "
+	    "version %d\n", h.version, INDEX_VERSION);
+    return NULL;
   }
-  fmi->idxs = malloc((1+(fmi->len)/32) * sizeof(int));
-  sz = fread(fmi->idxs, sizeof(int), 1+(fmi->len)/32, f);
-  if (sz != 1 + (fmi->len)/32) {
-    fprintf(stderr, "Error reading index from file\n");
-    err = 1;
+  if (h.len < 0 || h.len >= BWTINT_MAX) {
+    fprintf(stderr, "Index is for a sequence of %lld bases, which is too long "
+	    "for this build (rebuild with make LONG=1)\n", (long long)h.len);
+    return NULL;
   }
-  fmi->bwt = malloc((fmi->len+3)/4);
-  sz = fread(fmi->bwt, 1, (fmi->len+3)/4, f);
-  if (sz != (fmi->len+3)/4) {
+  if (h.super_shift != OCC_SUPER_SHIFT || h.occ_shift < 6 ||
+      h.occ_shift > 12 || h.sa_shift > 20 || h.sa_mode > SA_TEXT ||
+      h.sa_bits != sa_bits(h.sa_mode == SA_TEXT ? h.len >> h.sa_shift :
+			   h.len) || h.kmer_k > KMER_MAX ||
+      (h.kmer_k && h.kmer_bits != kmer_bits(h.len)) ||
+      h.fmd > 1 || (h.fmd && h.len % 2) ||
+      h.nsections > SEC_MAX ||
+      fread(secs, sizeof(struct index_section), h.nsections, f) !=
+      h.nsections || fstat(fileno(f), &st)) {
     fprintf(stderr, "Error reading index from file\n");
-    err = 1;
+    return NULL;
   }
 
-  if (err) {
-    destroy_fmi(fmi);
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+  if (map == MAP_FAILED) {
+    perror("Could not map index file");
     return NULL;
   }
-  
-  fmi->lookup = lookup_table();
-  fmi->rank_index = seq_index(fmi->bwt, fmi->len, 16, fmi->lookup);
+  // We're going to want most of it
+  madvise(map, st.st_size, MADV_WILLNEED);
+  for (i = 0; i < (int)h.nsections; ++i) {
+    if (secs[i].id >= SEC_MAX || secs[i].offset % INDEX_ALIGN ||
+	secs[i].offset > (uint64_t)st.st_size ||
+	secs[i].size > (uint64_t)st.st_size - secs[i].offset)
+      continue; // Ignore anything we don't know about
+    sec[secs[i].id] = (const char *)map + secs[i].offset;
+    secsize[secs[i].id] = secs[i].size;
+  }
+  if (secsize[SEC_OCC] != occ_size(h.len, h.occ_shift) ||
+      secsize[SEC_OCC_SUPER] != occ_super_size(h.len) ||
+      secsize[SEC_SA] != sa_size(h.len, h.sa_shift, h.sa_bits) ||
+      (h.sa_mode == SA_TEXT && secsize[SEC_SA_MARK] != sa_mark_size(h.len)) ||
+      (h.kmer_k && secsize[SEC_KMER] != kmer_size(h.len, h.kmer_k)) ||
+      (h.has_rev && (secsize[SEC_REV_OCC] != occ_size(h.len, h.occ_shift) ||
+		     secsize[SEC_REV_OCC_SUPER] != occ_super_size(h.len))) ||
+      (sec[SEC_LCP] && secsize[SEC_LCP] != lcp_size(h.len)) ||
+      (sec[SEC_REF] && secsize[SEC_REF] != (uint64_t)(h.len+3)/4) ||
+      (sec[SEC_CONTIGS] &&
+       !contigs_ok((const long long *)sec[SEC_CONTIGS], secsize[SEC_CONTIGS],
+		   h.fmd ? h.len / 2 : h.len))) {
+    fprintf(stderr, "Index file is truncated or corrupt\n");
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  fmi = calloc(1, sizeof(fm_index));
+  fmi->map = map;
+  fmi->map_len = st.st_size;
+  fmi->len = h.len;
+  fmi->endloc = h.endloc;
+  for (i = 0; i < 5; ++i)
+    fmi->C[i] = h.C[i];
+  fmi->occ_shift = h.occ_shift;
+  fmi->occ = (rank_block *)sec[SEC_OCC];
+#ifdef BWT_LONG
+  fmi->occ_super = (bwtint_t *)sec[SEC_OCC_SUPER];
+#endif
+  fmi->sa_shift = h.sa_shift;
+  fmi->sa_bits = h.sa_bits;
+  fmi->sa_mode = h.sa_mode;
+  if (h.sa_mode == SA_TEXT)
+    fmi->sa_mark = (unsigned long long *)sec[SEC_SA_MARK];
+  fmi->kmer_k = h.kmer_k;
+  fmi->kmer_bits = h.kmer_bits;
+  fmi->kmer = (unsigned long long *)sec[SEC_KMER];
+  fmi->idxs = (unsigned long long *)sec[SEC_SA];
+  fmi->ref = sec[SEC_REF];
+  fmi->contigs = (const long long *)sec[SEC_CONTIGS];
+  fmi->lcp = (unsigned char *)sec[SEC_LCP];
+  fmi->fmd = h.fmd;
+  if (h.has_rev) {
+    // This one's freed along with fmi
+    fm_index *rev = fmi->rev = calloc(1, sizeof(fm_index));
+    rev->len = h.len;
+    rev->endloc = h.rev_endloc;
+    for (i = 0; i < 5; ++i)
+      rev->C[i] = h.rev_C[i];
+    rev->occ_shift = h.occ_shift;
+    rev->occ = (rank_block *)sec[SEC_REV_OCC];
+#ifdef BWT_LONG
+    rev->occ_super = (bwtint_t *)sec[SEC_REV_OCC_SUPER];
+#endif
+  }
   return fmi;
 }
+
+// Where a contig table is put together while a FASTA file is read
+typedef struct {
+  long long n, cap;
+  long long *start, *name;
+  char *names;
+  size_t names_len, names_cap;
+} contig_list;
+
+static void contig_add(contig_list *l, long long start, FILE *fp) {
+  int c;
+  if (l->n == l->cap) {
+    l->cap = l->cap ? 2 * l->cap : 64;
+    l->start = realloc(l->start, l->cap * sizeof(long long));
+    l->name = realloc(l->name, l->cap * sizeof(long long));
+  }
+  l->start[l->n] = start;
+  l->name[l->n++] = l->names_len;
+  // The name is the header up to the first space; the rest is skipped
+  for (c = fgetc(fp); c != EOF && c != '\n'; c = fgetc(fp)) {
+    if (isspace(c))
+      break;
+    if (l->names_len + 1 >= l->names_cap) {
+      l->names_cap = l->names_cap ? 2 * l->names_cap : 1024;
+      l->names = realloc(l->names, l->names_cap);
+    }
+    l->names[l->names_len++] = c;
+  }
+  while (c != EOF && c != '\n')
+    c = fgetc(fp);
+  if (l->names_len + 1 >= l->names_cap) {
+    l->names_cap = l->names_cap ? 2 * l->names_cap : 1024;
+    l->names = realloc(l->names, l->names_cap);
+  }
+  l->names[l->names_len++] = 0;
+}
+
+// Packs the list into a table laid out as seqindex.h describes
+// (fm_index.contigs), and frees it
+static long long *contig_table(contig_list *l, long long len) {
+  long long i, n = l->n;
+  long long *t = malloc((2 * n + 3) * sizeof(long long) + l->names_len);
+  t[0] = n;
+  for (i = 0; i < n; ++i) {
+    t[1 + i] = l->start[i];
+    t[n + 2 + i] = l->name[i];
+  }
+  t[n + 1] = len;
+  t[2 * n + 2] = l->names_len;
+  memcpy(t + 2 * n + 3, l->names, l->names_len);
+  free(l->start);
+  free(l->name);
+  free(l->names);
+  return t;
+}
+
+// Reads a sequence from a text file and packs it 4 bases to a byte
+// (anything which isn't C, G or T is taken to be an A); the length goes in
+// len. A file starting with '>' is taken to be FASTA: the header lines and
+// the line breaks aren't part of the sequence, lowercase (soft-masked) bases
+// count the same as uppercase ones, and the
+// records are just put one after the other, with *contigs (if contigs isn't
+// NULL) set to a table of where each one starts (see fm_index.contigs); for
+// anything else it's NULL. Returns NULL if the file can't be read or is too
+// long for this build.
+char *read_seq_contigs(const char *filename, bwtint_t *len,
+		       long long **contigs) {
+  FILE *fp = fopen(filename, "rb");
+  contig_list l = {0};
+  long flen;
+  bwtint_t i = 0;
+  char *seq;
+  int c, fasta, bol = 1;
+  if (contigs)
+    *contigs = NULL;
+  if (fp == 0) {
+    fprintf(stderr, "Could not open sequence\n");
+    return NULL;
+  }
+  fseek(fp, 0L, SEEK_END);
+  flen = ftell(fp);
+  rewind(fp);
+  if (flen >= BWTINT_MAX) {
+    fprintf(stderr, "Sequence is too long for this build (rebuild with "
+	    "make LONG=1)\n");
+    fclose(fp);
+    return NULL;
+  }
+  fasta = (c = fgetc(fp)) == '>';
+  ungetc(c, fp);
+  // One byte of slack, since csuff_arr() wants a 0 after the sequence
+  seq = calloc(flen/4+1, 1);
+  while ((c = fgetc(fp)) != EOF) {
+    if (fasta) {
+      if (c == '>' && bol) {
+	contig_add(&l, i, fp);
+	continue;
+      }
+      bol = c == '\n';
+      if (isspace(c))
+	continue;
+    }
+    switch(fasta ? toupper(c) : c) {
+    case 'C': c = 1; break;
+    case 'G': c = 2; break;
+    case 'T': c = 3; break;
+    default: c = 0;
+    }
+    seq[i>>2] |= c << (2*(3-(i&3)));
+    ++i;
+  }
+  fclose(fp);
+  *len = i;
+  if (fasta) {
+    if (contigs)
+      *contigs = contig_table(&l, i);
+    else {
+      free(l.start);
+      free(l.name);
+      free(l.names);
+    }
+  }
+  return seq;
+}
+
+char *read_seq(const char *filename, bwtint_t *len) {
+  return read_seq_contigs(filename, len, NULL);
+}
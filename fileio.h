@@ -1,8 +1,23 @@
 #ifndef _FILEIO_H
 #define _FILEIO_H
 
-void write_index(const fm_index *fmi, FILE *f);
+#include <stdio.h>
+#include "seqindex.h"
 
+// Writes the index to f; if seq isn't NULL the (packed) sequence is stored
+// along with it, so that it doesn't need to be read in separately
+void write_index(const fm_index *fmi, const char *seq, FILE *f);
+
+// Maps an index written by write_index(); the file can be closed afterwards.
+// seq is unused (fmi->ref is the stored sequence, if there is one)
 fm_index *read_index(const char *seq, FILE *f);
 
+// Reads and packs a sequence from a text file, as described in README.md
+char *read_seq(const char *filename, bwtint_t *len);
+
+// The same, but if the file is FASTA *contigs gets a table of its records
+// for fm_index.contigs (malloc()ed; NULL for a plain sequence)
+char *read_seq_contigs(const char *filename, bwtint_t *len,
+		       long long **contigs);
+
 #endif /* _FILEIO_H */
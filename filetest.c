@@ -71,11 +71,11 @@ int main(int argc, char **argv) {
   }
   fclose(fp);
   // Now that we've loaded the sequence (ish) we can build an fm-index on it
-  fmi = make_fmi(seq, len);
+  fmi = make_fmi(seq, len, SA_SHIFT, SA_ROWS);
 
   // Write the index to a (temporary) file
   FILE *f = tmpfile();
-  write_index(fmi, f);
+  write_index(fmi, seq, f);
   rewind(f);
   destroy_fmi(fmi);
   fmi = read_index(seq, f);
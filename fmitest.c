@@ -32,7 +32,8 @@ static inline unsigned char getbase(const char *str, int idx) {
 void rna_seq(const fm_index *fmi, const char *pattern, int len) {
   // Copy pattern into a different aray for cyclic search
   char *pat = malloc(2*len);
-  int i, j, start, end;
+  int i, j;
+  bwtint_t start, end;
   memcpy(pat, pattern, len);
   memcpy(pat+len, pattern, len);
   for (i = len; i; --i) {
@@ -141,7 +142,7 @@ int main(int argc, char **argv) {
     str[len/4] = 0;
   }
   rdtscll(a);
-  fmi = make_fmi(str, len);
+  fmi = make_fmi(str, len, SA_SHIFT, SA_ROWS);
   rdtscll(b);
   printf("Built index with %d base pairs in %lld cycles (%f s)\n",
 	 len, b-a, ((double)(b-a)) / 2500000000.);
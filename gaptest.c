@@ -68,7 +68,7 @@ int main(int argc, char **argv) {
   }
   fclose(fp);
   // Now that we've loaded the sequence (ish) we can build an fm-index on it
-  fmi = make_fmi(seq, len);
+  fmi = make_fmi(seq, len, SA_SHIFT, SA_ROWS);
 
   // Testing!
   // Pull two 15-nt sequences from the genome and try aligning
@@ -92,21 +92,21 @@ int main(int argc, char **argv) {
     // are no longer looking for an exact match on one part of the genome)
     // for the string
     //jj = locate(fmi, buf, 30);
-    int start, end, start2, end2;
+    bwtint_t start, end, start2, end2;
     // Align the end of the sequence
     int nmatched = mms(fmi, buf, 30, &start, &end);
     // Align the rest of it
     int nmatched2 = mms(fmi, buf, 30-nmatched, &start2, &end2);
-    for (int kk = start; kk < end; ++kk) {
-      printf("%d %d\n", unc_sa(fmi, kk), jj);
+    for (bwtint_t kk = start; kk < end; ++kk) {
+      printf("%lld %d\n", (long long)unc_sa(fmi, kk), jj);
       printf("%d bases matched\n", nmatched);
       for (int iii = (30 - nmatched); iii < 30; ++iii)
 	putchar("ACGT"[buf[iii]]);
       putchar('\n');
       printseq(seq, unc_sa(fmi, kk), nmatched);
     }
-    for (int kk = start2; kk < end2; ++kk) {
-      printf("%d %d\n", unc_sa(fmi, kk), j);
+    for (bwtint_t kk = start2; kk < end2; ++kk) {
+      printf("%lld %d\n", (long long)unc_sa(fmi, kk), j);
       printf("%d bases matched\n", nmatched2);
       for (int iii = 0; iii < nmatched2; ++iii)
 	putchar("ACGT"[buf[iii]]);
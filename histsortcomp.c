@@ -16,51 +16,248 @@
 #include <pthread.h>
 #include "histsortcomp.h"
 #include "csacak.h"
+#include "taskpool.h"
 
-static inline unsigned char getbase(const char *str, int idx) {
+static inline unsigned char getbase(const char *str, bwtint_t idx) {
   // Gets the base at the appropriate index
   return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
 }
 
-static int *saux;
-
-// base is a pointer to the array of prefixes
-// len is one more than the number of base pairs (it's the length of the bwt)
-// arr is a pointer to the array of indices being sorted (i.e. we're
-// repesenting each string using the prefix)
-// aux is the auxiliary array being sorted into, although some trickery
-// ensures that the original array will end up sorted
-// depth is the current "string index" being considered.
-// This used to be called for depth=0, but for multithreading purposes it isn't
-void histhelper(const char *base, int len, int *arr, int *aux, int start, int end, int depth) {
-  // We are responsible for sorting the array from index arr[start] to
-  // arr[end-1], and are currently considering the base at
-  // position depth (that is, getbase(base,arr[i]+depth))
-  
-  // There are four buckets, plus one for a string which has just
-  // ended. Each of those four buckets is then sorted recursively.
-  int lens[4] = {0}, i;
-  int ptrs[4];
-  // Base cases, where the array is already sorted
-  if ((end - start) == 1) {
-    if (arr == saux)
-      aux[start] = arr[start];
-    // We want the original array to be sorted
-    return;
+// Buckets smaller than this are sorted by whoever split them off rather than
+// being handed to the task pool; below this the overhead isn't worth it
+#define HS_TASK_MIN 65536
+
+// Buckets at least this big are split on the next 4 bases at once (a byte of
+// the packed sequence) rather than on one; see hh_radix()
+#define HS_RADIX_MIN 512
+#define HS_RADIX 625 // 5^4: each base is 1-4, or 0 past the end
+
+// In a repeat each level only takes a few suffixes off the bucket (the ones
+// whose copy of the repeat ends first, or has a difference there), so
+// sorting it takes time quadratic in the length of the repeat, and with a
+// long enough one the stack runs out. So a bucket which hasn't halved in size
+// for HS_STALL bases, or has gone HS_MAX_DEPTH deep regardless, is put off
+// until the rest is sorted, then finished off by hs_refine()
+#define HS_STALL 16
+#define HS_MAX_DEPTH 1024
+
+// hs_refine() takes up to 4.5 words per suffix put off (see there), so once
+// more than 1 in HS_DEFER_MAX of them have been (and more than HS_DEFER_MIN,
+// which is nothing to worry about), the sort gives up and SACA-K does it
+// instead, which takes no more than the suffix array. That keeps the sort
+// to 1.2 words per base at worst, and it's no loss of time: on sequence that
+// repetitive SACA-K is the faster of the two anyway.
+#define HS_DEFER_MAX 32
+#define HS_DEFER_MIN 65536
+
+// hh_radix() keeps the keys of buckets up to this big (2 bytes each); bigger
+// ones have them worked out again as they're permuted, so that the sort's
+// memory doesn't depend on how big its biggest bucket is
+#define HS_KEYS_MAX (1 << 20)
+
+// A bucket put off for hs_refine(): rows [start, end) of the suffix array,
+// whose suffixes all start with the same depth bases
+typedef struct {
+  bwtint_t start, end, depth;
+} hs_group;
+
+// Everything one sort needs to know. This used to be a couple of static
+// globals, which meant only one sort could run at a time.
+typedef struct {
+  const char *base;
+  bwtint_t len; // The number of base pairs
+  bwtint_t *arr; // What's being sorted (in place)
+  taskpool *pool; // NULL to do the whole sort in the calling thread
+  pthread_mutex_t lock; // For the list of buckets put off
+  hs_group *deferred;
+  size_t ndeferred, capdeferred;
+  bwtint_t nsuffdeferred; // How many suffixes are in them
+  volatile int gave_up; // Too many put off; SACA-K's doing it instead
+} hs_sort;
+
+// A bucket which has been handed to the pool
+struct hh_args {
+  hs_sort *s;
+  bwtint_t start;
+  bwtint_t end;
+  bwtint_t depth;
+  bwtint_t since;
+  bwtint_t ref;
+};
+
+static void histhelper(hs_sort *s, bwtint_t start, bwtint_t end,
+		       bwtint_t depth, bwtint_t since, bwtint_t ref);
+static void hh_task(void *arg);
+
+// Sorts a bucket, or gives it to the pool if it's big enough to be worth it.
+// since and ref are where the bucket's parent last halved in size, and its
+// size then; this bucket is a new reference point if it's half that.
+static inline void hh_bucket(hs_sort *s, bwtint_t start, bwtint_t end,
+			     bwtint_t depth, bwtint_t since, bwtint_t ref) {
+  if (end - start <= ref / 2) {
+    since = depth;
+    ref = end - start;
+  }
+  if (s->pool && end - start >= HS_TASK_MIN) {
+    struct hh_args *args = malloc(sizeof(struct hh_args));
+    args->s = s;
+    args->start = start;
+    args->end = end;
+    args->depth = depth;
+    args->since = since;
+    args->ref = ref;
+    taskpool_submit(s->pool, hh_task, args);
   }
-  if (end == start)
+  else
+    histhelper(s, start, end, depth, since, ref);
+}
+
+// Puts a bucket off for hs_refine(), unless that makes too many
+static void hh_defer(hs_sort *s, bwtint_t start, bwtint_t end,
+		     bwtint_t depth) {
+  pthread_mutex_lock(&s->lock);
+  s->nsuffdeferred += end - start;
+  if (s->gave_up || (s->nsuffdeferred > s->len / HS_DEFER_MAX &&
+		     s->nsuffdeferred > HS_DEFER_MIN)) {
+    s->gave_up = 1;
+    pthread_mutex_unlock(&s->lock);
     return;
-  for (i = start; i != end; ++i) {
-    if(arr[i] + depth != len) { 
+  }
+  if (s->ndeferred == s->capdeferred) {
+    s->capdeferred = s->capdeferred ? 2 * s->capdeferred : 64;
+    s->deferred = realloc(s->deferred, s->capdeferred * sizeof(hs_group));
+  }
+  s->deferred[s->ndeferred].start = start;
+  s->deferred[s->ndeferred].end = end;
+  s->deferred[s->ndeferred].depth = depth;
+  ++s->ndeferred;
+  pthread_mutex_unlock(&s->lock);
+}
+
+// The bucket of the suffix at p in hh_radix(), by its next 4 bases. Suffixes
+// with fewer than 4 bases left come before everything they're a prefix of;
+// there's only ever one of those in a bucket, since it's the only suffix
+// ending where it does.
+static inline int hh_key4(const char *str, bwtint_t len, bwtint_t p) {
+  unsigned int v, k;
+  int j;
+  if (len - p >= 4) {
+    // The 4 bases are a byte's worth of the packed sequence, straddling two
+    // bytes unless p is a multiple of 4 (in which case the second one might
+    // be past the end)
+    v = (unsigned char)str[p>>2] << 8;
+    if (p & 3)
+      v |= (unsigned char)str[(p>>2)+1];
+    v = (v >> (8 - 2*(p&3))) & 0xff;
+    return 156 + 125*(v>>6) + 25*((v>>4)&3) + 5*((v>>2)&3) + (v&3);
+  }
+  for (k = 0, j = 0; j < 4; ++j)
+    k = k * 5 + (p + j < len ? getbase(str, p + j) + 1 : 0);
+  return k;
+}
+
+// histhelper() for big buckets: the same thing, but on 4 bases per level,
+// which cuts the number of passes over the bucket by 4 (they're what take
+// the time while the buckets are too big for the cache)
+// The buckets are worked out once, in a pass which can have plenty of reads
+// of the sequence on the go at once, and kept (in two bytes per suffix, a lot
+// less than the second array this used to take) for the permutation, where
+// each read would have to wait for the one before. Past HS_KEYS_MAX
+// suffixes they're worked out again instead.
+static void hh_radix(hs_sort *s, bwtint_t start, bwtint_t end,
+		     bwtint_t depth, bwtint_t since, bwtint_t ref) {
+  bwtint_t *lens = calloc(2 * HS_RADIX, sizeof(bwtint_t));
+  bwtint_t *ptrs = lens + HS_RADIX, *arr = s->arr + start, i, p, v, t;
+  unsigned short *keys = NULL, b, c;
+  int k;
+  if (end - start <= HS_KEYS_MAX)
+    keys = malloc((end - start) * sizeof(unsigned short));
+  for (i = 0; i != end - start; ++i) {
+    b = hh_key4(s->base, s->len, arr[i] + depth);
+    if (keys)
+      keys[i] = b;
+    lens[b]++;
+  }
+  for (p = 0, k = 0; k < HS_RADIX; ++k) {
+    ptrs[k] = p;
+    p += lens[k];
+  }
+  // Permute them into place: each suffix not yet in its bucket gets swapped
+  // into the next free slot of the bucket it belongs in, and whatever was
+  // there gets the same treatment, until one belonging where we started turns
+  // up. The buckets are filled in order, so a bucket's done once ptrs[k]
+  // reaches the start of the next one.
+  for (p = 0, k = 0; k < HS_RADIX; p += lens[k++]) {
+    while (ptrs[k] < p + lens[k]) {
+      v = arr[ptrs[k]];
+      b = keys ? keys[ptrs[k]] : hh_key4(s->base, s->len, v + depth);
+      while (b != k) {
+	t = arr[ptrs[b]];
+	c = keys ? keys[ptrs[b]] : hh_key4(s->base, s->len, t + depth);
+	arr[ptrs[b]++] = v;
+	v = t;
+	b = c;
+      }
+      arr[ptrs[k]++] = v;
+    }
+  }
+  free(keys);
+  // ptrs[k] is now the end of bucket k
+  for (k = 0; k < HS_RADIX; ++k)
+    if (lens[k])
+      hh_bucket(s, start + ptrs[k] - lens[k], start + ptrs[k], depth + 4,
+		since, ref);
+  free(lens);
+}
+
+// The first level, which is hh_radix() on the whole array, except that the
+// suffixes start out in order of position, so there's nothing to permute:
+// they're counted, then written straight into their buckets, both times
+// going through the sequence in order. That saves the keys (two bytes a
+// base) and the pass over the array which swapping them into place takes.
+static void hh_first(hs_sort *s) {
+  bwtint_t *lens = calloc(2 * HS_RADIX, sizeof(bwtint_t));
+  bwtint_t *ptrs = lens + HS_RADIX, p;
+  int k;
+  for (p = 0; p < s->len; ++p)
+    lens[hh_key4(s->base, s->len, p)]++;
+  // The last rotation leaves the $ in front, so it's sorted already
+  s->arr[0] = s->len;
+  for (p = 1, k = 0; k < HS_RADIX; ++k) {
+    ptrs[k] = p;
+    p += lens[k];
+  }
+  for (p = 0; p < s->len; ++p)
+    s->arr[ptrs[hh_key4(s->base, s->len, p)]++] = p;
+  for (k = 0; k < HS_RADIX; ++k)
+    if (lens[k])
+      hh_bucket(s, ptrs[k] - lens[k], ptrs[k], 4, 0, s->len + 1);
+  free(lens);
+}
+
+// Buckets the n (< HS_RADIX_MIN) suffixes at arr by the base at depth, with
+// the one which has just ended (if there is one) in front, and returns
+// whether there was one. They're bucketed through a buffer on the stack
+// (the old way, but small enough not to cost anything); it's not inlined so
+// that the buffer's gone again before histhelper() recurses.
+static int __attribute__((noinline))
+hh_small(const char *base, bwtint_t len, bwtint_t *arr, bwtint_t n,
+	 bwtint_t depth, bwtint_t *lens) {
+  bwtint_t tmp[HS_RADIX_MIN], ptrs[4], i, m = 0;
+  unsigned char keys[HS_RADIX_MIN];
+  int ended = 0;
+  for (i = 0; i != n; ++i) {
+    if (arr[i] + depth != len) { 
       // Not <, the others were handled already
-      lens[getbase(base,arr[i]+depth)]++;
+      keys[m] = getbase(base, arr[i] + depth);
+      lens[keys[m]]++;
+      tmp[m++] = arr[i];
     }
     else {
-      aux[start] = arr[i];
-      arr[i] = arr[start];
-      arr[start] = aux[start];
-      ++start; // This element is known to be in the right
-      // position now, so don't bother processing it again
+      // This element is known to be in the right position (the front), so
+      // don't bother processing it again
+      arr[0] = arr[i];
+      ended = 1;
     }
   }
   // lens will now contain the numbers of elements which should
@@ -68,120 +265,354 @@ void histhelper(const char *base, int len, int *arr, int *aux, int start, int en
   // values for ptrs
   // In essence, this is a 3-pivot quicksort with no comparisons,
   // which makes it slightly faster
-  ptrs[0] = start;
+  ptrs[0] = ended;
   ptrs[1] = ptrs[0] + lens[0];
   ptrs[2] = ptrs[1] + lens[1];
   ptrs[3] = ptrs[2] + lens[2];
-  // I don't know why I kept lens[3] around either, maybe a sanity
-  // check (or to avoid a branch prediction error). It lets me
-  // find the end of the array, but I know where that is anyway
-  for (i = start; i != end; ++i) {
-    aux[ptrs[getbase(base,arr[i]+depth)]] = arr[i];
-    ++ptrs[getbase(base,arr[i]+depth)];
-  }
-  histhelper(base, len, aux, arr,
-	     start, start + lens[0], depth+1);
-  histhelper(base, len, aux, arr,
-	     start+lens[0], start+lens[0]+lens[1], depth+1);
-  histhelper(base, len, aux, arr,
-	     start+lens[0]+lens[1], end - lens[3],depth+1);
-  histhelper(base, len, aux, arr,
-	     end - lens[3], end, depth+1);
+  for (i = 0; i != m; ++i)
+    arr[ptrs[keys[i]]++] = tmp[i];
+  return ended;
 }
 
-// A struct for pthreads, allowing us to pass arguments to the new threads
-struct hh_args {
-  const char *base;
-  int len;
-  int *arr;
-  int *aux;
-  int start;
-  int end;
-};
+// s describes the sort (the sequence, its length, the array being sorted,
+// and so on); we're responsible for s->arr[start] to s->arr[end-1], all of
+// which share their first depth bases.
+// since is the depth at which the bucket (or the one it came from) was last
+// half the size it was before, and ref is the size it was then
+// This used to bucket into a second array and back; now the big buckets
+// are permuted in place (hh_radix()) and the small ones go through a buffer,
+// so the sort needs half the memory.
+static void histhelper(hs_sort *s, bwtint_t start, bwtint_t end,
+		       bwtint_t depth, bwtint_t since, bwtint_t ref) {
+  // We are currently considering the base at position depth (that is,
+  // getbase(base,arr[i]+depth))
+  
+  // There are four buckets, plus one for a string which has just
+  // ended. Each of those four buckets is then sorted recursively.
+  bwtint_t lens[4] = {0};
+  int k;
+  // Base cases, where the array is already sorted (or won't be needed)
+  if (end - start <= 1 || s->gave_up)
+    return;
+  if (depth - since >= HS_STALL || depth > HS_MAX_DEPTH) {
+    hh_defer(s, start, end, depth);
+    return;
+  }
+  if (end - start >= HS_RADIX_MIN) {
+    hh_radix(s, start, end, depth, since, ref);
+    return;
+  }
+  start += hh_small(s->base, s->len, s->arr + start, end - start, depth, lens);
+  // The buckets don't overlap, so with a pool they can all be sorted at
+  // once; whichever are too small to bother with get done here
+  for (k = 0; k < 4; ++k) {
+    hh_bucket(s, start, start + lens[k], depth+1, since, ref);
+    start += lens[k];
+  }
+}
 
-// Wrapper function for histhelper for pthreads
-void *hh_wrapper(void *arg) {
+static void hh_task(void *arg) {
   struct hh_args *args = (struct hh_args*)arg;
-  histhelper(args->base, args->len, args->arr, args->aux,
-	     args->start, args->end, 1);
-  return NULL;
+  histhelper(args->s, args->start, args->end, args->depth, args->since,
+	     args->ref);
+  free(args);
+}
+
+static inline void hs_swap(bwtint_t *key, bwtint_t *sa, bwtint_t i,
+			   bwtint_t j) {
+  bwtint_t x = key[i], y = sa[i];
+  key[i] = key[j];
+  sa[i] = sa[j];
+  key[j] = x;
+  sa[j] = y;
 }
 
-// The depth = 0 call to histhelper. Making this a separate function allows
-// us to parallelize properly (we need 4 threads, and conveniently enough
-// we have four buckets, and absolutely no data races between them!)
-void histzero(const char *base, int len, int *arr, int *aux, int start, int end) {
-  int lens[4] = {0}, i;
-  int ptrs[4];
-  struct hh_args *args[4];
-  pthread_t threads[4];
-  void *status;
-  // Assumptions about our input allow us to do this iteration
-  // somewhat more efficiently (as if it matters all that much)
-  for (i = start; i != end; ++i) {
-    lens[getbase(base,arr[i])]++;
+// Sorts the n suffixes at sa by their keys (which go along with them). In a
+// tandem repeat most of a bucket's keys are the same (all but the copies
+// nearest the end of the repeat), so this is a quicksort which splits three
+// ways, putting everything equal to the pivot in the middle where it's done
+// with (as Larsson and Sadakane do)
+static void hs_sort_keys(bwtint_t *key, bwtint_t *sa, bwtint_t n) {
+  bwtint_t i, j, lt, gt, x, y;
+  while (n > 16) {
+    bwtint_t a = key[0], b = key[n/2], c = key[n-1], v;
+    v = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+    for (lt = i = 0, gt = n; i < gt; ) {
+      if (key[i] < v)
+	hs_swap(key, sa, i++, lt++);
+      else if (key[i] > v)
+	hs_swap(key, sa, i, --gt);
+      else
+	++i;
+    }
+    // Recurse on the smaller side, so the stack stays shallow
+    if (lt < n - gt) {
+      hs_sort_keys(key, sa, lt);
+      key += gt;
+      sa += gt;
+      n -= gt;
+    }
+    else {
+      hs_sort_keys(key + gt, sa + gt, n - gt);
+      n = lt;
+    }
   }
-  ptrs[0] = start;
-  ptrs[1] = ptrs[0] + lens[0];
-  ptrs[2] = ptrs[1] + lens[1];
-  ptrs[3] = ptrs[2] + lens[2];
-  aux[0] = arr[0];
-  for (i = start; i != end; ++i) {
-    aux[ptrs[getbase(base,arr[i])]] = arr[i];
-    ++ptrs[getbase(base,arr[i])];
+  // Insertion sort; most buckets are tiny (one suffix per copy of a repeat)
+  for (i = 1; i < n; ++i) {
+    x = key[i];
+    y = sa[i];
+    for (j = i; j > 0 && key[j-1] > x; --j) {
+      key[j] = key[j-1];
+      sa[j] = sa[j-1];
+    }
+    key[j] = x;
+    sa[j] = y;
   }
-  for (i = 0; i < 4; ++i) {
-    args[i] = malloc(sizeof(struct hh_args));
-    args[i]->base = base;
-    args[i]->len = len;
-    args[i]->arr = aux;
-    args[i]->aux = arr;
+}
+
+// A bitvector with a count of the bits set before every 512 (cnt) and,
+// within those, before every word (sub), so counting the bits before any
+// given one (rank) is three lookups and a popcount
+typedef struct {
+  unsigned long long *bits;
+  bwtint_t *cnt;
+  unsigned short *sub;
+} hs_bits;
+
+static void hs_bits_init(hs_bits *b, bwtint_t nw) {
+  b->bits = calloc(nw, sizeof(unsigned long long));
+  b->cnt = malloc(nw / 8 * sizeof(bwtint_t));
+  b->sub = malloc(nw * sizeof(unsigned short));
+}
+
+static void hs_bits_free(hs_bits *b) {
+  free(b->bits);
+  free(b->cnt);
+  free(b->sub);
+}
+
+static inline void hs_set(hs_bits *b, bwtint_t p) {
+  b->bits[p >> 6] |= 1ULL << (p & 63);
+}
+
+static inline int hs_bit(const hs_bits *b, bwtint_t p) {
+  return (b->bits[p >> 6] >> (p & 63)) & 1;
+}
+
+static inline bwtint_t hs_rank(const hs_bits *b, bwtint_t p) {
+  return b->cnt[p >> 9] + b->sub[p >> 6] +
+    __builtin_popcountll(b->bits[p >> 6] & ((1ULL << (p & 63)) - 1));
+}
+
+static void hs_count(hs_bits *b, bwtint_t nw) {
+  bwtint_t i, c;
+  unsigned short t = 0;
+  for (c = 0, i = 0; i < nw; ++i) {
+    if (!(i & 7)) {
+      b->cnt[i >> 3] = c;
+      t = 0;
+    }
+    b->sub[i] = t;
+    t += __builtin_popcountll(b->bits[i]);
+    c += __builtin_popcountll(b->bits[i]);
   }
-  args[0]->start = start;
-  args[1]->start = start + lens[0];
-  args[2]->start = start + lens[0] + lens[1];
-  args[3]->start = end - lens[3];
-  args[0]->end = args[1]->start;
-  args[1]->end = args[2]->start;
-  args[2]->end = args[3]->start;
-  args[3]->end = end;
-  for (i = 0; i < 4; ++i) {
-    pthread_create(&threads[i], NULL, hh_wrapper, (void *) args[i]);
+}
+
+// Rounds of hs_refine() which need the ranks of more than 1 in HS_SCAN of
+// the suffixes get them by going through the whole suffix array; fewer
+// (usually just the few at the end of each copy of a repeat) are looked up
+// one at a time with hs_find()
+#define HS_SCAN 1024
+
+// The row of the suffix at p, which wasn't put off, by binary search. The
+// buckets which were aren't sorted inside yet, but each is in the right
+// place as a whole, and p isn't in one, so comparing p with any of a
+// bucket's suffixes says which side of the whole bucket it's on.
+static bwtint_t hs_find(const hs_sort *s, bwtint_t p) {
+  bwtint_t lo = 0, hi = s->len + 1, mid, a, b;
+  for (;;) {
+    mid = lo + (hi - lo) / 2;
+    if (s->arr[mid] == p)
+      return mid;
+    for (a = p, b = s->arr[mid]; a < s->len && b < s->len &&
+	   getbase(s->base, a) == getbase(s->base, b); ++a, ++b)
+      ;
+    // Whichever ends first comes first
+    if (a == s->len || (b < s->len &&
+			getbase(s->base, a) < getbase(s->base, b)))
+      hi = mid;
+    else
+      lo = mid + 1;
   }
-  for (i = 0; i < 4; ++i) {
-    pthread_join(threads[i], &status);
-    free(args[i]);
+}
+
+// Finishes off the buckets histhelper() put off, by prefix doubling
+// (Larsson and Sadakane, "Faster suffix sorting", 2007) over just those
+// buckets. A bucket whose suffixes share d bases is sorted by the rank of the
+// suffixes d bases further on: their row, or the first row of their bucket
+// if that's not sorted yet. Those ranks are right as far as they go (the
+// buckets are in the right place relative to each other and everything
+// else), so any suffixes left tied are in the same bucket, which is at least
+// as deep as the shallowest one (h), so they now share at least d + h bases.
+// That's about double what they did, so a repeat of length L takes about
+// log2(L / HS_STALL) rounds. The keys are all looked up before any bucket
+// is split up, since the keys of one bucket come from the others.
+// Larsson and Sadakane keep the ranks in an inverse suffix array, but that
+// would need a second array as big as the first, which is what we got rid
+// of. Instead the suffixes which were put off are marked in a bitvector
+// (indef), and their ranks kept in dval, in order of position. The
+// suffixes d bases on from them are mostly put off as well (they're in the
+// same repeat), and the ranks of the ones that aren't are found by marking
+// them in another bitvector (need) and going through the suffix array once
+// (or by hs_find(), if there are only a few).
+// So for the tot suffixes put off this takes dval and the keys (a word
+// each), the ranks from the suffix array (at most a word each), and the
+// buckets, which are never more than tot / 2 since they're disjoint and have
+// two suffixes at least; they're kept in a ring, each round's new ones going
+// on the end as the old ones come off the front. That's 4.5 words per
+// suffix at most, plus the bitvectors (a fifth of a byte per base each).
+static void hs_refine(hs_sort *s) {
+  hs_group *q = s->deferred, g;
+  hs_bits indef, need;
+  bwtint_t *sa = s->arr, len = s->len, nw = (len + 512) / 512 * 8;
+  bwtint_t *dval, *key, *val, i, j, r, p, tot, h, nneed;
+  size_t n = s->ndeferred, live = n, cap, head = 0, k;
+  hs_bits_init(&indef, nw);
+  hs_bits_init(&need, nw);
+  for (tot = 0, k = 0; k < n; ++k)
+    for (r = q[k].start; r < q[k].end; ++r, ++tot)
+      hs_set(&indef, sa[r]);
+  hs_count(&indef, nw);
+  cap = tot / 2;
+  q = realloc(q, cap * sizeof(hs_group));
+  dval = malloc(tot * sizeof(bwtint_t));
+  key = malloc(tot * sizeof(bwtint_t));
+  for (k = 0; k < n; ++k)
+    for (r = q[k].start; r < q[k].end; ++r)
+      dval[hs_rank(&indef, sa[r])] = q[k].start;
+  while (n) {
+    h = q[head].depth;
+    for (nneed = 0, j = 0, k = 0; k < n; ++k) {
+      g = q[(head + k) % cap];
+      if (g.depth < h)
+	h = g.depth;
+      for (r = g.start; r < g.end; ++r, ++j) {
+	p = sa[r] + g.depth;
+	if (hs_bit(&indef, p))
+	  key[j] = dval[hs_rank(&indef, p)];
+	else {
+	  key[j] = -1;
+	  hs_set(&need, p);
+	  ++nneed; // Or more than need, if two buckets need the same one
+	}
+      }
+    }
+    if (nneed > len / HS_SCAN) {
+      hs_count(&need, nw);
+      val = malloc(nneed * sizeof(bwtint_t));
+      for (r = 0; r <= len; ++r)
+	if (hs_bit(&need, sa[r]))
+	  val[hs_rank(&need, sa[r])] = r;
+      for (j = 0, k = 0; k < n; ++k) {
+	g = q[(head + k) % cap];
+	for (r = g.start; r < g.end; ++r, ++j)
+	  if (key[j] < 0)
+	    key[j] = val[hs_rank(&need, sa[r] + g.depth)];
+      }
+      free(val);
+    }
+    else if (nneed) {
+      for (j = 0, k = 0; k < n; ++k) {
+	g = q[(head + k) % cap];
+	for (r = g.start; r < g.end; ++r, ++j)
+	  if (key[j] < 0)
+	    key[j] = hs_find(s, sa[r] + g.depth);
+      }
+    }
+    if (nneed)
+      memset(need.bits, 0, nw * sizeof(unsigned long long));
+    // Now sort each bucket, split it up wherever the key changes, and give
+    // the suffixes their new ranks (which can't affect the keys any more,
+    // since they've all been looked up already)
+    for (j = 0, k = 0; k < n; ++k) {
+      bwtint_t *kk = key + j; // kk[r - g.start] goes with row r
+      g = q[head];
+      head = (head + 1) % cap;
+      --live;
+      j += g.end - g.start;
+      hs_sort_keys(kk, sa + g.start, g.end - g.start);
+      for (i = r = g.start; r < g.end; i = r) {
+	for (++r; r < g.end && kk[r - g.start] == kk[i - g.start]; ++r)
+	  ;
+	if (r - i > 1) {
+	  q[(head + live) % cap].start = i;
+	  q[(head + live) % cap].end = r;
+	  q[(head + live++) % cap].depth = g.depth + h;
+	}
+	for (p = i; p < r; ++p)
+	  dval[hs_rank(&indef, sa[p])] = i;
+      }
+    }
+    n = live;
   }
+  free(q);
+  free(key);
+  free(dval);
+  hs_bits_free(&need);
+  hs_bits_free(&indef);
+  s->deferred = NULL;
 }
 
 // len is the number of base pairs, but we're going to increment that to
 // avoid some odd indexing problems (in particular, len becomes the length
 // of the bwt'd string)
 // Returns something quite like a suffix array
-int * histsort(const char *str, int len) {
-  int *arr = malloc((len+1) * sizeof(int));
-  int i;
-  int *aux = malloc((len+1) * sizeof(int));
-  arr[0] = len; // Note that the last rotation leaves the $ in
-  // front, so it will certainly be sorted here
-  for (i = 1; i <= len; ++i)
-    arr[i] = i-1;
-  saux = aux;
-  if (len < 10000000) { // This figure was established experimentally
-    histhelper(str, len, arr, aux, 0, len+1, 0);
-  }
-  else {
-    histzero(str, len, arr, aux, 1, len+1);
+bwtint_t * histsort_pool(const char *str, bwtint_t len, taskpool *pool) {
+  bwtint_t *arr = malloc((len+1) * sizeof(bwtint_t));
+  hs_sort s;
+  s.base = str;
+  s.len = len;
+  s.arr = arr;
+  s.pool = pool;
+  pthread_mutex_init(&s.lock, NULL);
+  s.deferred = NULL;
+  s.ndeferred = s.capdeferred = 0;
+  s.nsuffdeferred = 0;
+  s.gave_up = 0;
+  hh_first(&s);
+  if (pool)
+    taskpool_wait(pool);
+  pthread_mutex_destroy(&s.lock);
+  if (s.gave_up) {
+    // Too repetitive; the rest of the buckets were left as they were, and
+    // the suffix array has to go before SACA-K makes another
+    free(s.deferred);
+    free(arr);
+    return csuff_arr(str, len);
   }
-  // By the power of magic and handwaving, arr will end up sorted
-  free(aux);
+  // By the power of magic and handwaving, arr will end up sorted (apart from
+  // the buckets put off, which are done now)
+  if (s.ndeferred)
+    hs_refine(&s);
   return arr;
   // arr is the suffix array
 }
 
+bwtint_t * histsort(const char *str, bwtint_t len) {
+  taskpool *pool;
+  bwtint_t *arr;
+  int n = taskpool_ncpus();
+  if (len < 10000000 || n < 2) // This figure was established experimentally
+    return histsort_pool(str, len, NULL);
+  pool = taskpool_create(n);
+  arr = histsort_pool(str, len, pool);
+  taskpool_destroy(pool);
+  return arr;
+}
+
 // A wrapper function for histsort that simply prints the BWT as a string
-char * makebwt(const char *str, int len) {
-  int *idxs;
+char * makebwt(const char *str, bwtint_t len) {
+  bwtint_t *idxs;
   char *buf = malloc(len+2); // +2, because we'd like it to be
   // null-terminated (to play nice with printf and so on)
   idxs = histsort(str, len);
@@ -192,8 +623,8 @@ char * makebwt(const char *str, int len) {
 
 // Make compressed bwt; this is for testing purposes, I need the indices
 // for the FM index building
-int makecbwt(const char *str, int len, char *out) {
-  int *idxs, i;
+bwtint_t makecbwt(const char *str, bwtint_t len, char *out) {
+  bwtint_t *idxs, i;
   idxs = histsort(str, len);
   i = sprintcbwt(str, idxs, len, out);
   free(idxs);
@@ -201,8 +632,8 @@ int makecbwt(const char *str, int len, char *out) {
 }
 
 // Same as above, but uses saca-k to calculate the SA
-int saca_makecbwt(const char *str, int len, char *out) {
-  unsigned int *idxs, i;
+bwtint_t saca_makecbwt(const char *str, bwtint_t len, char *out) {
+  bwtint_t *idxs, i;
   idxs = csuff_arr(str, len);
   i = sprintcbwt(str, idxs, len, out);
   free(idxs);
@@ -216,11 +647,16 @@ int saca_makecbwt(const char *str, int len, char *out) {
 // allocated. str is assumed to be in compressed form.
 // len is the length of str, not idxs
 // Note that this function will result in massive numbers of cache misses; don't
-// be surprised by this
-unsigned int sprintcbwt(const char *str, unsigned int *idxs, unsigned int len, char *out) {
-  unsigned int i, d = 0xFFFFFFFF;
+// be surprised by this (each base is asked for BWT_AHEAD rows before it's
+// needed, so at least they overlap rather than being waited for one by one)
+#define BWT_AHEAD 32
+bwtint_t sprintcbwt(const char *str, const bwtint_t *idxs, bwtint_t len,
+		    char *out) {
+  bwtint_t i, d = -1;
   char c = 0, u=3;
   for (i=0; i<=len; ++i) {
+    if (i + BWT_AHEAD <= len)
+      __builtin_prefetch(str + ((idxs[i + BWT_AHEAD] - 1) >> 2));
     if (idxs[i]) {
       c ^= getbase(str, idxs[i]-1)<<(2*u);
       if (u-- == 0) {
@@ -236,6 +672,8 @@ unsigned int sprintcbwt(const char *str, unsigned int *idxs, unsigned int len, c
     }
   }
   for (++i; i<=len; ++i) {
+    if (i + BWT_AHEAD <= len)
+      __builtin_prefetch(str + ((idxs[i + BWT_AHEAD] - 1) >> 2));
     c ^= getbase(str, idxs[i]-1)<<(2*u);
     if (u-- == 0) {
       out[(i-1)/4] = c;
@@ -249,11 +687,11 @@ unsigned int sprintcbwt(const char *str, unsigned int *idxs, unsigned int len, c
   return d;
 }
 
-void putsg(const char *str, int idx, int len) {
+void putsg(const char *str, bwtint_t idx, bwtint_t len) {
   // Prints a rotation of str corresponding to idx
-  int i;
+  bwtint_t i;
   // len is the length of str
-  printf("%3d: ", idx);
+  printf("%3lld: ", (long long)idx);
   for (i = idx; i != len; ++i) {
     putchar('0'+getbase(str, i));
   }
@@ -264,20 +702,20 @@ void putsg(const char *str, int idx, int len) {
   putchar('\n');
 }
 
-void sprintbwt(char *out, const char *str, const int *bwt, int len) {
+void sprintbwt(char *out, const char *str, const bwtint_t *bwt, bwtint_t len) {
   // Prints the bwt into a string; bwt is assumed to be the return
   // value of histsort, and out should be at least len+1 bytes long.
   // Note that len is the length of the bwt, not str.
-  int i;
+  bwtint_t i;
   for (i = 0; i != len; ++i)
     out[i] = bwt[i] ? ('0' + getbase(str, bwt[i]-1)) : '$';
   out[i] = 0;
 }
 
-void putbwt(const char *str, const int *bwt, int len) {
+void putbwt(const char *str, const bwtint_t *bwt, bwtint_t len) {
   // Prints the bwt; bwt is assumed to be the return value
   // of histsort
-  int i;
+  bwtint_t i;
   for (i = 0; i <= len; ++i)
     if(bwt[i])
       putchar('0' + getbase(str,bwt[i]-1));
@@ -1,22 +1,34 @@
 #ifndef _HISTSORTCOMP_H
 #define _HISTSORTCOMP_H
 
-void histhelper(const char *, int, int *, int *, int, int, int);
+#include "bwtint.h"
 
-int * histsort(const char *, int);
+#include "taskpool.h"
 
-void putsg(const char *, int, int);
+// Sorts the suffixes of a packed sequence of len bases, giving the suffix
+// array (len + 1 entries). Big sequences are sorted with a thread per core.
+// Very repetitive ones are handed to csuff_arr() instead, so the sequence
+// needs a 0 byte after it, the same as for that.
+bwtint_t * histsort(const char *, bwtint_t);
 
-void putbwt(const char *, const int *, int);
+// The same, with the buckets shared out between the workers of pool (NULL to
+// do it all in this thread). Nothing is shared between sorts, so several can
+// run at once, on the same pool or not; but this waits for the pool to go
+// idle, so it can't be called from one of the pool's own tasks.
+bwtint_t * histsort_pool(const char *, bwtint_t, taskpool *);
 
-void sprintbwt(char *, const char *, const int *, int);
+void putsg(const char *, bwtint_t, bwtint_t);
 
-char * makebwt(const char *, int);
+void putbwt(const char *, const bwtint_t *, bwtint_t);
 
-int makecbwt(const char *, int, char *);
+void sprintbwt(char *, const char *, const bwtint_t *, bwtint_t);
 
-int saca_makecbwt(const char *, int, char *);
+char * makebwt(const char *, bwtint_t);
 
-unsigned int sprintcbwt(const char *, unsigned int *, unsigned int, char *);
+bwtint_t makecbwt(const char *, bwtint_t, char *);
+
+bwtint_t saca_makecbwt(const char *, bwtint_t, char *);
+
+bwtint_t sprintcbwt(const char *, const bwtint_t *, bwtint_t, char *);
 
 #endif // _HISTSORTCOMP_H
@@ -1,5 +1,8 @@
 #include "histsortcomp.h"
-//#include "csacak.h"
+#include "csacak.h"
+#include "psort.h"
+#include "blockwise.h"
+#include "taskpool.h"
 #include "rdtscll.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,6 +13,85 @@ static inline unsigned char getbase(const char *str, int idx) {
   return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
 }
 
+static inline void setbase(char *str, int idx, int base) {
+  int shift = 2*(3-(idx&3));
+  str[idx>>2] = (str[idx>>2] & ~(3 << shift)) | base << shift;
+}
+
+// Where bsuff_arr() puts its blocks as they come
+typedef struct {
+  bwtint_t *sa;
+  bwtint_t next;
+  int bad;
+} block_dest;
+
+static void copy_block(void *arg, const bwtint_t *sa, bwtint_t row,
+		       bwtint_t n) {
+  block_dest *d = (block_dest *)arg;
+  // The blocks should come in order, with nothing missing
+  if (row != d->next) d->bad = 1;
+  else memcpy(d->sa + row, sa, n * sizeof(bwtint_t));
+  d->next = row + n;
+}
+
+static int same_sa(const char *what, const bwtint_t *ref, const bwtint_t *sa,
+		   bwtint_t len) {
+  bwtint_t i;
+  if (sa == NULL) {
+    printf("  %s: no suffix array\n", what);
+    return 0;
+  }
+  for (i = 0; i <= len; ++i) {
+    if (sa[i] != ref[i]) {
+      printf("  %s: mismatch at row %lld, %lld instead of %lld\n", what,
+	     (long long)i, (long long)sa[i], (long long)ref[i]);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Checks that every way we have of building the suffix array gives exactly
+// what csuff_arr() does, and returns the number that didn't
+static int check_sa(const char *name, const char *str, bwtint_t len,
+		    taskpool *pool) {
+  static const int nthreads[] = {1, 2, 4};
+  static const int nblocks[] = {1, 3, 16};
+  char what[64];
+  int bad = 0;
+  unsigned int k;
+  bwtint_t *ref = csuff_arr(str, len), *sa;
+  block_dest d;
+  printf("Checking suffix arrays of %s (%lld bases)\n", name, (long long)len);
+  sa = histsort_pool(str, len, pool);
+  bad += !same_sa("histsort_pool", ref, sa, len);
+  free(sa);
+  sa = histsort_pool(str, len, NULL);
+  bad += !same_sa("histsort_pool without a pool", ref, sa, len);
+  free(sa);
+  for (k = 0; k < sizeof(nthreads) / sizeof(nthreads[0]); ++k) {
+    sprintf(what, "psuff_arr with %d threads", nthreads[k]);
+    sa = psuff_arr(str, len, nthreads[k]);
+    bad += !same_sa(what, ref, sa, len);
+    free(sa);
+  }
+  d.sa = malloc((len + 1) * sizeof(bwtint_t));
+  for (k = 0; k < sizeof(nblocks) / sizeof(nblocks[0]); ++k) {
+    sprintf(what, "bsuff_arr with %d blocks", nblocks[k]);
+    d.next = 0;
+    d.bad = 0;
+    bsuff_arr(str, len, nblocks[k], copy_block, &d);
+    if (d.bad || d.next != len + 1) {
+      printf("  %s: blocks out of order or missing\n", what);
+      ++bad;
+    }
+    else bad += !same_sa(what, ref, d.sa, len);
+  }
+  free(d.sa);
+  free(ref);
+  return bad;
+}
+
 int main(int argc, char **argv) {
   /*
   // Testing code to verify correctness
@@ -34,10 +116,19 @@ int main(int argc, char **argv) {
   unsigned int i;
   unsigned long long a, b;
   len = atoi(argv[1]);
-  str = malloc(1+len/4 * sizeof(char));
+  int bad = 0;
+  bwtint_t primary, saca_primary;
+  taskpool *pool;
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s length\n", argv[0]);
+    return 1;
+  }
+  len = atoi(argv[1]);
+  // One byte of slack, since csuff_arr() wants a 0 after the sequence
+  str = calloc(len/4 + 2, sizeof(char));
   bwt = malloc(1+len/4 * sizeof(char));
   saca_bwt = malloc(1+len/4 * sizeof(char));
-  for (i = 0; i < (len+1)/4; ++i) {
+  for (i = 0; i <= len/4; ++i) {
     str[i] = (char)rand();
   }
   str[len/4] &= (0xFF << 2*(4 - (len&3)));
@@ -45,13 +136,13 @@ int main(int argc, char **argv) {
   // (Obfuscatedly) appends the sentinel character ;)
   //bwt = makebwt(str, len);
   rdtscll(a);
-  i = makecbwt(str, len, bwt);
+  primary = makecbwt(str, len, bwt);
   rdtscll(b);
   puts("Using parallelized histogram sort");
   printf("%u nucleotides processed in %lld cycles (%f seconds)\n",
 	 len, (b-a), ((double)(b-a)) / 2500000000.);
   rdtscll(a);
-  i = saca_makecbwt(str, len, saca_bwt);
+  saca_primary = saca_makecbwt(str, len, saca_bwt);
   rdtscll(b);
   puts("Using SACA-K");
   printf("%u nucleotides processed in %lld cycles (%f seconds)\n",
@@ -60,19 +151,50 @@ int main(int argc, char **argv) {
   // as much memory and 2) not being as fast (due to saca-k being
   // damn near impossible to parallelize nicely)
   
-  /*
-    for (i = 0; i < len; ++i) {
+  
+  for (i = 0; i < len; ++i) {
     if (getbase(bwt, i) != getbase(saca_bwt, i)) {
-    printf("Mismatch at base %u, %u %u", 
-    i, getbase(bwt, i), getbase(saca_bwt,i));
-    }
+      printf("Mismatch at base %u, %u %u\n",
+	     i, getbase(bwt, i), getbase(saca_bwt,i));
+      ++bad;
+      break;
     }
-    if (i == len)
-    printf("Sequences match\n"); */
+  }
+  if (primary != saca_primary) {
+    printf("Primary index %lld, not %lld\n", (long long)primary,
+	   (long long)saca_primary);
+    ++bad;
+  }
+  if (!bad)
+    printf("Sequences match\n");
+
+  // Now the suffix arrays themselves, on the random sequence and on some
+  // repetitive ones, which are where the sorts have to work hardest: the
+  // random half repeated, and a short period with the odd base changed
+  pool = taskpool_create(4);
+  bad += check_sa("random sequence", str, len, pool);
+  // A repeat few enough suffixes are in for histsort to finish itself (the
+  // ones below are repetitive enough that it hands them to SACA-K)
+  for (i = 0; i < len / 100; ++i)
+    setbase(str, len / 2 + i, getbase(str, len / 4 + i));
+  bad += check_sa("random sequence with a repeat", str, len, pool);
+  memset(str, 0, len/4 + 2);
+  for (i = 0; i < len; ++i)
+    setbase(str, i, i < len/2 ? rand() & 3 : getbase(str, i - len/2));
+  bad += check_sa("repeated sequence", str, len, pool);
+  memset(str, 0, len/4 + 2);
+  for (i = 0; i < len; ++i)
+    setbase(str, i, i % 997 == 0 ? rand() & 3 : (i % 7) & 3);
+  bad += check_sa("tandem repeat", str, len, pool);
+  taskpool_destroy(pool);
+  if (bad)
+    printf("%d suffix arrays differ from csuff_arr()\n", bad);
+  else
+    printf("Suffix arrays match\n");
   free(str);
   free(bwt);
   free(saca_bwt);
   /* Saves ~7.5% memory, some performance gain at large array sizes
      Peak memory usage is about 9.25 bytes * len */
-  return 0;
+  return bad != 0;
 }
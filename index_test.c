@@ -80,6 +80,8 @@ int main(int argc, char **argv) {
   }
   fmi = read_index(seq, ifp);
   fclose(ifp);
+  if (fmi == NULL)
+    exit(-1);
   // And we're done! Well, okay, we might want to align some sequences.
   int seqlen = 30;
   buf = malloc(seqlen); // The C/C++ standard guarantees that sizeof(char) == 1
@@ -104,6 +106,53 @@ int main(int argc, char **argv) {
 	  b-a, seqlen);
   fprintf(stderr, "(%f seconds), over a genome of length %d\n", 
 	 ((double)(b-a)) / 2500000000, len);
+
+  // Now see how many LF() steps unc_sa() takes for random rows; with row
+  // sampling this has a long tail (repeats), with text sampling it's never
+  // more than the rate - 1
+#define MAX_STEPS 1024
+  int rate = 1 << fmi->sa_shift, steps, maxsteps = 0;
+  long long *hist = calloc(MAX_STEPS + 1, sizeof(long long)), total = 0;
+  rdtscll(a);
+  for (i = 0; i < 1000000; ++i) {
+    j = rand() % (len + 1);
+    steps = unc_sa_steps(fmi, j);
+    total += steps;
+    if (steps > maxsteps)
+      maxsteps = steps;
+    hist[steps < MAX_STEPS ? steps : MAX_STEPS]++;
+  }
+  rdtscll(b);
+  fprintf(stderr, "%s sampling, rate %d: %f LF() steps per row on average "
+	  "(%f cycles per row), max %d\n",
+	  fmi->sa_mode == SA_TEXT ? "Text" : "Row", rate, total / 1000000.0,
+	  (double)(b-a) / 1000000, maxsteps);
+  {
+    // Percentiles, then the histogram in buckets of rate/8
+    static const int pct[] = {50, 90, 99, 100};
+    long long sum = 0;
+    int p = 0, w = rate >= 8 ? rate / 8 : 1;
+    for (k = 0; k <= MAX_STEPS && p < 4; ++k) {
+      sum += hist[k];
+      while (p < 4 && sum * 100 >= pct[p] * 1000000LL)
+	fprintf(stderr, "  p%d: %s%d steps\n", pct[p++],
+		k == MAX_STEPS ? ">= " : "", k);
+    }
+    // Anything past twice the rate goes in the last bucket
+    for (k = 0; k <= maxsteps; k += w) {
+      sum = 0;
+      if (k >= 2 * rate || k + w > MAX_STEPS) {
+	for (jj = k; jj <= MAX_STEPS; ++jj)
+	  sum += hist[jj];
+	fprintf(stderr, "  %4d+    : %lld\n", k, sum);
+	break;
+      }
+      for (jj = k; jj < k + w; ++jj)
+	sum += hist[jj];
+      fprintf(stderr, "  %4d-%4d: %lld\n", k, k + w - 1, sum);
+    }
+  }
+  free(hist);
   destroy_fmi(fmi);
   free(seq);
   free(buf);
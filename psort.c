@@ -0,0 +1,275 @@
+// A multithreaded suffix array construction, for when speed matters more
+// than memory: SACA-K (csacak.c) takes a word per base but only ever uses one
+// core, and the histogram sort (histsortcomp.c) and the blockwise sort
+// (blockwise.c) save memory too, at some cost in time. This one spends three
+// words per base to go as fast as the cores allow, however repetitive the
+// sequence.
+// This is prefix doubling (Manber and Myers, with Larsson and Sadakane's trick
+// of only going back over the groups which aren't sorted yet): the suffixes
+// are first bucketed by their first PS_K bases, then each round sorts the
+// suffixes within each group of ties by the rank of the suffix h bases
+// further on, which sorts them by their first 2h bases. Every group can be
+// sorted independently of the others, so each round is split between the
+// threads a chunk of groups at a time, and the initial bucketing is a
+// counting sort with a histogram per thread.
+// Uses three words per base (SA, inverse SA and the sort keys), plus the list
+// of groups still unsorted, so it's no use when memory is tight.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "psort.h"
+
+#define PS_K 8 // Bases in the initial bucket key
+#define PS_BUCKETS 390625 // 5^PS_K: each base is 1-4, or 0 past the end
+#define PS_CHUNK 64 // Groups a thread takes at a time
+
+static inline unsigned char getbase(const char *str, bwtint_t idx) {
+  // Gets the base at the appropriate index
+  return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
+}
+
+// The bucket of the suffix starting at i; the '$' (i = len) is bucket 0, and
+// a suffix shorter than PS_K comes before everything it's a prefix of, as it
+// should
+static inline unsigned int ps_key(const char *str, bwtint_t len, bwtint_t i) {
+  unsigned int k = 0;
+  int j;
+  for (j = 0; j < PS_K; ++j)
+    k = k * 5 + (i + j < len ? getbase(str, i + j) + 1 : 0);
+  return k;
+}
+
+typedef struct {
+  bwtint_t key, idx;
+} ps_pair;
+
+// What all the threads work on; groups holds (start, end) pairs of the
+// ranges of the SA which are still ties
+typedef struct {
+  const char *str;
+  bwtint_t len, h;
+  bwtint_t *sa, *isa, *key;
+  bwtint_t *hist, *bstart; // nthreads * PS_BUCKETS and PS_BUCKETS
+  bwtint_t *groups;
+  size_t ngroups, next;
+  int nthreads;
+} ps_shared;
+
+// And what each one keeps to itself: the new groups it's found (which are
+// put together once the round is over) and a buffer for qsort()
+typedef struct {
+  ps_shared *s;
+  int t;
+  bwtint_t *out;
+  size_t nout, capout;
+  ps_pair *buf;
+  size_t capbuf;
+} ps_thread;
+
+// Each thread counts the buckets of its own slice of the suffixes...
+static void *ps_count(void *arg) {
+  ps_thread *p = arg;
+  ps_shared *s = p->s;
+  bwtint_t n = s->len + 1, i;
+  bwtint_t *hist = s->hist + (size_t)p->t * PS_BUCKETS;
+  for (i = n / s->nthreads * p->t;
+       i < (p->t == s->nthreads - 1 ? n : n / s->nthreads * (p->t + 1)); ++i)
+    ++hist[ps_key(s->str, s->len, i)];
+  return NULL;
+}
+
+// ...and, once those have been turned into where its share of each bucket
+// starts, puts them there. The suffixes within a bucket stay in order of
+// position, although that doesn't matter since they're sorted later anyway.
+static void *ps_scatter(void *arg) {
+  ps_thread *p = arg;
+  ps_shared *s = p->s;
+  bwtint_t n = s->len + 1, i;
+  bwtint_t *hist = s->hist + (size_t)p->t * PS_BUCKETS;
+  for (i = n / s->nthreads * p->t;
+       i < (p->t == s->nthreads - 1 ? n : n / s->nthreads * (p->t + 1)); ++i) {
+    unsigned int k = ps_key(s->str, s->len, i);
+    s->sa[hist[k]++] = i;
+    s->isa[i] = s->bstart[k];
+  }
+  return NULL;
+}
+
+static int ps_cmp(const void *a, const void *b) {
+  bwtint_t x = ((const ps_pair *)a)->key, y = ((const ps_pair *)b)->key;
+  return (x > y) - (x < y);
+}
+
+// Sorts a group by the rank of the suffix h further on. The ranks of the
+// suffixes in the group (and so of the others the keys come from) don't
+// change until every group is done, since that's done separately (below).
+static void ps_sort_group(ps_thread *p, bwtint_t start, bwtint_t end) {
+  ps_shared *s = p->s;
+  bwtint_t *sa = s->sa, *key = s->key, i, j;
+  for (i = start; i < end; ++i)
+    key[i] = s->isa[sa[i] + s->h];
+  if (end - start <= 16) {
+    // Insertion sort; most groups are tiny by the time we get to them
+    for (i = start + 1; i < end; ++i) {
+      bwtint_t k = key[i], x = sa[i];
+      for (j = i; j > start && key[j-1] > k; --j) {
+	key[j] = key[j-1];
+	sa[j] = sa[j-1];
+      }
+      key[j] = k;
+      sa[j] = x;
+    }
+    return;
+  }
+  if (p->capbuf < end - start) {
+    free(p->buf);
+    p->capbuf = end - start;
+    p->buf = malloc(p->capbuf * sizeof(ps_pair));
+  }
+  for (i = start; i < end; ++i) {
+    p->buf[i - start].key = key[i];
+    p->buf[i - start].idx = sa[i];
+  }
+  qsort(p->buf, end - start, sizeof(ps_pair), ps_cmp);
+  for (i = start; i < end; ++i) {
+    key[i] = p->buf[i - start].key;
+    sa[i] = p->buf[i - start].idx;
+  }
+}
+
+// Splits a sorted group wherever the key changes, giving each suffix the
+// rank of the start of its new group, and keeps the ones which are still
+// ties for the next round
+static void ps_split_group(ps_thread *p, bwtint_t start, bwtint_t end) {
+  ps_shared *s = p->s;
+  bwtint_t i, j, g = start;
+  for (i = start; i <= end; ++i) {
+    if (i < end && s->key[i] == s->key[g])
+      continue;
+    if (i - g > 1) {
+      if (p->nout + 2 > p->capout) {
+	p->capout = p->capout ? 2 * p->capout : 1024;
+	p->out = realloc(p->out, p->capout * sizeof(bwtint_t));
+      }
+      p->out[p->nout++] = g;
+      p->out[p->nout++] = i;
+    }
+    for (j = g; j < i; ++j)
+      s->isa[s->sa[j]] = g;
+    g = i;
+  }
+}
+
+// The splitting has to wait until every group is sorted, since it changes
+// the ranks the keys are taken from; hence the two passes
+static void *ps_sort_pass(void *arg) {
+  ps_thread *p = arg;
+  ps_shared *s = p->s;
+  size_t g, e;
+  while ((g = __sync_fetch_and_add(&s->next, PS_CHUNK)) < s->ngroups) {
+    e = g + PS_CHUNK < s->ngroups ? g + PS_CHUNK : s->ngroups;
+    for (; g < e; ++g)
+      ps_sort_group(p, s->groups[2*g], s->groups[2*g+1]);
+  }
+  return NULL;
+}
+
+static void *ps_split_pass(void *arg) {
+  ps_thread *p = arg;
+  ps_shared *s = p->s;
+  size_t g, e;
+  while ((g = __sync_fetch_and_add(&s->next, PS_CHUNK)) < s->ngroups) {
+    e = g + PS_CHUNK < s->ngroups ? g + PS_CHUNK : s->ngroups;
+    for (; g < e; ++g)
+      ps_split_group(p, s->groups[2*g], s->groups[2*g+1]);
+  }
+  return NULL;
+}
+
+static void ps_run(ps_thread *th, int nthreads, void *(*fn)(void *)) {
+  pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+  int t;
+  th[0].s->next = 0;
+  for (t = 0; t < nthreads; ++t)
+    pthread_create(&threads[t], NULL, fn, &th[t]);
+  for (t = 0; t < nthreads; ++t)
+    pthread_join(threads[t], NULL);
+  free(threads);
+}
+
+bwtint_t *psuff_arr(const char *str, bwtint_t len, int nthreads) {
+  ps_shared s;
+  ps_thread *th;
+  bwtint_t n = len + 1, tot = 0, c;
+  size_t b, g;
+  int t;
+  if (nthreads < 1)
+    nthreads = 1;
+  memset(&s, 0, sizeof(s));
+  s.str = str;
+  s.len = len;
+  s.nthreads = nthreads;
+  s.sa = malloc(n * sizeof(bwtint_t));
+  s.isa = malloc(n * sizeof(bwtint_t));
+  s.key = malloc(n * sizeof(bwtint_t));
+  s.hist = calloc((size_t)nthreads * PS_BUCKETS, sizeof(bwtint_t));
+  s.bstart = malloc(PS_BUCKETS * sizeof(bwtint_t));
+  th = calloc(nthreads, sizeof(ps_thread));
+  for (t = 0; t < nthreads; ++t) {
+    th[t].s = &s;
+    th[t].t = t;
+  }
+  ps_run(th, nthreads, ps_count);
+  for (b = 0; b < PS_BUCKETS; ++b) {
+    s.bstart[b] = tot;
+    for (t = 0; t < nthreads; ++t) {
+      c = s.hist[(size_t)t * PS_BUCKETS + b];
+      s.hist[(size_t)t * PS_BUCKETS + b] = tot;
+      tot += c;
+    }
+  }
+  ps_run(th, nthreads, ps_scatter);
+  free(s.hist);
+  // The buckets with more than one suffix in them are the first groups
+  for (b = 0; b < PS_BUCKETS; ++b) {
+    bwtint_t e = b + 1 < PS_BUCKETS ? s.bstart[b+1] : n;
+    if (e - s.bstart[b] > 1) {
+      if (th[0].nout + 2 > th[0].capout) {
+	th[0].capout = th[0].capout ? 2 * th[0].capout : 1024;
+	th[0].out = realloc(th[0].out, th[0].capout * sizeof(bwtint_t));
+      }
+      th[0].out[th[0].nout++] = s.bstart[b];
+      th[0].out[th[0].nout++] = e;
+    }
+  }
+  free(s.bstart);
+  for (s.h = PS_K; ; s.h *= 2) {
+    // Gather up the groups the threads found last time
+    for (g = 0, t = 0; t < nthreads; ++t)
+      g += th[t].nout;
+    if (!g)
+      break;
+    free(s.groups);
+    s.groups = malloc(g * sizeof(bwtint_t));
+    for (g = 0, t = 0; t < nthreads; ++t) {
+      // A thread which found no groups hasn't got an out at all
+      if (th[t].nout)
+	memcpy(s.groups + g, th[t].out, th[t].nout * sizeof(bwtint_t));
+      g += th[t].nout;
+      th[t].nout = 0;
+    }
+    s.ngroups = g / 2;
+    ps_run(th, nthreads, ps_sort_pass);
+    ps_run(th, nthreads, ps_split_pass);
+  }
+  for (t = 0; t < nthreads; ++t) {
+    free(th[t].out);
+    free(th[t].buf);
+  }
+  free(th);
+  free(s.groups);
+  free(s.key);
+  free(s.isa);
+  return s.sa;
+}
@@ -0,0 +1,11 @@
+#ifndef _PSORT_H
+#define _PSORT_H
+#include "bwtint.h"
+
+// Builds the suffix array of a packed sequence of len bases using nthreads
+// threads; the result is exactly what csuff_arr() gives (len + 1 entries,
+// the first being len, for the '$'). Uses about three words per base, where
+// csuff_arr() uses one, plus some for the list of groups still unsorted.
+bwtint_t *psuff_arr(const char *str, bwtint_t len, int nthreads);
+
+#endif /* _PSORT_H */
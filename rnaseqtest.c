@@ -40,11 +40,12 @@ static inline int fnw_acc(int *values, int i, int j, int width) {
 
 // TODO: write a more specialized version for "continuing" searches (e.g. take
 // a gap of 3 on either side); stitching is trivial by comparison
-int mms_search(const fm_index *fmi, const char *pattern, int len,
-	       int *len_p, int cutoff) {
+bwtint_t mms_search(const fm_index *fmi, const char *pattern, int len,
+		    int *len_p, int cutoff) {
   // Structurally almost identical to locate(), except for the way we use
   // len...
-  int start, end, i;
+  bwtint_t start, end;
+  int i;
   start = fmi->C[pattern[len-1]];
   end = fmi->C[pattern[len-1]+1];
   for (i = len-2; i >= 0; --i) {
@@ -72,12 +73,13 @@ int mms_search(const fm_index *fmi, const char *pattern, int len,
 // MMS found and tries to continue it if possible; to compensate for this
 // we allow a much smaller value for cutoff (noting that the relation of
 // cutoff to statistical significance is exponential!)
-int mms_continue(const fm_index *fmi, const char *pattern, int len,
-		 int *len_p, int cutoff, int lastpos) {
+bwtint_t mms_continue(const fm_index *fmi, const char *pattern, int len,
+		      int *len_p, int cutoff, bwtint_t lastpos) {
   // Tries to continue a MMS search with the knowledge of the previous position;
   // this allows us to (usually) continue the search if we have some mismatch
   // or indel rather than a splice site
-  int start, end, i, j, pos;
+  bwtint_t start, end, j, pos;
+  int i;
   start = fmi->C[pattern[len-1]];
   end = fmi->C[pattern[len-1]+1];
   for (i = len-2; i >= 0; --i) {
@@ -110,7 +112,7 @@ int mms_continue(const fm_index *fmi, const char *pattern, int len,
       for (j = start; j < end; ++j) {
 	// Check the position of j
 	pos = unc_sa(fmi, j);
-	fprintf(stderr, "%d\n", lastpos - (pos+cutoff));
+	fprintf(stderr, "%lld\n", (long long)(lastpos - (pos+cutoff)));
 	if ((pos < lastpos) && (lastpos - (pos + cutoff) <= 6)) {
 	  start = j;
 	  end = j+1;
@@ -128,13 +130,14 @@ int mms_continue(const fm_index *fmi, const char *pattern, int len,
 
 // Another variant of locate(); this one does not try to continue the previous
 // search, so this has a loop removed from mms_continue.
-int mms_gap(const fm_index *fmi, const char *pattern, int len,
-		 int *len_p, int cutoff, int lastpos) {
+bwtint_t mms_gap(const fm_index *fmi, const char *pattern, int len,
+		 int *len_p, int cutoff, bwtint_t lastpos) {
   // Tries to continue a MMS search with the knowledge of the previous position;
   // We abandon explicitly isolating the match that continues the previous
   // search (one interesting "optimization" to try would be to isolate the
   // match closest to the previous search and see whether that improves things)
-  int start, end, i, j, pos;
+  bwtint_t start, end, j, pos;
+  int i;
   int score; // Keep a running tally of the score of the alignment so far
   // TODO: borrow scoring ideas from bowtie or something
   start = fmi->C[pattern[len-1]];
@@ -159,6 +162,37 @@ int mms_gap(const fm_index *fmi, const char *pattern, int len,
   return unc_sa(fmi, start);
 }
 
+// Most places a seed can occur for smem_stitch() to look through them all;
+// anything more repetitive than that doesn't tell us where the read goes
+#define STITCH_MAX_OCC 16
+
+// Finds where a seed (an SMEM to the left of the part of the read aligned so
+// far, which starts at pattern[readpos] and at lastpos on the genome) fits
+// in front of it, and returns that position (-1 if there isn't one). It has
+// to lie before lastpos, and can't be more than a codon further along the
+// genome than it would be with no gap at all (which allows for a codon
+// inserted in the read); a deletion or an intron just puts it further back,
+// so we take the nearest one. A seed which overlaps the aligned part of the
+// read can only be off by a codon the other way too, though: anything else
+// is a chance match of the bases around a mismatch.
+bwtint_t smem_stitch(const fm_index *fmi, const smem *seed, int readpos,
+		     bwtint_t lastpos) {
+  bwtint_t j, pos, best = -1;
+  bwtint_t diag = lastpos - readpos; // Where the seed goes with no gap
+  if (seed->iv.size > STITCH_MAX_OCC)
+    return -1;
+  for (j = seed->iv.fsp; j < seed->iv.fsp + seed->iv.size; ++j) {
+    pos = unc_sa(fmi, j);
+    if (pos >= lastpos || pos - seed->start > diag + 3)
+      continue;
+    if (seed->end > readpos && pos - seed->start < diag - 3)
+      continue;
+    if (pos > best)
+      best = pos;
+  }
+  return best;
+}
+
 // "Traditional" gapped alignment search
 // Unidirectional search with no real tricks; meant to be fast, but doesn't
 // guarantee best alignment or finding an alignment if one exists
@@ -180,10 +214,10 @@ void rna_seq(const fm_index *fmi, const char *pattern, int len) {
   // equivalent) maximum mappable suffixes instead to get O(m + log(n)) time
   // We could just reverse the genome to get equivalent results anyway
   
-  // TODO: Adding a reverse FM-index may allow us to double anchor the search
-  // for better accuracy? (Particularly if we have paired reads or something)
+  // With bidirectional search (fmi_bidir()) we seed from SMEMs instead: see below
 
-  int i, mmslen, mmspos, genpos, nextpos;
+  int i, mmslen;
+  bwtint_t mmspos, genpos, nextpos;
   // We begin indexing from the end of the pattern. Reverse search to find
   // a "statistically significant" match (len - log_4(fmi->len) > 2, for
   // example, makes a decent cutoff). Use needleman-wunsch or a specialized
@@ -194,17 +228,50 @@ void rna_seq(const fm_index *fmi, const char *pattern, int len) {
   // function (by abusing unions in a somewhat non-portable way). log2 is
   // apparently only in C11 (and not implemented in gcc!); check your local
   // version of tgmath.h to see if you have a library implementation
-  mmspos = mms_search(fmi, pattern, i, &mmslen, 14);
-  while ((mmspos == -1) && i > 14) {
-    --i;
+  if (fmi_bidir(fmi)) {
+    // With a reverse index find_smems() gives us every maximal match in one
+    // pass, so instead of restarting the search from further and further
+    // left we anchor on the rightmost one which is long enough and only
+    // occurs once, then stitch on each one to the left of it which fits (see
+    // smem_stitch()). Whatever's left in front of the last one stitched on is
+    // extended just as below; if that was at the very start of the read
+    // there's nothing left to do.
+    smem *seeds = malloc(len * sizeof(smem));
+    int nseeds = find_smems(fmi, pattern, len, 15, seeds);
+    int j = nseeds - 1;
+    while (j >= 0 && seeds[j].iv.size != 1)
+      --j;
+    if (j >= 0) {
+      mmspos = unc_sa(fmi, seeds[j].iv.fsp);
+      i = seeds[j].start;
+      // SMEMs come in order of start, and no two start in the same place, so
+      // every one before this starts further left (though it may overlap it)
+      while (--j >= 0) {
+	nextpos = smem_stitch(fmi, &seeds[j], i, mmspos);
+	if (nextpos != -1) {
+	  mmspos = nextpos;
+	  i = seeds[j].start;
+	}
+      }
+    }
+    else {
+      mmspos = -1;
+      i = 0;
+    }
+    free(seeds);
+  }
+  else {
     mmspos = mms_search(fmi, pattern, i, &mmslen, 14);
-    // We need *somewhere* to start...
+    while ((mmspos == -1) && i > 14) {
+      --i;
+      mmspos = mms_search(fmi, pattern, i, &mmslen, 14);
+      // We need *somewhere* to start...
+    }
+    // Now that we have a starting position, "stitch" the stuff behind it if
+    // necessary
+    // TODO: write the helper function to do that
+    i -= mmslen; // LOL forgot that.
   }
-  // Now that we have a starting position, "stitch" the stuff behind it if
-  // necessary
-  // TODO: write the helper function to do that
-  i -= mmslen; // LOL forgot that.
-  //fprintf(stderr, "%d\n", i);
   while (i > 18) { // There's kind of a point where we should just give up
     genpos = mmspos;
     // Skip ahead 3 nucleotides (i.e. 1 codon; this deals with deletions of
@@ -238,7 +305,7 @@ void rna_seq(const fm_index *fmi, const char *pattern, int len) {
     // Main loop of function
   }
   // TODO: Do something at the end of the thingy
-  printf("%d ", mmspos);
+  printf("%lld ", (long long)mmspos);
   // TODO: something more useful
 }
 
@@ -303,7 +370,8 @@ int main(int argc, char **argv) {
   }
   fclose(fp);
   // Now that we've loaded the sequence (ish) we can build an fm-index on it
-  fmi = make_fmi(seq, len);
+  fmi = make_fmi(seq, len, SA_SHIFT, SA_ROWS);
+  fmi_build_rev(fmi, seq);
   // Do some fun tests (load up a length 30 sequence (starting from anywhere
   // on the "genome") and backwards search for it on the fm-index (and we're
   // going to fix locate() now too)
@@ -1,7 +1,13 @@
 // Tries aligning reads from a file against an index and sequence read from
 // file
 
-// usage: search_reads seqfile indexfile readfile
+// usage: search_reads [seqfile] indexfile readfile
+// With an index built with build_index -f, which has both strands, only the
+// read as given is searched for; its matches on the reverse strand are
+// given just as if its reverse complement had been searched for.
+// With an index of a FASTA file, locations are given as contig:position
+// (see build_index.c), and both matches of a read have to be in the same
+// contig.
 
 #include <stdio.h>
 #include <string.h>
@@ -13,72 +19,48 @@
 #include "rdtscll.h"
 #include "time.h"
 
-static inline unsigned char getbase(const char *str, int idx) {
+static inline unsigned char getbase(const char *str, bwtint_t idx) {
 	// Gets the base at the appropriate index
 	return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
 }
 
+// Prints where a match of len bases is: in terms of the contigs, if the
+// index has them
+static void print_pos(const fm_index *fmi, bwtint_t pos, int len) {
+  bwtint_t off;
+  long long contig = fmi_contig(fmi, pos, len, &off);
+  if (fmi->contigs && contig >= 0)
+    printf("%s:%lld", fmi_contig_name(fmi, contig), (long long)off);
+  else
+    printf("%lld", (long long)pos);
+}
+
 // Reminder to self: buf length (i.e. maximum read length) is currently
 // hardcoded; change to a larger value (to align longer reads) or make it
 // dynamic
 
+// Number of reads searched together
+#define READ_BATCH 4096
+
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s seqfile indexfile readfile\n", argv[0]);
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s [seqfile] indexfile readfile\n", argv[0]);
+    fprintf(stderr, "(seqfile can be left out if the index includes the "
+	    "sequence)\n");
     exit(-1);
   }
-  char *seq, *seqfile, *indexfile, *readfile, *buf = malloc(256*256), *revbuf = malloc(256*256), c;
+  char *seq = NULL, *seqfile, *indexfile, *readfile, *buf = malloc(256*256);
   fm_index *fmi;
-  int len;
-  int i, j, k, jj;
-  FILE *sfp, *ifp, *rfp;
-  seqfile = argv[1];
-  indexfile = argv[2];
-  readfile = argv[3];
-  sfp = fopen(seqfile, "rb");
-  if (sfp == 0) {
-    fprintf(stderr, "Could not open sequence\n");
-    exit(-1);
-  }
-  fseek(sfp, 0L, SEEK_END);
-  len = ftell(sfp);
-  rewind(sfp);
-  seq = malloc(len/4+1);
-  for (i = 0; i < len/4 + 1; ++i) {
-    switch(fgetc(sfp)) {
-    case 'C': c = 64; break;
-    case 'G': c = 128; break;
-    case 'T': c = 192; break;
-    default: c = 0;
-    }
-    switch(fgetc(sfp)) {
-    case 'C': c ^= 16; break;
-    case 'G': c ^= 32; break;
-    case 'T': c ^= 48;
-    }
-    switch(fgetc(sfp)) {
-    case 'C': c ^= 4; break;
-    case 'G': c ^= 8; break;
-    case 'T': c ^= 12;
-    }
-    switch(fgetc(sfp)) {
-    case 'C': c ^= 1; break;
-    case 'G': c ^= 2; break;
-    case 'T': c ^= 3;
-    }
-    seq[i] = c;
+  bwtint_t len;
+  FILE *ifp, *rfp;
+  seqfile = (argc == 4) ? argv[1] : NULL;
+  indexfile = argv[argc-2];
+  readfile = argv[argc-1];
+  if (seqfile) {
+    seq = read_seq(seqfile, &len);
+    if (seq == 0)
+      exit(-1);
   }
-  // Handle the last character (which is at seq[len/4]
-  c = 0;
-  for (i = 0; i < len&3; ++i) {
-    switch(fgetc(sfp)) {
-    case 'C': c ^= 64 >> (2 * i); break;
-    case 'G': c ^= 128 >> (2 * i); break;
-    case 'T': c ^= 192 >> (2 * i);
-    }
-    seq[len/4] = c;
-  }
-  fclose(sfp);
   
   // Open index file
   ifp = fopen(indexfile, "rb");
@@ -88,6 +70,17 @@ int main(int argc, char **argv) {
   }
   fmi = read_index(seq, ifp);
   fclose(ifp);
+  if (!fmi)
+    exit(-1);
+  if (!seqfile) {
+    // Use the copy of the sequence in the index
+    if (!fmi->ref) {
+      fprintf(stderr, "Index doesn't include the sequence, so it needs to be "
+	      "given\n");
+      exit(-1);
+    }
+    seq = (char *)fmi->ref;
+  }
 
   // And now we go read the index file
   rfp = fopen(readfile, "r");
@@ -99,72 +92,166 @@ int main(int argc, char **argv) {
   
   printf("Beginning alignment\n");
   int nread = 0;
+  // Reads are handled READ_BATCH at a time. Each read gives two patterns
+  // (2k is the read as given, 2k+1 its reverse complement), and each round
+  // does one mms() for every pattern that still has more than 20 bases left,
+  // through mms_batch()
+  char **text = malloc(READ_BATCH * sizeof(char *));
+  char **pats = malloc(2 * READ_BATCH * sizeof(char *));
+  const char **apats = malloc(2 * READ_BATCH * sizeof(char *));
+  int *plens = malloc(2 * READ_BATCH * sizeof(int));
+  int *alens = malloc(2 * READ_BATCH * sizeof(int));
+  int *active = malloc(2 * READ_BATCH * sizeof(int));
+  int *nmatch = malloc(2 * READ_BATCH * sizeof(int));
+  bwtint_t *mpos = malloc(2 * READ_BATCH * sizeof(bwtint_t));
+  int *mlen = malloc(2 * READ_BATCH * sizeof(int));
+  bwtint_t *sp = malloc(2 * READ_BATCH * sizeof(bwtint_t));
+  bwtint_t *ep = malloc(2 * READ_BATCH * sizeof(bwtint_t));
+  int *matched = malloc(2 * READ_BATCH * sizeof(int));
+  // Anchors found in a round, which are all located together at the end of it
+  int *hits = malloc(2 * READ_BATCH * sizeof(int));
+  bwtint_t *hitrows = malloc(2 * READ_BATCH * sizeof(bwtint_t));
+  bwtint_t *hitpos = malloc(2 * READ_BATCH * sizeof(bwtint_t));
+  int *hitlens = malloc(2 * READ_BATCH * sizeof(int));
   while (!feof(rfp)) {
-    if (! fgets(buf, 256*256-1, rfp))
-      continue;
-    int forward_pos, backward_pos;
-    int forward_match = 0, backward_match = 0;
-    // fgets() writes the ending newline if present, so we need to remove
-    // that
-    if (buf[strlen(buf)-1] == '\n')
-      buf[strlen(buf)-1] = 0;
-    int len = strlen(buf);
-    for (int k = 0; k < strlen(buf); ++k)
-      revbuf[k] = buf[strlen(buf)-k-1];
-    revbuf[strlen(buf)] = 0;
-    while (len > 20 /* Replace with user-specified constant? */) {
-      // Try aligning against the end of the read (MMS)
-      int start, end;
-      int matched = mms(fmi, buf, len, &start, &end);
-      if (matched >= 20) {
-	// Got an anchor length of >20
-	// Print out the matches
-	//printf("\n%d anchor(s) found with length %d for read %d\n", end - start, matched, nread);
-	//for (int j = start; j < end; ++j)
-	//printf("Starting at position %d\n", unc_sa(fmi, j));
-	forward_match++;
-	len -= matched;
-	forward_pos = unc_sa(fmi, start);
+    int nb = 0, nactive = 0;
+    while (nb < READ_BATCH && fgets(buf, 256*256-1, rfp)) {
+      // fgets() writes the ending newline if present, so we need to remove
+      // that
+      if (buf[0] && buf[strlen(buf)-1] == '\n')
+	buf[strlen(buf)-1] = 0;
+      int len = strlen(buf);
+      char *fwd = pats[2*nb] = malloc(len), *rev = pats[2*nb+1] = malloc(len);
+      for (int k = 0; k < len; ++k) {
+	switch(buf[k]) {
+	case 'A': fwd[k] = 0; rev[len-k-1] = 3; break;
+	case 'C': fwd[k] = 1; rev[len-k-1] = 2; break;
+	case 'G': fwd[k] = 2; rev[len-k-1] = 1; break;
+	case 'T': fwd[k] = 3; rev[len-k-1] = 0; break;
+	default: fwd[k] = rev[len-k-1] = 5; // 'N'
+	}
       }
-      else {
-	len -= 1; // this constant should probably be bigger than 1 for performance
-		  // reasons
+      text[nb] = strdup(buf);
+      for (int k = 2*nb; k < 2*nb+2; ++k) {
+	plens[k] = len;
+	nmatch[k] = 0;
+	// An FMD index has both strands, so the read as given finds the
+	// reverse complement's matches too (see below)
+	if (len > 20 /* Replace with user-specified constant? */ &&
+	    !(fmi->fmd && (k & 1)))
+	  active[nactive++] = k;
       }
+      nb++;
     }
-    len = strlen(revbuf);
-     while (len > 20 /* Replace with user-specified constant? */) {
+    while (nactive) {
       // Try aligning against the end of the read (MMS)
-      int start, end;
-      int matched = mms(fmi, revbuf, len, &start, &end);
-      if (matched >= 20) {
-	// Got an anchor length of >20
-	// Print out the matches
-	//printf("\n%d anchor(s) found with length %d for read %d\n", end - start, matched, nread);
-	//for (int j = start; j < end; ++j)
-	//printf("Starting at position %d\n", unc_sa(fmi, j));
-	backward_match++;
-	len -= matched;
-	backward_pos = unc_sa(fmi, start);
+      for (int j = 0; j < nactive; ++j) {
+	apats[j] = pats[active[j]];
+	alens[j] = plens[active[j]];
+      }
+      mms_batch(fmi, nactive, apats, alens, sp, ep, matched);
+      int still = 0, nhits = 0;
+      for (int j = 0; j < nactive; ++j) {
+	int k = active[j];
+	// With an LCP array, rather than trying again from one base further
+	// left next round, carry on from where this search got to straight away
+	while (fmi->lcp && matched[j] < 20 && plens[k] - 1 > 20) {
+	  plens[k] -= 1;
+	  matched[j] = mms_shift(fmi, pats[k], plens[k], 1, matched[j], &sp[j],
+				 &ep[j]);
+	}
+	if (matched[j] >= 20) {
+	  // Got an anchor length of >20
+	  // Print out the matches
+	  //printf("\n%d anchor(s) found with length %d for read %d\n", ep[j] - sp[j], matched[j], nread);
+	  //for (int i = sp[j]; i < ep[j]; ++i)
+	  //printf("Starting at position %d\n", unc_sa(fmi, i));
+	  plens[k] -= matched[j];
+	  hits[nhits] = k;
+	  hitlens[nhits] = matched[j];
+	  hitrows[nhits++] = sp[j];
+	}
+	else {
+	  plens[k] -= 1; // this constant should probably be bigger than 1 for performance
+			 // reasons
+	}
+	if (plens[k] > 20)
+	  active[still++] = k;
       }
-      else {
-	len -= 1; // this constant should probably be bigger than 1 for performance
-		  // reasons
+      locate_rows(fmi, nhits, hitrows, hitpos, NULL);
+      for (int j = 0; j < nhits; ++j) {
+	int k = hits[j];
+	bwtint_t start, half = fmi->len / 2;
+	// Only the part of an anchor in the same piece of the sequence as its
+	// last base is a real match (see fmi_piece()); the bases before that
+	// go back to be searched again, and if what's left is too short it's
+	// as if there was no anchor here at all
+	fmi_piece(fmi, hitpos[j] + hitlens[j] - 1, &start);
+	if (start > hitpos[j]) {
+	  int keep = hitpos[j] + hitlens[j] - start;
+	  int back = keep >= 20 ? hitlens[j] - keep : hitlens[j] - 1;
+	  if (plens[k] <= 20 && plens[k] + back > 20)
+	    active[still++] = k;
+	  plens[k] += back;
+	  if (keep < 20)
+	    continue;
+	  hitlens[j] = keep;
+	  hitpos[j] = start;
+	}
+	// A match in the second half of an FMD index is one of the reverse
+	// complement in the first (see fmd_seq())
+	if (fmi->fmd && hitpos[j] >= half) {
+	  k |= 1;
+	  hitpos[j] = 2*half - hitpos[j] - hitlens[j];
+	}
+	nmatch[k]++;
+	mpos[k] = hitpos[j];
+	mlen[k] = hitlens[j];
       }
+      nactive = still;
     }
-    if (forward_match && backward_match && (abs(forward_pos - backward_pos) < 10000)) {
-      printf("\nRead %d: Aligned both forward (%d) and backward (%d)\n",
-             nread, forward_match, backward_match);
-      printf("At locations %d and %d respectively\n", forward_pos, backward_pos);
-      printf("%s\n", buf);
+    for (int k = 0; k < nb; ++k) {
+      int forward_match = nmatch[2*k], backward_match = nmatch[2*k+1];
+      bwtint_t off;
+      if (forward_match && backward_match && (llabs(mpos[2*k] - mpos[2*k+1]) < 10000) &&
+	  fmi_contig(fmi, mpos[2*k], mlen[2*k], &off) ==
+	  fmi_contig(fmi, mpos[2*k+1], mlen[2*k+1], &off)) {
+	printf("\nRead %d: Aligned both forward (%d) and backward (%d)\n",
+	       nread, forward_match, backward_match);
+	printf("At locations ");
+	print_pos(fmi, mpos[2*k], mlen[2*k]);
+	printf(" and ");
+	print_pos(fmi, mpos[2*k+1], mlen[2*k+1]);
+	printf(" respectively\n");
+	printf("%s\n", text[k]);
+      }
+      nread++;
+      free(text[k]);
+      free(pats[2*k]);
+      free(pats[2*k+1]);
     }
-
-    nread++;
   }
   fclose(rfp);
   
   free(buf);
-  free(revbuf);
+  free(text);
+  free(pats);
+  free(apats);
+  free(plens);
+  free(alens);
+  free(active);
+  free(nmatch);
+  free(mpos);
+  free(mlen);
+  free(hits);
+  free(hitrows);
+  free(hitpos);
+  free(hitlens);
+  free(sp);
+  free(ep);
+  free(matched);
   destroy_fmi(fmi);
-  free(seq);
+  if (seqfile)
+    free(seq);
   return 0;
 }
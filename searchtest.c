@@ -68,7 +68,7 @@ int main(int argc, char **argv) {
   }
   fclose(fp);
   // Now that we've loaded the sequence (ish) we can build an fm-index on it
-  fmi = make_fmi(seq, len);
+  fmi = make_fmi(seq, len, SA_SHIFT, SA_ROWS);
   // Do some fun tests (load up a length 30 sequence (starting from anywhere
   // on the "genome") and backwards search for it on the fm-index (and we're
   // going to fix locate() now too)
@@ -5,231 +5,1131 @@
 // Compression is probably possible but will slow things down and is largely
 // pointless (a genome is not that big anyway)
 
-// TODO (maybe): We can optimize some code if blocksize is required to be
-// a power of 2 rather than a multiple of 4
+// The block size is a power of 2, so finding a block is a shift and a
+// multiply, and counting within a block is done a 64-bit word (32 symbols)
+// at a time with popcount rather than a byte at a time through a table
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <emmintrin.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "seqindex.h"
 #include "histsortcomp.h"
 #include "csacak.h"
+#include "psort.h"
+#include "blockwise.h"
 
-static inline unsigned char getbase(const char *str, int idx) {
+static inline unsigned char getbase(const char *str, bwtint_t idx) {
   // Gets the base at the appropriate index
   return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
 }
 
-int **seq_index(char *bwt, int len, int blocksize,const unsigned char *tbl) {
-  // len is, as usual, the length of the bwt. bwt is in compressed form.
-  // blocksize is assumed to be a multiple of 4 and is the number of
-  // base pairs per block.
-  // index, unlike lookup_table, is a 2D array, largely because I feel
-  // like it.
-  // tbl is the return value of lookup_table() (because who wants to call
-  // it more than once?).
-  int i, j, **index;
-  unsigned char c; // Apparently C does something odd when casting
-  // unsigned char to unsigned int... by sign extending
-  // which is certainly not what I want
-  
-  // Compiling with full warnings will give you tons of rubbish about
-  // array indexing with a char; I know perfectly well what I'm doing.
-  index = malloc((1+((len+blocksize-1)/blocksize)) * sizeof(int *));
-  
-  index[0] = calloc(4, sizeof(int));
-  // Do the first loop separately to avoid complicated logic
-  for (j = 1; j < 1 + (len/blocksize); ++j) {
-    index[j] = malloc(4 * sizeof(int));
-    index[j][0] = index[j-1][0];
-    index[j][1] = index[j-1][1];
-    index[j][2] = index[j-1][2];
-    index[j][3] = index[j-1][3];
-    for (i = -blocksize/4; i; ++i) {
-      // Beautifully obfuscated loop unroll
-      c = bwt[j*(blocksize/4) + i];
-      index[j][0] += tbl[4 * c];
-      index[j][1] += tbl[4 * c + 1];
-      index[j][2] += tbl[4 * c + 2];
-      index[j][3] += tbl[4 * c + 3];
+static inline const rank_block *occ_block(const rank_block *occ, int shift,
+					  bwtint_t idx) {
+  return (const rank_block *)((const unsigned long long *)occ +
+			      (size_t)(idx >> shift) * OCC_WORDS(shift));
+}
+
+// Each base repeated 32 times
+static const unsigned long long occ_pat[4] = {
+  0ULL, 0x5555555555555555ULL, 0xAAAAAAAAAAAAAAAAULL, 0xFFFFFFFFFFFFFFFFULL
+};
+
+// Counts the symbols equal to c in the positions of w selected by mask
+static inline int occ_count(unsigned long long w, char c,
+			    unsigned long long mask) {
+  // XORing with the pattern leaves 00 exactly where the symbol is c; fold
+  // each pair onto its low bit and count those
+  w ^= occ_pat[(int)c];
+  return __builtin_popcountll(~(w | (w >> 1)) & 0x5555555555555555ULL & mask);
+}
+
+// How to build suffix arrays; see fmi_set_build_threads() and
+// fmi_set_build_histsort(). 0 threads means the default (one for SACA-K, as
+// many as there are cores for histsort())
+static int build_threads = 0, build_hist = 0, build_blocks = 0;
+static size_t build_budget = 0;
+
+// Where the index's big arrays are built (see fmi_set_build_tmpdir()), and
+// which of them are mappings (of files there, or anonymous) rather than
+// malloc()ed
+static const char *build_tmpdir = NULL;
+static struct {
+  void *p;
+  size_t size;
+} *build_maps;
+static size_t build_nmaps, build_capmaps;
+
+// Arrays smaller than this aren't worth a mapping of their own
+#define BUILD_MAP_MIN (1 << 20)
+
+// Allocates one of the index's arrays, zeroed and 64-byte aligned (so the
+// blocks of the occurrence table don't straddle cache lines). A big one is a
+// mapping, so its pages only take up memory once they're written to (the
+// arrays are filled in while the suffix array is given back, and the two
+// needn't both be there in full). With a directory to build in, it's a
+// shared mapping of a file there, which is deleted straight away (so it
+// goes away with the mapping, however that happens): the kernel writes the
+// pages out as they're filled in, so building the index doesn't need the
+// memory for all of it at once.
+static void *build_alloc(size_t size) {
+  void *p = MAP_FAILED;
+  if (build_tmpdir && size >= BUILD_MAP_MIN) {
+    char *path = malloc(strlen(build_tmpdir) + 16);
+    int fd;
+    sprintf(path, "%s/fmiXXXXXX", build_tmpdir);
+    fd = mkstemp(path);
+    if (fd >= 0)
+      unlink(path);
+    free(path);
+    if (fd >= 0 && !ftruncate(fd, size))
+      p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0)
+      close(fd);
+    if (p == MAP_FAILED)
+      fprintf(stderr, "Couldn't make a %zu byte file in %s; building that "
+	      "part of the index in memory\n", size, build_tmpdir);
+  }
+  if (p == MAP_FAILED && size >= BUILD_MAP_MIN)
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	     -1, 0);
+  if (p != MAP_FAILED) {
+    if (build_nmaps == build_capmaps) {
+      build_capmaps = build_capmaps ? 2 * build_capmaps : 16;
+      build_maps = realloc(build_maps, build_capmaps * sizeof(*build_maps));
     }
+    build_maps[build_nmaps].p = p;
+    build_maps[build_nmaps++].size = size;
+    return p;
   }
-  // Handle some edge cases; notice how j went to len/blocksize rather
-  // than (len + (blocksize-1)) / blocksize
-  if (len % blocksize) {
-    index[j] = malloc(4 * sizeof(int));
-    index[j][0] = index[j-1][0];
-    index[j][1] = index[j-1][1];
-    index[j][2] = index[j-1][2];
-    index[j][3] = index[j-1][3];
-    // Count up the base pairs in the last block; this loop
-    // will also be unrolled, just for old time's sake
-    for (i = -blocksize/4; i < ((len%blocksize) - blocksize)/4 - !!(len%4); ++i) {
-      c = bwt[j*(blocksize/4) + i];
-      index[j][0] += tbl[4 * c];
-      index[j][1] += tbl[4 * c + 1];
-      index[j][2] += tbl[4 * c + 2];
-      index[j][3] += tbl[4 * c + 3];
+  if (posix_memalign(&p, 64, size ? size : 64))
+    return NULL;
+  memset(p, 0, size);
+  return p;
+}
+
+// Frees something from build_alloc() (or malloc())
+static void build_free(void *p) {
+  size_t i;
+  for (i = 0; i < build_nmaps; ++i)
+    if (build_maps[i].p == p) {
+      munmap(p, build_maps[i].size);
+      build_maps[i] = build_maps[--build_nmaps];
+      return;
     }
-    // Now we handle the last few base pairs (there are between
-    // 0 and 3 of them)
-    for (i = 0; i < (len&3); ++i) {
-      // Bitwise manipulations to make indexing easier
-      c = getbase(bwt, (len & 0xFFFFFFC) ^ i);
-      index[j][c]++;
+  free(p);
+}
+
+// Runs fn on each of the n structs (of size bytes apiece) in parts, with a
+// thread apiece (or in this thread, if there's only the one)
+static void run_parts(void *parts, size_t size, int n, void *(*fn)(void *)) {
+  pthread_t *threads;
+  int t;
+  if (n == 1) {
+    fn(parts);
+    return;
+  }
+  threads = malloc(n * sizeof(pthread_t));
+  for (t = 0; t < n; ++t)
+    pthread_create(&threads[t], NULL, fn, (char *)parts + t * size);
+  for (t = 0; t < n; ++t)
+    pthread_join(threads[t], NULL);
+  free(threads);
+}
+
+// Sets BWT[idx] to c in an occurrence table that starts out zeroed (so the
+// '$', stored as an A, doesn't need setting at all)
+static inline void occ_put(rank_block *occ, int shift, bwtint_t idx,
+			   unsigned long long c) {
+  rank_block *b = (rank_block *)occ_block(occ, shift, idx);
+  b->bwt[(idx & ((1 << shift) - 1)) >> 5] |= c << (2*(idx&31));
+}
+
+// Allocates an occurrence table for len+1 symbols (and the superblock counts
+// for it, or NULL if this isn't a BWT_LONG build), all zeroed
+static rank_block *occ_alloc(bwtint_t len, int shift, bwtint_t **super) {
+  rank_block *occ;
+  *super = NULL;
+#ifdef BWT_LONG
+  *super = calloc(1, occ_super_size(len));
+  if (!*super)
+    return NULL;
+#endif
+  if (!(occ = build_alloc(occ_size(len, shift)))) {
+    free(*super);
+    *super = NULL;
+  }
+  return occ;
+}
+
+// A stretch of an occurrence table for occ_count_blocks() to fill in the
+// counts of: the rows from start (the start of a block) to end, and the
+// counts before start (the counts up to end, once it's done)
+typedef struct {
+  rank_block *occ;
+  int shift;
+  bwtint_t *super;
+  bwtint_t start, end;
+  bwtint_t cnt[4];
+} occ_part;
+
+// Adds up the first n symbols of a block
+static inline void occ_block_counts(const rank_block *b, int n,
+				    bwtint_t cnt[4]) {
+  unsigned long long mask;
+  int j, c;
+  for (j = 0; j < n; j += 32) {
+    mask = n - j >= 32 ? ~0ULL : (1ULL << (2*(n-j))) - 1;
+    for (c = 0; c < 4; ++c)
+      cnt[c] += occ_count(b->bwt[j >> 5], c, mask);
+  }
+}
+
+static void *occ_total_part(void *arg) {
+  occ_part *p = arg;
+  bwtint_t i;
+  int n = 1 << p->shift;
+  memset(p->cnt, 0, sizeof(p->cnt));
+  for (i = p->start; i < p->end; i += n)
+    occ_block_counts(occ_block(p->occ, p->shift, i),
+		     p->end - i < n ? p->end - i : n, p->cnt);
+  return NULL;
+}
+
+// The counts at the start of each block are relative to its superblock,
+// whose counts must already be there
+static void *occ_fill_part(void *arg) {
+  static const bwtint_t zero[4] = {0};
+  occ_part *p = arg;
+  const bwtint_t *s = zero;
+  rank_block *b;
+  bwtint_t i;
+  int c, n = 1 << p->shift;
+  for (i = p->start; i < p->end; i += n) {
+    b = (rank_block *)occ_block(p->occ, p->shift, i);
+#ifdef BWT_LONG
+    s = p->super + 4 * (i >> OCC_SUPER_SHIFT);
+#endif
+    for (c = 0; c < 4; ++c)
+      b->cnt[c] = p->cnt[c] - s[c];
+    occ_block_counts(b, p->end - i < n ? p->end - i : n, p->cnt);
+  }
+  return NULL;
+}
+
+// Fills in the counts at the start of each block of an occurrence table once
+// all of its symbols are there (and the superblock counts). This only reads
+// the table itself, straight through. With more than one thread, the table
+// is split into stretches of whole blocks (and of whole superblocks, with
+// BWT_LONG): each thread adds up the symbols in its own, the totals are
+// summed to give the counts at the start of each stretch, and then each
+// thread goes through its stretch again putting them in.
+static void occ_count_blocks(rank_block *occ, bwtint_t len, int shift,
+			     bwtint_t *super, int nthreads) {
+  bwtint_t r, next, step, rows = len + 1, cnt[4] = {0};
+  int c, t, n = 0;
+  occ_part *parts;
+  rank_block *b;
+  if (nthreads < 1)
+    nthreads = 1;
+  step = ((rows / nthreads >> shift) + 1) << shift;
+  parts = calloc(nthreads + 1 + ((long long)rows >> OCC_SUPER_SHIFT),
+		 sizeof(occ_part));
+  for (r = 0; r < rows; r = next) {
+    next = rows - r < step ? rows : r + step;
+#ifdef BWT_LONG
+    if (next > (((r >> OCC_SUPER_SHIFT) + 1) << OCC_SUPER_SHIFT))
+      next = ((r >> OCC_SUPER_SHIFT) + 1) << OCC_SUPER_SHIFT;
+#endif
+    parts[n].occ = occ;
+    parts[n].shift = shift;
+    parts[n].super = super;
+    parts[n].start = r;
+    parts[n++].end = next;
+  }
+  if (n > 1)
+    run_parts(parts, sizeof(occ_part), n, occ_total_part);
+  for (t = 0; t < n; ++t)
+    for (c = 0; c < 4; ++c) {
+      r = parts[t].cnt[c];
+      parts[t].cnt[c] = cnt[c];
+      cnt[c] += r;
+#ifdef BWT_LONG
+      if (!(parts[t].start & ((1LL << OCC_SUPER_SHIFT) - 1)))
+	super[4 * (parts[t].start >> OCC_SUPER_SHIFT) + c] = parts[t].cnt[c];
+#endif
     }
+  run_parts(parts, sizeof(occ_part), n, occ_fill_part);
+  memcpy(cnt, parts[n-1].cnt, sizeof(cnt));
+  if (!(rows & ((1 << shift) - 1))) {
+    // The spare block
+    b = (rank_block *)occ_block(occ, shift, rows);
+#ifdef BWT_LONG
+    if (!(rows & ((1LL << OCC_SUPER_SHIFT) - 1)))
+      memcpy(super + 4 * (rows >> OCC_SUPER_SHIFT), cnt, sizeof(cnt));
+    for (c = 0; c < 4; ++c)
+      cnt[c] -= super[4 * (rows >> OCC_SUPER_SHIFT) + c];
+#endif
+    for (c = 0; c < 4; ++c)
+      b->cnt[c] = cnt[c];
   }
-  //for (i = 0; i < 1+((len+blocksize-1)/blocksize); ++i) {
-  //	printf("%d %d %d %d\n", index[i][0], index[i][1],
-  //		index[i][2], index[i][3]);
-  //}
-  return index;
+  free(parts);
 }
 
-// Calculates the index of character c (between 0 and 3) at index idx
-// in the given sequence index in the given Burrows-Wheeler transform
-int seq_rank(unsigned char *bwt, int **sidx, int blocksize, int idx, char c, const unsigned char * lookup) {
-  int x, i;
+rank_block *seq_index(const char *bwt, bwtint_t len, bwtint_t endloc,
+		      int shift, bwtint_t **super) {
+  // len is, as usual, the length of the original sequence, and bwt is the
+  // compressed BWT as returned by sprintcbwt() (i.e. without the '$').
+  // The index is a flat array of blocks of 1 << shift symbols, each holding
+  // the counts up to the start of the block followed by the block's part of
+  // the BWT; it covers all len+1 rows of the BWT, with the '$' at endloc
+  // stored as an A (rank() takes it back off again).
+  // There's always one block more than strictly necessary so that
+  // rank(fmi, c, len+1) doesn't need special casing.
+  // *super gets the superblock counts (see rank_block in seqindex.h), or
+  // NULL if this isn't a BWT_LONG build.
+  bwtint_t i;
+  rank_block *occ = occ_alloc(len, shift, super);
+  if (!occ)
+    return NULL;
+  for (i = 0; i <= len; ++i)
+    if (i != endloc)
+      occ_put(occ, shift, i, getbase(bwt, i - (i > endloc)));
+  occ_count_blocks(occ, len, shift, *super, build_threads);
+  return occ;
+}
+
+// The counts at the start of the superblock idx is in
+static inline bwtint_t occ_super(const fm_index *fmi, bwtint_t idx, int c) {
+#ifdef BWT_LONG
+  return fmi->occ_super[4 * (idx >> OCC_SUPER_SHIFT) + c];
+#else
+  return 0;
+#endif
+}
+
+// Calculates the number of occurrences of c (between 0 and 3) before idx in
+// the BWT stored in the given occurrence table, counting the '$' as an A
+// (and counting from the start of idx's superblock)
+unsigned int seq_rank(const rank_block *occ, int shift, bwtint_t idx, char c) {
+  const rank_block *b = occ_block(occ, shift, idx);
+  unsigned int x;
+  int i, r = idx & ((1 << shift) - 1);
   // First we look up the appropriate block prefix sum
-  x = sidx[idx/blocksize][c];
-  // Now we iterate through the block
-  /* unoptimized version */
-  //for (i = 0; i < idx % blocksize; i ++) {
-  //	if (getbase(bwt,(idx/blocksize)*blocksize + i) == c) {
-  //		++y;
-  //	}
-  //}
-  for (i = (idx/blocksize)*blocksize/4; i < idx/4; i++) {
-    x += lookup[4*bwt[i] + c];
-  }
-  for (i = 0 ; i < idx % 4; ++i) {
-    if (getbase(bwt, (idx & 0xFFFFFFFC) ^ i) == c)
-      ++x;
-  }
-  // printf("Rank of %c is %d at index %d\n", '0'+c, x, idx);
-  return x;
+  x = b->cnt[(int)c];
+  // Then count through the block's words; the last (partial) one is masked
+  // rather than looped over
+  for (i = 0; i < (r >> 5); ++i)
+    x += occ_count(b->bwt[i], c, ~0ULL);
+  return x + occ_count(b->bwt[r >> 5], c, (1ULL << (2*(r&31))) - 1);
 }
 
-// TODO: Maybe hardcode this table or something, stop it from being called
-// multiple times (e.g. we could just write a function to print it out)
-unsigned char * lookup_table() {
-  // Calculates the lookup table for one byte of the sequence (i.e.
-  // 4 base pairs). 256 possible combinations * 4 entries per byte
-  // = 1024 bytes for our table. Used to speed up some iterations/searches
-  unsigned char *tbl = malloc(1024);
-  memset(tbl, 0, 1024);
-  int i, j, k, l;
-  for (i = 0; i < 4; ++i)
-    for (j = 0; j < 4; ++j)
-      for (k = 0; k < 4; ++k)
-	for (l = 0; l < 4; ++l) {
-	  // Brilliantly obfsucated loop
-	  // In essence, tbl[4x + i] (for i < 4, x < 256) is
-	  // the count of base pair i in the byte represented by x
-	  tbl[257*i + 64*j + 16*k + 4*l]++;
-	  tbl[256*i + 65*j + 16*k + 4*l]++;
-	  tbl[256*i + 64*j + 17*k + 4*l]++;
-	  tbl[256*i + 64*j + 16*k + 5*l]++;
-	}
-  // There are possibly more intuitive ways to calculate this, but this
-  // makes for the simplest code, and it's enough to know what the lookup table
-  // is without knowing how to construct one
-  return tbl;
+// Counts each base in the n positions of w selected by mask, returning
+// the counts as a vector (A, C, G, T). Only the Cs, Gs and Ts need a popcount;
+// the As are whatever is left over
+static inline __m128i occ_count4(unsigned long long w, unsigned long long mask,
+				 int n) {
+  unsigned long long hi = (w >> 1) & 0x5555555555555555ULL & mask;
+  unsigned long long lo = w & 0x5555555555555555ULL & mask;
+  int t = __builtin_popcountll(hi & lo);
+  int g = __builtin_popcountll(hi) - t;
+  int c = __builtin_popcountll(lo) - t;
+  return _mm_set_epi32(t, g, c, n - c - g - t);
+}
+
+// Calculates the ranks of all four bases at idx from one visit to the block,
+// counting the '$' as an A (and from the start of idx's superblock, as for
+// seq_rank()). out must have space for 4 ints
+void seq_occ4(const rank_block *occ, int shift, bwtint_t idx,
+	      unsigned int *out) {
+  const rank_block *b = occ_block(occ, shift, idx);
+  int i, r = idx & ((1 << shift) - 1);
+  __m128i x = _mm_loadu_si128((const __m128i *)b->cnt);
+  for (i = 0; i < (r >> 5); ++i)
+    x = _mm_add_epi32(x, occ_count4(b->bwt[i], ~0ULL, 32));
+  x = _mm_add_epi32(x, occ_count4(b->bwt[r >> 5], (1ULL << (2*(r&31))) - 1,
+				  r&31));
+  _mm_storeu_si128((__m128i *)out, x);
+}
+
+// Gets BWT[idx] from the occurrence table (the '$' comes back as an A)
+static inline char occ_base(const fm_index *fmi, bwtint_t idx) {
+  const rank_block *b = occ_block(fmi->occ, fmi->occ_shift, idx);
+  return (b->bwt[(idx & ((1 << fmi->occ_shift) - 1)) >> 5] >> (2*(idx&31)))
+    & 3;
 }
 
 void destroy_fmi (fm_index *fmi) {
-  int i;
-  if (fmi) {
-    if (fmi->bwt)
-      free(fmi->bwt);
+  if (fmi && fmi->map) {
+    // Everything is in the mapping
+    munmap(fmi->map, fmi->map_len);
+    free(fmi->rev);
+    free(fmi);
+  }
+  else if (fmi) {
+    if (fmi->occ)
+      build_free(fmi->occ);
+    if (fmi->occ_super)
+      free(fmi->occ_super);
     if (fmi->idxs)
-      free(fmi->idxs);
-    if (fmi->rank_index) {
-      for (i = 0; i <= (fmi->len+15)/16; ++i)
-	if (fmi->rank_index[i])
-	  free(fmi->rank_index[i]);
-      free(fmi->rank_index);
-    }
-    if (fmi->lookup)
-      free(fmi->lookup);
+      build_free(fmi->idxs);
+    if (fmi->sa_mark)
+      build_free(fmi->sa_mark);
+    if (fmi->kmer)
+      build_free(fmi->kmer);
+    if (fmi->lcp)
+      free(fmi->lcp);
+    destroy_fmi(fmi->rev);
     free(fmi);
   }
 }
 
+// The occurrence table is filled in a symbol at a time by occ_put() (see
+// fmi_fill_rows()) after fmi_start_occ(), and fmi_finish_occ() then adds the
+// counts and works out C from them
+static void fmi_start_occ(fm_index *fmi) {
+  fmi->occ_shift = RANK_SHIFT;
+  fmi->occ = occ_alloc(fmi->len, fmi->occ_shift, &fmi->occ_super);
+}
+
+static void fmi_finish_occ(fm_index *fmi) {
+  int c;
+  occ_count_blocks(fmi->occ, fmi->len, fmi->occ_shift, fmi->occ_super,
+		   build_threads);
+  fmi->C[0] = 1;
+  for (c = 0; c < 4; ++c)
+    fmi->C[c+1] = fmi->C[c] + rank(fmi, c, fmi->len+1);
+}
+
+// Sets the i-th value of a packed array (see packed_get())
+static inline void packed_put(unsigned long long *a, int bits, size_t i,
+			      unsigned long long x) {
+  unsigned long long bit = (unsigned long long)i * bits;
+  unsigned long long mask = (1ULL << bits) - 1;
+  int off = bit & 63;
+  a[bit >> 6] = (a[bit >> 6] & ~(mask << off)) | (x << off);
+  if (off + bits > 64)
+    a[(bit >> 6) + 1] = (a[(bit >> 6) + 1] & ~(mask >> (64 - off))) |
+      (x >> (64 - off));
+}
+
+// Like packed_put(), but for an array which starts out zeroed and may have
+// several threads filling in neighbouring values at once (the values are
+// ORed in atomically, so a word two of them share comes out right)
+static inline void packed_or(unsigned long long *a, int bits, size_t i,
+			     unsigned long long x) {
+  unsigned long long bit = (unsigned long long)i * bits;
+  int off = bit & 63;
+  __sync_fetch_and_or(&a[bit >> 6], x << off);
+  if (off + bits > 64)
+    __sync_fetch_and_or(&a[(bit >> 6) + 1], x >> (64 - off));
+}
+
+// Takes one in every (1 << shift) entries of the suffix array, packing them
+// into just as many bits as they need (25 rather than 32 for a 20Mbp
+// chromosome, say). fmi_sample_start() sets up the samples, and then
+// fmi_sample_row() is given the rows in order (k counts the samples kept so
+// far, for SA_TEXT; a thread given a stretch of the rows starts it off at the
+// number of samples before them).
+static void fmi_sample_start(fm_index *fmi, int shift, int mode) {
+  fmi->sa_shift = shift;
+  fmi->sa_mode = mode;
+  if (mode == SA_ROWS) {
+    fmi->sa_bits = sa_bits(fmi->len);
+    fmi->idxs = build_alloc(sa_size(fmi->len, shift, fmi->sa_bits));
+    return;
+  }
+  fmi->sa_bits = sa_bits(fmi->len >> shift);
+  fmi->idxs = build_alloc(sa_size(fmi->len, shift, fmi->sa_bits));
+  fmi->sa_mark = build_alloc(sa_mark_size(fmi->len));
+}
+
+static inline void fmi_sample_row(fm_index *fmi, bwtint_t r, bwtint_t pos,
+				  bwtint_t *k) {
+  int shift = fmi->sa_shift;
+  if (fmi->sa_mode == SA_ROWS) {
+    if (!(r & ((1 << shift) - 1)))
+      packed_or(fmi->idxs, fmi->sa_bits, r >> shift, pos);
+    return;
+  }
+  // Mark the rows of the positions divisible by the rate, and keep the
+  // positions (divided by the rate) in order of row
+  unsigned long long *b = fmi->sa_mark + (r >> 8) * 5;
+  if (!(r & 255))
+    b[0] = *k;
+  if (pos & ((1 << shift) - 1))
+    return;
+  b[1 + ((r >> 6) & 3)] |= 1ULL << (r & 63);
+  packed_or(fmi->idxs, fmi->sa_bits, (*k)++, pos >> shift);
+}
+
+void fmi_set_build_threads(int n) {
+  build_threads = n < 1 ? 1 : n;
+}
+
+void fmi_set_build_histsort(int on) {
+  build_hist = on;
+}
+
+void fmi_set_build_blocks(int n) {
+  build_blocks = n < 0 ? 0 : n;
+}
+
+void fmi_set_build_budget(size_t bytes) {
+  build_budget = bytes;
+}
+
+void fmi_set_build_tmpdir(const char *dir) {
+  build_tmpdir = dir;
+}
+
+static bwtint_t *hist_sa(const char *str, bwtint_t len) {
+  taskpool *pool;
+  bwtint_t *idxs;
+  if (!build_threads)
+    return histsort(str, len);
+  pool = taskpool_create(build_threads);
+  idxs = histsort_pool(str, len, pool);
+  taskpool_destroy(pool);
+  return idxs;
+}
+
+// The suffix arrays below all come from here: SACA-K with one thread, the
+// parallel sort in psort.c with more (which gives the same result, using
+// more memory), or the histogram sort if that's been asked for
+static bwtint_t *build_sa(const char *str, bwtint_t len) {
+  if (build_hist)
+    return hist_sa(str, len);
+  if (build_threads > 1)
+    return psuff_arr(str, len, build_threads);
+  return csuff_arr(str, len);
+}
+
+// How far ahead fmi_fill_rows() asks for the text, and how many rows a
+// thread does at a time before giving that part of the suffix array back
+#define FILL_AHEAD 32
+#define FILL_CHUNK (1 << 16)
+
+// What's needed to put rows of the suffix array into fmi, which is all there
+// is of the BWT until it's done: the symbols go straight into the
+// occurrence table, and the samples are taken on the way
+typedef struct {
+  fm_index *fmi;
+  const char *str;
+  bwtint_t k; // For fmi_sample_row()
+  int sample;
+} fmi_fill;
+
+// Puts n rows of the suffix array, starting at row row, into the index. The
+// base before each suffix is a cache miss (on any sequence much bigger than
+// the cache), so they're asked for FILL_AHEAD rows early and the misses
+// overlap instead of coming one after another.
+static void fmi_fill_rows(void *arg, const bwtint_t *sa, bwtint_t row,
+			  bwtint_t n) {
+  fmi_fill *f = arg;
+  fm_index *fmi = f->fmi;
+  bwtint_t i;
+  for (i = 0; i < n; ++i, ++row) {
+    if (i + FILL_AHEAD < n)
+      __builtin_prefetch(f->str + ((sa[i + FILL_AHEAD] - 1) >> 2));
+    if (f->sample)
+      fmi_sample_row(fmi, row, sa[i], &f->k);
+    if (sa[i])
+      occ_put(fmi->occ, fmi->occ_shift, row, getbase(f->str, sa[i] - 1));
+    else
+      fmi->endloc = row; // The '$', which stays an A
+  }
+}
+
+// Hands the whole pages of a part of a (malloc()ed) array which won't be
+// needed again back to the system; the memory comes back (zeroed) if it's
+// touched again, and free() is happy with it either way
+static void release_pages(void *p, size_t size) {
+  static size_t page = 0;
+  size_t start, end;
+  if (!page)
+    page = sysconf(_SC_PAGESIZE);
+  start = ((size_t)p + page - 1) & ~(page - 1);
+  end = ((size_t)p + size) & ~(page - 1);
+  if (end > start)
+    madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+// One thread's stretch of rows for fmi_fill_sa()
+typedef struct {
+  fmi_fill f;
+  bwtint_t *sa;
+  bwtint_t start, end;
+} fmi_part;
+
+// Counts the SA_TEXT samples in a stretch, so the next one knows where its
+// samples go
+static void *fmi_count_part(void *arg) {
+  fmi_part *p = arg;
+  bwtint_t r, mask = (1 << p->f.fmi->sa_shift) - 1;
+  p->f.k = 0;
+  for (r = p->start; r < p->end; ++r)
+    p->f.k += !(p->sa[r] & mask);
+  return NULL;
+}
+
+static void *fmi_fill_part(void *arg) {
+  fmi_part *p = arg;
+  bwtint_t r, n;
+  for (r = p->start; r < p->end; r += n) {
+    n = p->end - r < FILL_CHUNK ? p->end - r : FILL_CHUNK;
+    fmi_fill_rows(&p->f, p->sa + r, r, n);
+    release_pages(p->sa + r, n * sizeof(bwtint_t));
+  }
+  return NULL;
+}
+
+// Puts the whole suffix array into fmi (see fmi_fill_rows()) with nthreads
+// threads, giving back its memory as it goes: by the end, all that's left
+// of it is the array itself for the caller to free. Each thread gets whole
+// blocks of the occurrence table and of sa_mark, so none of them write to
+// the same words except at the ends of their packed samples, which
+// packed_or() takes care of.
+static void fmi_fill_sa(fm_index *fmi, const char *str, bwtint_t *sa,
+			int sample, int nthreads) {
+  bwtint_t rows = fmi->len + 1, step, k = 0;
+  int t, align = fmi->occ_shift > 8 ? fmi->occ_shift : 8;
+  fmi_part *parts;
+  if (nthreads < 1)
+    nthreads = 1;
+  step = ((rows / nthreads >> align) + 1) << align;
+  parts = calloc(nthreads, sizeof(fmi_part));
+  for (t = 0; t < nthreads; ++t) {
+    parts[t].f.fmi = fmi;
+    parts[t].f.str = str;
+    parts[t].f.sample = sample;
+    parts[t].sa = sa;
+    parts[t].start = t * step < rows ? t * step : rows;
+    parts[t].end = parts[t].start + step < rows ? parts[t].start + step : rows;
+  }
+  if (sample && fmi->sa_mode == SA_TEXT && nthreads > 1) {
+    run_parts(parts, sizeof(fmi_part), nthreads, fmi_count_part);
+    for (t = 0; t < nthreads; ++t) {
+      bwtint_t n = parts[t].f.k;
+      parts[t].f.k = k;
+      k += n;
+    }
+  }
+  run_parts(parts, sizeof(fmi_part), nthreads, fmi_fill_part);
+  free(parts);
+}
+
+// Works out fmi's occurrence table, C and endloc, and its SA samples too
+// unless sa_shift is negative, from the suffix array of str (or from sa if
+// that's been built already; it's freed). With fmi_set_build_blocks(), the
+// suffix array goes past a block at a time instead of being built all at
+// once, so the index is all that's kept of it.
+static void fmi_build_sa(fm_index *fmi, const char *str, bwtint_t *sa,
+			 int sa_shift, int sa_mode) {
+  fmi_fill f;
+  int nblocks = build_blocks;
+  if (build_budget) {
+    // As few blocks as fit (or as many as there can be, if none do)
+    nblocks = bsuff_blocks(fmi->len, build_budget);
+    if (!nblocks)
+      nblocks = BSUFF_MAX_BLOCKS;
+  }
+  // The index's arrays are only made once there's something to go in them,
+  // so that they aren't taking up memory while the suffix array is sorted
+  if (!sa && !nblocks)
+    sa = build_sa(str, fmi->len);
+  fmi_start_occ(fmi);
+  if (sa_shift >= 0)
+    fmi_sample_start(fmi, sa_shift, sa_mode);
+  if (sa) {
+    fmi_fill_sa(fmi, str, sa, sa_shift >= 0, build_threads);
+    free(sa);
+  }
+  else {
+    f.fmi = fmi;
+    f.str = str;
+    f.k = 0;
+    f.sample = sa_shift >= 0;
+    bsuff_arr(str, fmi->len, nblocks, fmi_fill_rows, &f);
+  }
+  fmi_finish_occ(fmi);
+}
+
 // Comment: rather memory intensive
 // Also doesn't check malloc()'s return status at all so have fun with that
-fm_index *make_fmi(const char *str, int len) {
-  int *idxs, i;
+fm_index *make_fmi(const char *str, bwtint_t len, int sa_shift, int sa_mode) {
+  bwtint_t *idxs;
   fm_index *fmi;
-  idxs = histsort(str, len); // i.e. SA
-  // TODO: Write a mechanism (command line argument perhaps) to switch
-  // between the algorithms
+  idxs = hist_sa(str, len); // i.e. SA
   // csuff_arr() uses less memory but is slower for all but the most
-  // extreme cases
+  // extreme cases (build_sa() switches between them)
   // histsort(), on the other hand, is cache-friendly and multithreaded
-  // idxs = csuff_arr(str, len);
   
   fmi = calloc(1, sizeof(fm_index));
-  fmi->idxs = malloc((1 + (len / 32)) * sizeof(int));
-  // idxs is probably more properly referred to as "CSA"
-  for (i = 0; i < (1+(len / 32)); ++i)
-    fmi->idxs[i] = idxs[32 * i];
-  fmi->bwt = malloc((len+3)/4);
   fmi->len = len;
-  fmi->endloc = sprintcbwt(str, idxs, len, fmi->bwt);
-  free(idxs);
-  fmi->lookup = lookup_table();
-  fmi->rank_index = seq_index(fmi->bwt, len, 16, fmi->lookup);
-  fmi->C[0] = 1;
-  fmi->C[1] = 1         + fmi->rank_index[(len+15)/16][0];
-  fmi->C[2] = fmi->C[1] + fmi->rank_index[(len+15)/16][1];
-  fmi->C[3] = fmi->C[2] + fmi->rank_index[(len+15)/16][2];
-  fmi->C[4] = fmi->C[3] + fmi->rank_index[(len+15)/16][3];
+  // idxs is probably more properly referred to as "CSA"
+  fmi_build_sa(fmi, str, idxs, sa_shift, sa_mode);
   return fmi;
 }
 
 // The same, but using SACA-K instead 
-fm_index *make_fmi_sacak(const char *str, int len) {
-  int *idxs, i;
+fm_index *make_fmi_sacak(const char *str, bwtint_t len, int sa_shift,
+			 int sa_mode) {
   fm_index *fmi;
-   idxs = csuff_arr(str, len);
-  fmi = malloc(sizeof(fm_index));
-  fmi->idxs = malloc((1 + (len / 32)) * sizeof(int));
-  for (i = 0; i < (1+(len / 32)); ++i)
-    fmi->idxs[i] = idxs[32 * i];
-  fmi->bwt = malloc((len+3)/4);
+  fmi = calloc(1, sizeof(fm_index));
   fmi->len = len;
-  fmi->endloc = sprintcbwt(str, idxs, len, fmi->bwt);
-  free(idxs);
-  fmi->lookup = lookup_table();
-  fmi->rank_index = seq_index(fmi->bwt, len, 16, fmi->lookup);
-  fmi->C[0] = 1;
-  fmi->C[1] = 1         + fmi->rank_index[(len+15)/16][0];
-  fmi->C[2] = fmi->C[1] + fmi->rank_index[(len+15)/16][1];
-  fmi->C[3] = fmi->C[2] + fmi->rank_index[(len+15)/16][2];
-  fmi->C[4] = fmi->C[3] + fmi->rank_index[(len+15)/16][3];
+  fmi_build_sa(fmi, str, NULL, sa_shift, sa_mode);
   return fmi;
 }
 
-int lf(const fm_index *fmi, int idx) {
-  if (idx == fmi->endloc)
+void fmi_build_rev(fm_index *fmi, const char *str) {
+  bwtint_t i, len = fmi->len;
+  // One byte of slack, since csuff_arr() wants a 0 after the sequence
+  char *rstr = calloc(len/4 + 1, 1);
+  fm_index *rev;
+  for (i = 0; i < len; ++i)
+    rstr[i>>2] |= getbase(str, len-1-i) << (2*(3-(i&3)));
+  rev = calloc(1, sizeof(fm_index));
+  rev->len = len;
+  fmi_build_sa(rev, rstr, NULL, -1, SA_ROWS);
+  free(rstr);
+  if (fmi->rev)
+    destroy_fmi(fmi->rev);
+  fmi->rev = rev;
+}
+
+// The LCP array comes from the SA by way of the permuted LCP array (Karkkainen
+// et al., "Permuted longest-common-prefix array", 2009): plcp[p] is the LCP
+// of the suffix at p and the one before it in the SA, and plcp[p + 1] >=
+// plcp[p] - 1, so working through the sequence in order takes O(len) base
+// comparisons in all
+void fmi_build_lcp(fm_index *fmi, const char *str) {
+  bwtint_t i, p, l = 0, len = fmi->len;
+  bwtint_t *idxs = build_sa(str, len);
+  bwtint_t *plcp = malloc((len+1) * sizeof(bwtint_t));
+  unsigned char *lcp = calloc(1, lcp_size(len)), *mins = lcp + len + 2;
+  // plcp starts off as the suffix before each one (SA[0] = len, the '$', is
+  // the only one with nothing before it)
+  for (i = 1; i <= len; ++i)
+    plcp[idxs[i]] = idxs[i-1];
+  for (p = 0; p < len; ++p) {
+    bwtint_t q = plcp[p];
+    while (p + l < len && q + l < len &&
+	   getbase(str, p + l) == getbase(str, q + l))
+      ++l;
+    plcp[p] = l;
+    if (l)
+      --l;
+  }
+  for (i = 1; i <= len; ++i)
+    lcp[i] = plcp[idxs[i]] > LCP_MAX ? LCP_MAX : plcp[idxs[i]];
+  free(plcp);
+  free(idxs);
+  for (i = 0; i < len + 2; ++i)
+    if (i % LCP_BLOCK == 0 || lcp[i] < mins[i / LCP_BLOCK])
+      mins[i / LCP_BLOCK] = lcp[i];
+  if (fmi->lcp)
+    free(fmi->lcp);
+  fmi->lcp = lcp;
+}
+
+char *fmd_seq(const char *str, bwtint_t len) {
+  bwtint_t i;
+  // One byte of slack, since csuff_arr() wants a 0 after the sequence
+  char *out = calloc(len/2 + 1, 1);
+  for (i = 0; i < len; ++i) {
+    unsigned char c = getbase(str, i);
+    bwtint_t j = 2*len - 1 - i;
+    out[i>>2] |= c << (2*(3-(i&3)));
+    out[j>>2] |= (3 - c) << (2*(3-(j&3)));
+  }
+  return out;
+}
+
+// The last contig starting at or before pos (which skips any empty ones
+// starting there too); start is the contig table's list of starts
+static long long contig_at(const long long *start, long long n, bwtint_t pos) {
+  long long lo = 0, hi = n, mid;
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (start[mid] <= pos)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+long long fmi_contig(const fm_index *fmi, bwtint_t pos, bwtint_t n,
+		     bwtint_t *off) {
+  const long long *start;
+  long long i;
+  if (!fmi->contigs) {
+    *off = pos;
     return 0;
-  return fmi->C[getbase(fmi->bwt,idx - (idx > fmi->endloc))] +
-    rank(fmi, getbase(fmi->bwt,idx - (idx > fmi->endloc)), idx);
+  }
+  start = fmi->contigs + 1;
+  i = contig_at(start, fmi->contigs[0], pos);
+  *off = pos - start[i];
+  return pos + n <= start[i + 1] ? i : -1;
+}
+
+bwtint_t fmi_piece(const fm_index *fmi, bwtint_t pos, bwtint_t *start) {
+  const long long *cs = fmi->contigs ? fmi->contigs + 1 : NULL;
+  bwtint_t half = fmi->fmd ? fmi->len / 2 : fmi->len;
+  long long i;
+  if (fmi->fmd && pos >= half) {
+    // Contig i is [cs[i], cs[i + 1]) in the first half, so its reverse
+    // complement is [2 * half - cs[i + 1], 2 * half - cs[i]) in the second
+    if (!cs) {
+      *start = half;
+      return 2 * half;
+    }
+    i = contig_at(cs, fmi->contigs[0], 2 * half - 1 - pos);
+    *start = 2 * half - cs[i + 1];
+    return 2 * half - cs[i];
+  }
+  if (!cs) {
+    *start = 0;
+    return half;
+  }
+  i = contig_at(cs, fmi->contigs[0], pos);
+  *start = cs[i];
+  return cs[i + 1];
+}
+
+const char *fmi_contig_name(const fm_index *fmi, long long i) {
+  long long n;
+  if (!fmi->contigs)
+    return NULL;
+  n = fmi->contigs[0];
+  return (const char *)(fmi->contigs + 2 * n + 3) + fmi->contigs[n + 2 + i];
+}
+
+// Packs the BWT back into the form sprintcbwt() gives (skipping the '$')
+void unpack_bwt(const fm_index *fmi, char *out) {
+  bwtint_t i, j = 0;
+  char c = 0;
+  for (i = 0; i <= fmi->len; ++i) {
+    if (i == fmi->endloc)
+      continue;
+    c |= occ_base(fmi, i) << (2*(3-(j&3)));
+    if ((++j & 3) == 0) {
+      out[(j-1)/4] = c;
+      c = 0;
+    }
+  }
+  if (j & 3)
+    out[j/4] = c;
+}
+
+// The '$' is in the occurrence table as an A, so rank() only has to not count
+// it. lf() still has to send the '$' row itself to row 0 (the '$' isn't in
+// C[]), which is a select on endloc rather than a lookup.
+bwtint_t lf(const fm_index *fmi, bwtint_t idx) {
+  char c = occ_base(fmi, idx);
+  bwtint_t x = fmi->C[c] + rank(fmi, c, idx);
+  return (idx == fmi->endloc) ? 0 : x;
+}
+
+bwtint_t rank(const fm_index *fmi, char c, bwtint_t idx) {
+  return occ_super(fmi, idx, c) +
+    seq_rank(fmi->occ, fmi->occ_shift, idx, c) -
+    ((c == 0) & (idx > fmi->endloc));
+}
+
+// Adds the superblock counts and takes off the '$'
+static inline void occ4_fix(const fm_index *fmi, bwtint_t idx,
+			    const unsigned int cnt[4], bwtint_t out[4]) {
+  for (int c = 0; c < 4; ++c)
+    out[c] = occ_super(fmi, idx, c) + cnt[c];
+  out[0] -= (idx > fmi->endloc);
+}
+
+void occ4(const fm_index *fmi, bwtint_t idx, bwtint_t out[4]) {
+  unsigned int cnt[4];
+  seq_occ4(fmi->occ, fmi->occ_shift, idx, cnt);
+  occ4_fix(fmi, idx, cnt, out);
+}
+
+void occ4_range(const fm_index *fmi, bwtint_t sp, bwtint_t ep,
+		bwtint_t osp[4], bwtint_t oep[4]) {
+  const int shift = fmi->occ_shift;
+  if ((sp >> shift) != (ep >> shift)) {
+    occ4(fmi, sp, osp);
+    occ4(fmi, ep, oep);
+    return;
+  }
+  // Both ends are in the same block, so count up to sp and then carry on
+  // from there to ep
+  const rank_block *b = occ_block(fmi->occ, shift, sp);
+  int i, rs = sp & ((1 << shift) - 1), re = ep & ((1 << shift) - 1);
+  unsigned int cs[4], ce[4];
+  __m128i x = _mm_loadu_si128((const __m128i *)b->cnt);
+  for (i = 0; i < (rs >> 5); ++i)
+    x = _mm_add_epi32(x, occ_count4(b->bwt[i], ~0ULL, 32));
+  _mm_storeu_si128((__m128i *)cs,
+		   _mm_add_epi32(x, occ_count4(b->bwt[rs >> 5],
+					       (1ULL << (2*(rs&31))) - 1,
+					       rs&31)));
+  for (; i < (re >> 5); ++i)
+    x = _mm_add_epi32(x, occ_count4(b->bwt[i], ~0ULL, 32));
+  _mm_storeu_si128((__m128i *)ce,
+		   _mm_add_epi32(x, occ_count4(b->bwt[re >> 5],
+					       (1ULL << (2*(re&31))) - 1,
+					       re&31)));
+  occ4_fix(fmi, sp, cs, osp);
+  occ4_fix(fmi, ep, ce, oep);
+}
+
+// The interval of reversed cP in the reverse index starts with the
+// occurrence of reversed P at the very end of the sequence, if P is at the
+// very start (the row of fmi where BWT is '$'), then has the occurrences
+// followed by A, C, ... in that order, so occ4_range() in one index gives
+// everything needed for the other as well. In an FMD index the other
+// interval is that of the reverse complement, which is followed by the
+// complements of A, C, ..., i.e. the bases the other way around (rc).
+static inline bwtint_t bi_extend(const fm_index *fmi, bwtint_t sp,
+				 bwtint_t osp_other, bwtint_t size, char c,
+				 int rc, bwtint_t *sp_out, bwtint_t *osp_out) {
+  bwtint_t osp[4], oep[4], x;
+  occ4_range(fmi, sp, sp + size, osp, oep);
+  x = osp_other + (fmi->endloc >= sp && fmi->endloc < sp + size);
+  for (int d = rc ? 3 : 0; d != c; d += rc ? -1 : 1)
+    x += oep[d] - osp[d];
+  *sp_out = fmi->C[c] + osp[c];
+  *osp_out = x;
+  return oep[c] - osp[c];
+}
+
+bwtint_t extend_left(const fm_index *fmi, const bi_interval *iv, char c,
+		     bi_interval *out) {
+  return out->size = bi_extend(fmi, iv->fsp, iv->rsp, iv->size, c, fmi->fmd,
+			       &out->fsp, &out->rsp);
+}
+
+bwtint_t extend_right(const fm_index *fmi, const bi_interval *iv, char c,
+		      bi_interval *out) {
+  // In an FMD index, Pc's reverse complement is the complement of c followed
+  // by P's
+  if (fmi->fmd)
+    return out->size = bi_extend(fmi, iv->rsp, iv->fsp, iv->size, 3 - c, 1,
+				 &out->rsp, &out->fsp);
+  return out->size = bi_extend(fmi->rev, iv->rsp, iv->fsp, iv->size, c, 0,
+			       &out->rsp, &out->fsp);
+}
+
+// Finds the SMEMs which cover pattern[x] (Li, "Exploring single-sample SNP
+// and INDEL calling with whole-genome de novo assembly", 2012), adding them
+// to out (in order of start) and returning where the next search should
+// start; prev and curr are scratch space for len + 1 matches each.
+// First pattern[x, i) is grown to the right, keeping the interval each time
+// the next base would make it smaller (those are the matches which can't be
+// extended to the right). Then all of those are grown to the left together,
+// longest first; once one can't be, it's an SMEM unless a longer one was
+// still going (in which case it's contained in that).
+static int smem1(const fm_index *fmi, const char *pattern, int len, int x,
+		 smem *out, int *n, smem *prev, smem *curr) {
+  bi_interval ik, ok;
+  int i, j, np = 0, nc, ret, first = *n;
+  smem *t;
+  bi_init(fmi, &ik);
+  if (pattern[x] > 3 || !extend_right(fmi, &ik, pattern[x], &ik))
+    return x + 1;
+  for (i = x + 1; i < len && pattern[i] <= 3; ++i) {
+    if (extend_right(fmi, &ik, pattern[i], &ok) != ik.size) {
+      prev[np].start = x;
+      prev[np].end = i;
+      prev[np++].iv = ik;
+      if (!ok.size)
+	break;
+    }
+    ik = ok;
+  }
+  if (i == len || pattern[i] > 3) {
+    prev[np].start = x;
+    prev[np].end = i;
+    prev[np++].iv = ik;
+  }
+  ret = prev[np-1].end;
+  for (j = 0; j < np/2; ++j) {
+    smem m = prev[j];
+    prev[j] = prev[np-1-j];
+    prev[np-1-j] = m;
+  }
+
+  for (i = x - 1; i >= -1; --i) {
+    int c = (i < 0 || pattern[i] > 3) ? -1 : pattern[i];
+    for (j = 0, nc = 0; j < np; ++j) {
+      if (c >= 0)
+	extend_left(fmi, &prev[j].iv, c, &ok);
+      if (c < 0 || !ok.size) {
+	if (!nc && (*n == first || i + 1 < out[*n-1].start)) {
+	  out[*n] = prev[j];
+	  out[(*n)++].start = i + 1;
+	}
+      }
+      else if (!nc || ok.size != curr[nc-1].iv.size) {
+	curr[nc] = prev[j];
+	curr[nc++].iv = ok;
+      }
+    }
+    if (!nc)
+      break;
+    t = prev;
+    prev = curr;
+    curr = t;
+    np = nc;
+  }
+  // They were found longest (and so earliest starting) first
+  for (j = 0; j < (*n - first)/2; ++j) {
+    smem m = out[first+j];
+    out[first+j] = out[*n-1-j];
+    out[*n-1-j] = m;
+  }
+  return ret;
+}
+
+// Without a reverse index: the longest match ending at each position e is
+// found by backward search, and it's an SMEM if it starts before all the
+// ones ending after e
+static int smems_fwd(const fm_index *fmi, const char *pattern, int len,
+		     smem *out) {
+  int e, s, n = 0, minstart = len, j;
+  for (e = len; e > 0; --e) {
+    char c = pattern[e-1];
+    bwtint_t sp, ep;
+    if (c > 3)
+      continue;
+    sp = fmi->C[c];
+    ep = fmi->C[c+1];
+    for (s = e - 1; ep > sp && s > 0 && pattern[s-1] <= 3; --s) {
+      bwtint_t nsp, nep;
+      c = pattern[s-1];
+      nsp = fmi->C[c] + rank(fmi, c, sp);
+      nep = fmi->C[c] + rank(fmi, c, ep);
+      if (nep <= nsp)
+	break;
+      sp = nsp;
+      ep = nep;
+    }
+    if (ep > sp && s < minstart) {
+      out[n].start = minstart = s;
+      out[n].end = e;
+      out[n].iv.fsp = sp;
+      out[n].iv.rsp = 0;
+      out[n++].iv.size = ep - sp;
+    }
+  }
+  for (j = 0; j < n/2; ++j) {
+    smem m = out[j];
+    out[j] = out[n-1-j];
+    out[n-1-j] = m;
+  }
+  return n;
 }
 
-int rank(const fm_index *fmi, char c, int idx) {
-	if (idx > fmi->endloc)
-		idx--;
-	return seq_rank(fmi->bwt, fmi->rank_index, 16, idx, c, fmi->lookup);
+int find_smems(const fm_index *fmi, const char *pattern, int len, int min_len,
+	       smem *out) {
+  int n = 0, x = 0, k, m;
+  if (!fmi_bidir(fmi))
+    n = smems_fwd(fmi, pattern, len, out);
+  else {
+    smem *prev = malloc(2 * (len + 1) * sizeof(smem));
+    while (x < len)
+      x = smem1(fmi, pattern, len, x, out, &n, prev, prev + len + 1);
+    free(prev);
+  }
+  for (k = m = 0; k < n; ++k)
+    if (out[k].end - out[k].start >= min_len)
+      out[m++] = out[k];
+  return m;
+}
+
+// Fills in the k-mer table entries for all the k-mers ending in the l bases
+// given by key (whose interval is [sp, ep)); the first row of each k-mer is
+// just where a backward search for it would start, even if it doesn't occur
+static void kmer_fill(fm_index *fmi, size_t key, int l, bwtint_t sp,
+		      bwtint_t ep) {
+  bwtint_t osp[4], oep[4];
+  int c;
+  if (l == fmi->kmer_k) {
+    packed_put(fmi->kmer, fmi->kmer_bits, key, (unsigned long long)sp << 4);
+    return;
+  }
+  occ4_range(fmi, sp, ep, osp, oep);
+  for (c = 0; c < 4; ++c)
+    kmer_fill(fmi, ((size_t)c << (2 * l)) | key, l + 1, fmi->C[c] + osp[c],
+	      fmi->C[c] + oep[c]);
+}
+
+void fmi_build_kmers(fm_index *fmi, int k) {
+  size_t n = (size_t)1 << (2 * k), key = 0;
+  bwtint_t r = 0;
+  int j;
+  if (fmi->kmer)
+    build_free(fmi->kmer);
+  fmi->kmer_k = k;
+  fmi->kmer_bits = kmer_bits(fmi->len);
+  fmi->kmer = build_alloc(kmer_size(fmi->len, k));
+  kmer_fill(fmi, 0, 0, 0, fmi->len + 1);
+  packed_put(fmi->kmer, fmi->kmer_bits, n, (unsigned long long)(fmi->len + 1)
+	     << 4);
+  // The suffixes shorter than k (the last k-1 of them; row 0 is the one
+  // which is just the '$') are the only rows which aren't in the interval of
+  // some k-mer. Such a suffix s comes just before the first k-mer it's a
+  // prefix of, i.e. s followed by As, so that's where it gets counted. We
+  // walk back from row 0 to get them, building up s as we go.
+  for (j = 1; j < k && j <= fmi->len; ++j) {
+    key = ((size_t)occ_base(fmi, r) << (2 * (k - 1))) | (key >> 2);
+    r = lf(fmi, r);
+    if (key) // If it's all As it's before every k-mer
+      packed_put(fmi->kmer, fmi->kmer_bits, key,
+		 packed_get(fmi->kmer, fmi->kmer_bits, key) + 1);
+  }
+}
+
+// Looks up the interval of the last k bases of the pattern in the k-mer
+// table. Returns 0 if it can't (no table, the pattern's too short or has an
+// N in it) or if the interval is empty, in which case the search should be
+// done the usual way: where an empty interval ends up depends on where the
+// search ran out, and loc_search() and mms() pass that on.
+static inline int kmer_lookup(const fm_index *fmi, const char *pattern,
+			      int len, bwtint_t *sp, bwtint_t *ep) {
+  int k = fmi->kmer_k, i;
+  size_t x = 0;
+  unsigned long long a, b;
+  if (!k || len < k)
+    return 0;
+  for (i = len - k; i < len; ++i) {
+    if (pattern[i] > 3)
+      return 0;
+    x = (x << 2) | pattern[i];
+  }
+  a = packed_get(fmi->kmer, fmi->kmer_bits, x);
+  b = packed_get(fmi->kmer, fmi->kmer_bits, x + 1);
+  if ((b >> 4) - (b & 15) <= (a >> 4))
+    return 0;
+  *sp = a >> 4;
+  *ep = (b >> 4) - (b & 15);
+  return 1;
 }
 
 // Runs in O(m) time
-int reverse_search(const fm_index *fmi, const char *pattern, int len) {
-  int start, end, i;
-  start = fmi->C[pattern[len-1]];
-  end = fmi->C[pattern[len-1]+1];
-  for (i = len-2; i >= 0; --i) {
+bwtint_t reverse_search(const fm_index *fmi, const char *pattern, int len) {
+  bwtint_t start, end;
+  int i;
+  if (kmer_lookup(fmi, pattern, len, &start, &end))
+    i = len - fmi->kmer_k - 1;
+  else {
+    start = fmi->C[pattern[len-1]];
+    end = fmi->C[pattern[len-1]+1];
+    i = len - 2;
+  }
+  for (; i >= 0; --i) {
     if (end <= start) {
       return 0;
     }
@@ -241,30 +1141,83 @@ int reverse_search(const fm_index *fmi, const char *pattern, int len) {
   return end - start+1;
 }
 
-int unc_sa(const fm_index *fmi, int idx) {
-  // Calculates SA[idx] given an fm-index ("enhancedish partial suffix array"?)
-  int i, x;
-  for (i = 0; idx & 31; ++i) {
+// Whether row idx is sampled, and the number of sampled rows before it (for
+// SA_TEXT)
+static inline int sa_marked(const fm_index *fmi, bwtint_t idx) {
+  const unsigned long long *b = fmi->sa_mark + (idx >> 8) * 5;
+  return (b[1 + ((idx >> 6) & 3)] >> (idx & 63)) & 1;
+}
+
+static inline bwtint_t sa_mark_rank(const fm_index *fmi, bwtint_t idx) {
+  const unsigned long long *b = fmi->sa_mark + (idx >> 8) * 5;
+  bwtint_t r = b[0];
+  int i, w = (idx >> 6) & 3;
+  for (i = 0; i < w; ++i)
+    r += __builtin_popcountll(b[1 + i]);
+  return r + __builtin_popcountll(b[1 + w] & ((1ULL << (idx & 63)) - 1));
+}
+
+static inline int sa_sampled(const fm_index *fmi, bwtint_t idx) {
+  if (fmi->sa_mode == SA_TEXT)
+    return sa_marked(fmi, idx);
+  return !(idx & ((1 << fmi->sa_shift) - 1));
+}
+
+// Walks back from idx to a sampled row, returning the number of LF() steps
+// that took; idx is left at the sampled row
+static inline int sa_walk(const fm_index *fmi, bwtint_t *idx) {
+  int i;
+  bwtint_t r = *idx;
+  // With SA_TEXT there are at most (1 << sa_shift) - 1 steps, since
+  // position 0 is sampled
+  for (i = 0; !sa_sampled(fmi, r); ++i) {
     // Use the LF-mapping to find the rotation previous to idx
-    idx = lf(fmi, idx);
+    r = lf(fmi, r);
   }
-  x = fmi->idxs[idx/32] + i;
+  *idx = r;
+  return i;
+}
+
+// SA[idx], given that idx is a sampled row which was i LF() steps away from
+// the one we wanted
+static inline bwtint_t sa_finish(const fm_index *fmi, bwtint_t idx, int i) {
+  bwtint_t x;
+  if (fmi->sa_mode == SA_TEXT)
+    // Never wraps around, since we stop at position 0 at the latest
+    return (sa_sample(fmi, sa_mark_rank(fmi, idx)) << fmi->sa_shift) + i;
+  x = sa_sample(fmi, idx >> fmi->sa_shift) + i;
   if (x > fmi->len)
     x -= fmi->len + 1;
   return x;
 }
 
+bwtint_t unc_sa(const fm_index *fmi, bwtint_t idx) {
+  // Calculates SA[idx] given an fm-index ("enhancedish partial suffix array"?)
+  int i = sa_walk(fmi, &idx);
+  return sa_finish(fmi, idx, i);
+}
+
+int unc_sa_steps(const fm_index *fmi, bwtint_t idx) {
+  return sa_walk(fmi, &idx);
+}
+
 // Runs in O(log(n) + m) time
-int locate(const fm_index *fmi, const char *pattern, int len) {
+bwtint_t locate(const fm_index *fmi, const char *pattern, int len) {
   // Find the (first[0]) instance of a given sequence in a given fm-index
   // Returns -1 if none are found
   // [0] "first" in terms of location in the suffix array; i.e. the match
   // whose corresponding rotation (or equivalently, suffix) comes first
   // lexicographically; this is largely irrelevant in any real usage
-  int start, end, i;
-  start = fmi->C[pattern[len-1]];
-  end = fmi->C[pattern[len-1]+1];
-  for (i = len-2; i >= 0; --i) {
+  bwtint_t start, end;
+  int i;
+  if (kmer_lookup(fmi, pattern, len, &start, &end))
+    i = len - fmi->kmer_k - 1;
+  else {
+    start = fmi->C[pattern[len-1]];
+    end = fmi->C[pattern[len-1]+1];
+    i = len - 2;
+  }
+  for (; i >= 0; --i) {
     if (end <= start) {
       return -1;
     }
@@ -278,7 +1231,7 @@ int locate(const fm_index *fmi, const char *pattern, int len) {
 
 // Runs in O(m) time. Finds the locations of all matches to the pattern.
 void loc_search(const fm_index *fmi, const char *pattern, int len,
-	int *sp, int *ep) {
+	bwtint_t *sp, bwtint_t *ep) {
   // Searches for a pattern in fmi and returns the start and
   // end indices. This is to be used for seed searches (as such
   // it would be called with len=14 instead of, say, 100 (the latter
@@ -292,10 +1245,16 @@ void loc_search(const fm_index *fmi, const char *pattern, int len,
   // This function is implemented essentially identically to the
   // previous, it just stores start and end into pointers (this
   // being better than, say, returning a struct).
-  int start, end, i;
-  start = fmi->C[pattern[len-1]];
-  end = fmi->C[pattern[len-1]+1];
-  for (i = len-2; i >= 0; --i) {
+  bwtint_t start, end;
+  int i;
+  if (kmer_lookup(fmi, pattern, len, &start, &end))
+    i = len - fmi->kmer_k - 1;
+  else {
+    start = fmi->C[pattern[len-1]];
+    end = fmi->C[pattern[len-1]+1];
+    i = len - 2;
+  }
+  for (; i >= 0; --i) {
     if (end <= start) {
       break;
     }
@@ -308,19 +1267,12 @@ void loc_search(const fm_index *fmi, const char *pattern, int len,
   *ep = end;
 }
 
-// Finds the maximum mappable suffix of the pattern; returns the length
-// matched (starting at the end of the pattern) and stores the range
-// of matches in sp and ep.
-int mms(const fm_index *fmi, const char *pattern, int len, int *sp, int *ep) {
-  int start, end, i;
-  int skips = 0;
-  while (pattern[len-1] == 5) {
-    len--;
-    skips++;
-  }
-  *sp = start = fmi->C[pattern[len-1]];
-  *ep = end = fmi->C[pattern[len-1]+1];
-  for (i = len-2; i >= 0; --i) {
+// The backward search part of mms(): [start, end) is the interval of
+// pattern[i + 1, len) (less skips trailing Ns)
+static int mms_from(const fm_index *fmi, const char *pattern, int len, int i,
+		    bwtint_t start, bwtint_t end, int skips, bwtint_t *sp,
+		    bwtint_t *ep) {
+  for (; i >= 0; --i) {
     if (end <= start) {
       break;
     }
@@ -328,15 +1280,19 @@ int mms(const fm_index *fmi, const char *pattern, int len, int *sp, int *ep) {
     *ep = end;
     char c = pattern[i];
     if (c == 5) {
-      // Assume it's the "most likely" one (the one with most matches)
-      int max = -1;
+      // Assume it's the "most likely" one (the one with most matches); one
+      // occ4_range() gets the counts for all of them
+      bwtint_t osp[4], oep[4], max = -1;
+      occ4_range(fmi, start, end, osp, oep);
       for (char d = 0; d < 4; ++d) {
-	int count = rank(fmi, d, end) - rank(fmi, d, start);
-	if (count > max) {
-	  max = count;
+	if (oep[d] - osp[d] > max) {
+	  max = oep[d] - osp[d];
 	  c = d;
 	}
       }
+      start = fmi->C[c] + osp[c];
+      end = fmi->C[c] + oep[c];
+      continue;
     }
     start = fmi->C[c] + rank(fmi, c, start);
     end = fmi->C[c] + rank(fmi, c, end);
@@ -350,8 +1306,428 @@ int mms(const fm_index *fmi, const char *pattern, int len, int *sp, int *ep) {
   }
 }
 
+// Finds the maximum mappable suffix of the pattern; returns the length
+// matched (starting at the end of the pattern) and stores the range
+// of matches in sp and ep.
+int mms(const fm_index *fmi, const char *pattern, int len, bwtint_t *sp,
+	bwtint_t *ep) {
+  bwtint_t start, end;
+  int i;
+  int skips = 0;
+  while (pattern[len-1] == 5) {
+    len--;
+    skips++;
+  }
+  if (kmer_lookup(fmi, pattern, len, &start, &end))
+    i = len - fmi->kmer_k - 1;
+  else {
+    *sp = start = fmi->C[pattern[len-1]];
+    *ep = end = fmi->C[pattern[len-1]+1];
+    i = len - 2;
+  }
+  return mms_from(fmi, pattern, len, i, start, end, skips, sp, ep);
+}
+
+// Widens [*sp, *ep) to the interval of the first l bases of what it's the
+// interval of: that's every row around it which shares at least l bases with
+// the next one in, which the block minima let us skip over 64 rows at a time
+static void lcp_widen(const fm_index *fmi, bwtint_t *sp, bwtint_t *ep,
+		      int l) {
+  const unsigned char *lcp = fmi->lcp, *mins = lcp + fmi->len + 2;
+  bwtint_t i = *sp, j = *ep;
+  // lcp[0] and lcp[len + 1] are both 0, so neither loop can run off the end
+  while (lcp[i] >= l) {
+    --i;
+    while ((i & (LCP_BLOCK - 1)) == LCP_BLOCK - 1 &&
+	   mins[i / LCP_BLOCK] >= l)
+      i -= LCP_BLOCK;
+  }
+  for (;;) {
+    while ((j & (LCP_BLOCK - 1)) == 0 && mins[j / LCP_BLOCK] >= l)
+      j += LCP_BLOCK;
+    if (lcp[j] < l)
+      break;
+    ++j;
+  }
+  *sp = i;
+  *ep = j;
+}
+
+int mms_shift(const fm_index *fmi, const char *pattern, int len, int shift,
+	      int matched, bwtint_t *sp, bwtint_t *ep) {
+  int l = matched - shift, i;
+  if (!fmi->lcp || l < 1 || l > LCP_MAX)
+    return mms(fmi, pattern, len, sp, ep);
+  // An N means the interval isn't for exactly what's in the pattern (and
+  // what mms() picks for it depends on what comes after it)
+  for (i = len + shift - matched; i < len + shift; ++i)
+    if (pattern[i] > 3)
+      return mms(fmi, pattern, len, sp, ep);
+  lcp_widen(fmi, sp, ep, l);
+  return mms_from(fmi, pattern, len, len - l - 1, *sp, *ep, 0, sp, ep);
+}
+
+// Backtracking search for matches with a few differences (as in BWA's
+// bwt_match_gap(); Li and Durbin, "Fast and accurate short read alignment
+// with Burrows-Wheeler transform", 2009). d[i] is a lower bound on the
+// number of differences pattern[0, i] needs: it's split greedily into
+// pieces which don't occur in the sequence, and each of those needs at
+// least one. That's what cuts off branches which can't get anywhere.
+static void diff_bound(const fm_index *fmi, const char *pattern, int len,
+		       int *d) {
+  bi_interval iv;
+  bwtint_t sp, ep;
+  int i, j = 0, z = 0;
+  bi_init(fmi, &iv);
+  for (i = 0; i < len; ++i) {
+    char c = pattern[i];
+    if (c > 3) {
+      z++;
+      j = i + 1;
+      bi_init(fmi, &iv);
+    }
+    else if (fmi_bidir(fmi)) {
+      if (!extend_right(fmi, &iv, c, &iv)) {
+	z++;
+	j = i + 1;
+	bi_init(fmi, &iv);
+      }
+    }
+    else {
+      // Without bidirectional search pattern[j, i] is searched for from
+      // scratch every time; the pieces are only about log_4(len) long, so
+      // this isn't too bad
+      loc_search(fmi, pattern + j, i - j + 1, &sp, &ep);
+      if (ep <= sp) {
+	z++;
+	j = i + 1;
+      }
+    }
+    d[i] = z;
+  }
+}
+
+enum { MM_MATCH, MM_INS, MM_DEL };
+
+struct mm_search {
+  const fm_index *fmi;
+  const char *pattern;
+  const int *d;
+  int edits, bound;
+  mm_hit *hits;
+  int nhits, max_hits;
+};
+
+// Matches pattern[0, i] backward from the interval [sp, ep), having used
+// diffs of s->bound differences so far; glen is how many bases of the
+// sequence have been matched and last what the last step was (an insertion
+// straight after a deletion, or the other way around, is just a mismatch)
+static void mm_step(struct mm_search *s, int i, bwtint_t sp, bwtint_t ep,
+		    int diffs, int glen, int last) {
+  const fm_index *fmi = s->fmi;
+  bwtint_t osp[4], oep[4];
+  int c;
+  if (s->nhits == s->max_hits)
+    return;
+  if (i < 0) {
+    // Anything with fewer differences was found by an earlier round, and the
+    // same interval can be reached with the same number more than one way
+    if (diffs < s->bound)
+      return;
+    for (c = 0; c < s->nhits; ++c)
+      if (s->hits[c].sp == sp && s->hits[c].ep == ep)
+	return;
+    s->hits[s->nhits].sp = sp;
+    s->hits[s->nhits].ep = ep;
+    s->hits[s->nhits].diffs = diffs;
+    s->hits[s->nhits++].glen = glen;
+    return;
+  }
+  if (s->bound - diffs < s->d[i])
+    return;
+  occ4_range(fmi, sp, ep, osp, oep);
+  // The base in the pattern first, so the hits with fewest differences are
+  // found before the cap is reached
+  if (s->pattern[i] <= 3) {
+    c = s->pattern[i];
+    if (oep[c] > osp[c])
+      mm_step(s, i - 1, fmi->C[c] + osp[c], fmi->C[c] + oep[c], diffs,
+	      glen + 1, MM_MATCH);
+  }
+  if (diffs == s->bound)
+    return;
+  for (c = 0; c < 4; ++c) {
+    if (oep[c] <= osp[c])
+      continue;
+    if (c != s->pattern[i])
+      mm_step(s, i - 1, fmi->C[c] + osp[c], fmi->C[c] + oep[c], diffs + 1,
+	      glen + 1, MM_MATCH);
+    // Indels at either end of the pattern are no better than mismatches
+    if (s->edits && glen && last != MM_INS)
+      mm_step(s, i, fmi->C[c] + osp[c], fmi->C[c] + oep[c], diffs + 1,
+	      glen + 1, MM_DEL);
+  }
+  if (s->edits && glen && i && last != MM_DEL)
+    mm_step(s, i - 1, sp, ep, diffs + 1, glen, MM_INS);
+}
+
+int mismatch_search(const fm_index *fmi, const char *pattern, int len,
+		    int max_diffs, int edits, mm_hit *hits, int max_hits) {
+  struct mm_search s;
+  int *d;
+  if (len < 1 || max_hits < 1)
+    return 0;
+  d = malloc(len * sizeof(int));
+  diff_bound(fmi, pattern, len, d);
+  s.fmi = fmi;
+  s.pattern = pattern;
+  s.d = d;
+  s.edits = edits;
+  s.hits = hits;
+  s.nhits = 0;
+  s.max_hits = max_hits;
+  // One round per number of differences, so hits come out in order of that
+  // and the cap keeps the best ones
+  for (s.bound = d[len-1]; s.bound <= max_diffs; ++s.bound)
+    mm_step(&s, len - 1, 0, fmi->len + 1, 0, 0, MM_MATCH);
+  free(d);
+  return s.nhits;
+}
+
+// Batched backward search. Every step of a backward search waits on a
+// cache miss into occ which depends on the step before it, so one search at
+// a time mostly leaves the core waiting on DRAM. Instead we keep
+// BATCH_WIDTH searches in flight and advance each by one base per round,
+// prefetching the blocks its next step will need; by the time we come back
+// around to it they should have arrived.
+
+enum { BS_REVERSE, BS_LOC, BS_MMS };
+
+// State of one search in a batch
+struct bs_slot {
+  int k; // Which pattern this is
+  const char *pattern;
+  int len, skips;
+  int i; // Next position of the pattern to match
+  bwtint_t start, end; // Current interval
+  bwtint_t sp, ep; // Last non-empty interval (for mms())
+};
+
+static inline void bs_prefetch(const fm_index *fmi, bwtint_t start,
+			       bwtint_t end) {
+  __builtin_prefetch(occ_block(fmi->occ, fmi->occ_shift, start));
+  __builtin_prefetch(occ_block(fmi->occ, fmi->occ_shift, end));
+}
+
+// Writes out the result of a finished search, in the same way as the
+// corresponding scalar function
+static inline void bs_finish(const struct bs_slot *s, int mode,
+			     bwtint_t *sp, bwtint_t *ep, bwtint_t *counts,
+			     int *res) {
+  switch (mode) {
+  case BS_REVERSE:
+    counts[s->k] = (s->i >= 0) ? 0 : s->end - s->start + 1;
+    break;
+  case BS_LOC:
+    sp[s->k] = s->start;
+    ep[s->k] = s->end;
+    break;
+  case BS_MMS:
+    if (s->end <= s->start) { // Didn't finish matching
+      sp[s->k] = s->sp;
+      ep[s->k] = s->ep;
+      res[s->k] = s->len - s->i - 2 + s->skips;
+    }
+    else {
+      sp[s->k] = s->start;
+      ep[s->k] = s->end;
+      res[s->k] = s->len - s->i - 1 + s->skips;
+    }
+  }
+}
+
+static void search_batch(const fm_index *fmi, int n, const char **patterns,
+			 const int *lens, bwtint_t *sp, bwtint_t *ep,
+			 bwtint_t *counts, int *res, int mode) {
+  struct bs_slot slots[BATCH_WIDTH];
+  int nslots = 0, next = 0, j;
+  while (nslots || next < n) {
+    // Keep the batch topped up
+    while (nslots < BATCH_WIDTH && next < n) {
+      struct bs_slot *s = &slots[nslots];
+      s->k = next;
+      s->pattern = patterns[next];
+      s->len = lens[next++];
+      s->skips = 0;
+      if (mode == BS_MMS)
+	while (s->len && s->pattern[s->len-1] == 5) {
+	  s->len--;
+	  s->skips++;
+	}
+      if (!s->len) {
+	// Nothing to search for (the scalar functions don't cope with this)
+	s->start = s->end = s->sp = s->ep = 0;
+	s->i = -1;
+	bs_finish(s, mode, sp, ep, counts, res);
+	continue;
+      }
+      if (kmer_lookup(fmi, s->pattern, s->len, &s->start, &s->end))
+	s->i = s->len - fmi->kmer_k - 1;
+      else {
+	s->start = fmi->C[s->pattern[s->len-1]];
+	s->end = fmi->C[s->pattern[s->len-1]+1];
+	s->i = s->len - 2;
+      }
+      s->sp = s->start;
+      s->ep = s->end;
+      bs_prefetch(fmi, s->start, s->end);
+      nslots++;
+    }
+    // Advance every search in the batch by one base
+    for (j = 0; j < nslots; ) {
+      struct bs_slot *s = &slots[j];
+      if (s->i < 0 || s->end <= s->start) {
+	bs_finish(s, mode, sp, ep, counts, res);
+	*s = slots[--nslots];
+	continue;
+      }
+      s->sp = s->start;
+      s->ep = s->end;
+      char c = s->pattern[s->i--];
+      if (c == 5 && mode == BS_MMS) {
+	bwtint_t osp[4], oep[4], max = -1;
+	occ4_range(fmi, s->start, s->end, osp, oep);
+	for (char d = 0; d < 4; ++d) {
+	  if (oep[d] - osp[d] > max) {
+	    max = oep[d] - osp[d];
+	    c = d;
+	  }
+	}
+	s->start = fmi->C[c] + osp[c];
+	s->end = fmi->C[c] + oep[c];
+      }
+      else {
+	s->start = fmi->C[c] + rank(fmi, c, s->start);
+	s->end = fmi->C[c] + rank(fmi, c, s->end);
+      }
+      bs_prefetch(fmi, s->start, s->end);
+      ++j;
+    }
+  }
+}
+
+void reverse_search_batch(const fm_index *fmi, int n, const char **patterns,
+			  const int *lens, bwtint_t *counts) {
+  search_batch(fmi, n, patterns, lens, NULL, NULL, counts, NULL, BS_REVERSE);
+}
+
+void loc_search_batch(const fm_index *fmi, int n, const char **patterns,
+		      const int *lens, bwtint_t *sp, bwtint_t *ep) {
+  search_batch(fmi, n, patterns, lens, sp, ep, NULL, NULL, BS_LOC);
+}
+
+void mms_batch(const fm_index *fmi, int n, const char **patterns,
+	       const int *lens, bwtint_t *sp, bwtint_t *ep, int *matched) {
+  search_batch(fmi, n, patterns, lens, sp, ep, NULL, matched, BS_MMS);
+}
+
+// Batched locate, along the same lines as search_batch(): each LF() step of
+// unc_sa() waits on a cache miss into occ (and for SA_TEXT, sa_mark), so we
+// walk BATCH_WIDTH rows back at once, one step each per round, prefetching
+// what each one's next step will need.
+
+// State of one row being located
+struct lr_slot {
+  bwtint_t k; // Where the result goes
+  bwtint_t idx; // The row we want SA[] for
+  bwtint_t row; // Where its walk has got to
+  int steps;
+};
+
+static inline void lr_prefetch(const fm_index *fmi, bwtint_t row) {
+  __builtin_prefetch(occ_block(fmi->occ, fmi->occ_shift, row));
+  if (fmi->sa_mode == SA_TEXT)
+    __builtin_prefetch(fmi->sa_mark + (row >> 8) * 5);
+  else if (!(row & ((1 << fmi->sa_shift) - 1)))
+    // We'll be reading the sample next time round
+    __builtin_prefetch(fmi->idxs + (((unsigned long long)(row >> fmi->sa_shift)
+				     * fmi->sa_bits) >> 6));
+}
+
+static inline int memo_get(const sa_memo *memo, bwtint_t idx, bwtint_t *out) {
+  int h = idx & (SA_MEMO_SIZE - 1);
+  if (!memo || memo->row[h] != idx)
+    return 0;
+  *out = memo->pos[h];
+  return 1;
+}
+
+static inline void memo_put(sa_memo *memo, bwtint_t idx, bwtint_t pos) {
+  int h = idx & (SA_MEMO_SIZE - 1);
+  if (!memo)
+    return;
+  memo->row[h] = idx;
+  memo->pos[h] = pos;
+}
+
+// Locates rows[k] (or sp + k, if rows is NULL) for k from 0 to n-1
+static void locate_batch(const fm_index *fmi, bwtint_t n, const bwtint_t *rows,
+			 bwtint_t sp, bwtint_t *out, sa_memo *memo) {
+  struct lr_slot slots[BATCH_WIDTH];
+  int nslots = 0, j;
+  bwtint_t next = 0;
+  while (nslots || next < n) {
+    // Keep the batch topped up
+    while (nslots < BATCH_WIDTH && next < n) {
+      struct lr_slot *s = &slots[nslots];
+      s->k = next;
+      s->idx = s->row = rows ? rows[next] : sp + next;
+      next++;
+      if (memo_get(memo, s->idx, &out[s->k]))
+	continue;
+      s->steps = 0;
+      lr_prefetch(fmi, s->row);
+      nslots++;
+    }
+    // Move every walk back by one step
+    for (j = 0; j < nslots; ) {
+      struct lr_slot *s = &slots[j];
+      if (sa_sampled(fmi, s->row)) {
+	out[s->k] = sa_finish(fmi, s->row, s->steps);
+	memo_put(memo, s->idx, out[s->k]);
+	*s = slots[--nslots];
+	continue;
+      }
+      s->row = lf(fmi, s->row);
+      s->steps++;
+      lr_prefetch(fmi, s->row);
+      ++j;
+    }
+  }
+}
+
+void locate_range(const fm_index *fmi, bwtint_t sp, bwtint_t ep,
+		  bwtint_t *out, sa_memo *memo) {
+  if (ep > sp)
+    locate_batch(fmi, ep - sp, NULL, sp, out, memo);
+}
+
+void locate_rows(const fm_index *fmi, int n, const bwtint_t *rows,
+		 bwtint_t *out, sa_memo *memo) {
+  locate_batch(fmi, n, rows, 0, out, memo);
+}
+
+bwtint_t unc_sa_memo(const fm_index *fmi, sa_memo *memo, bwtint_t idx) {
+  bwtint_t x;
+  if (memo_get(memo, idx, &x))
+    return x;
+  x = unc_sa(fmi, idx);
+  memo_put(memo, idx, x);
+  return x;
+}
+
 // Prints part of a compressed sequence in more human readable format
-void printseq(const char *seq, int startidx, int len) {
+void printseq(const char *seq, bwtint_t startidx, int len) {
   const char *nts = "ACGT";
   for (int i = 0; i < len; ++i) {
     putchar(nts[getbase(seq, startidx+i)]);
@@ -1,45 +1,361 @@
 #ifndef _SEQINDEX_H
 #define _SEQINDEX_H
 
+#include <stddef.h>
+#include "bwtint.h"
+
 // The function to build the sequence index are here, as are the functions
 // relating to the actual FM-index, as well as the struct definition thereof
 
 
-int **seq_index(char *, int, int, const unsigned char *);
+// The occurrence table is split into blocks of (1 << RANK_SHIFT) BWT symbols.
+// Any shift from 6 to 12 works; bigger blocks use less memory (the counts
+// are 16 bytes per block) but make rank() count through more words. With
+// the default a block is 32 bytes, so it never straddles a cache line.
+// (Build with e.g. -DRANK_SHIFT=8 to change it)
+#ifndef RANK_SHIFT
+#define RANK_SHIFT 6
+#endif
+
+// By default every 32nd row of the suffix array is kept (SA_SHIFT is the log2
+// of that); a smaller rate makes unc_sa() quicker and the index bigger.
+// build_index can be told to use any other power of 2.
+#ifndef SA_SHIFT
+#define SA_SHIFT 5
+#endif
+
+// Which entries of the suffix array are kept: SA_ROWS keeps every k-th row,
+// which is cheap to check for but puts no bound on the number of LF() steps
+// unc_sa() takes to get to one (a repetitive region can go a long way without
+// passing a sampled row). SA_TEXT keeps the rows for every k-th position of
+// the sequence instead, so unc_sa() takes at most k-1 steps; it needs a
+// bitvector to say which rows those are (one more cache miss per step).
+enum { SA_ROWS, SA_TEXT };
+
+// Longest k-mers the k-mer table (see fmi_build_kmers()) can be built for;
+// the table has 4^k entries, so 14 is already over a gigabyte
+#define KMER_MAX 14
+
+// One block of the occurrence table: the number of each base in the BWT
+// before the start of the block, followed by the symbols the block covers,
+// 32 to a 64-bit word (symbol i of a word is in bits 2i and 2i+1).
+// The counts are relative to the start of the superblock (of 2^32 rows) that
+// the block is in, so they always fit in 32 bits; with BWT_LONG the counts at
+// the start of each superblock are kept separately (there are only a handful
+// of them, so that table stays in cache).
+typedef struct _rank_block {
+	unsigned int cnt[4];
+	unsigned long long bwt[];
+} rank_block;
+
+#ifndef OCC_SUPER_SHIFT
+#define OCC_SUPER_SHIFT 32
+#endif
+
+// Size of a block of the occurrence table, in 64-bit words
+#define OCC_WORDS(shift) (2 + (1 << ((shift) - 5)))
+
+// Sizes (in bytes) of the occurrence table and of the superblock counts for
+// a sequence of length len
+static inline size_t occ_size(bwtint_t len, int shift) {
+  return (size_t)(((len+1) >> shift) + 1) * OCC_WORDS(shift) *
+    sizeof(unsigned long long);
+}
 
-int seq_rank(unsigned char *, int **, int, int, char, const unsigned char *);
+static inline size_t occ_super_size(bwtint_t len) {
+  return (size_t)((((long long)len+1) >> OCC_SUPER_SHIFT) + 1) * 4 *
+    sizeof(long long);
+}
 
-unsigned char *lookup_table();
+rank_block *seq_index(const char *, bwtint_t, bwtint_t, int, bwtint_t **);
+
+unsigned int seq_rank(const rank_block *, int, bwtint_t, char);
+
+void seq_occ4(const rank_block *, int, bwtint_t, unsigned int *);
 
 typedef struct _fmi {
-	char *bwt;
-	int *idxs;
-	int **rank_index;
-	unsigned char* lookup;
-	int endloc;
-	int C[5];
-	int len;
+	rank_block *occ; // Interleaved BWT and rank index (len+1 symbols)
+	int occ_shift; // log2 of the number of symbols per block of occ
+	bwtint_t *occ_super; // Counts at each superblock (BWT_LONG only)
+	unsigned long long *idxs; // SA samples, packed sa_bits bits apiece
+	int sa_shift; // log2 of the SA sampling rate
+	int sa_bits; // Bits per SA sample (enough to hold len)
+	int sa_mode; // SA_ROWS or SA_TEXT
+	// For SA_TEXT, the sampled rows: blocks of 5 words, a count of the
+	// sampled rows before the block and then a 256 row bitvector; the
+	// samples are stored divided by the rate, in order of row
+	unsigned long long *sa_mark;
+	// Optional table of the intervals of every kmer_k-mer: entry x is the
+	// first row of k-mer x (in the same order as the rows, i.e. A first)
+	// shifted up 4 bits, plus the number of suffixes shorter than kmer_k
+	// which come just before it (they're the only thing between the end of
+	// one interval and the start of the next)
+	int kmer_k; // 0 if there's no table
+	int kmer_bits; // Bits per entry
+	unsigned long long *kmer;
+	// Optional index of the reversed sequence, for bidirectional search
+	// (only occ, C and endloc are filled in; positions come from this one)
+	struct _fmi *rev;
+	// Nonzero if the sequence indexed is some sequence followed by its
+	// reverse complement (see fmd_seq()); such an index can do
+	// bidirectional search without rev
+	int fmd;
+	// Optional LCP array: lcp[i] is the length of the longest common prefix
+	// of rows i - 1 and i (capped at LCP_MAX, with lcp[0] = lcp[len + 1] =
+	// 0), followed by the minimum of each block of LCP_BLOCK of them
+	unsigned char *lcp;
+	bwtint_t endloc;
+	bwtint_t C[5];
+	bwtint_t len;
+	const char *ref; // Packed reference, if the index file had one
+	// Optional table of the contigs the sequence is made of (the records
+	// of a FASTA file; see fmi_contig()): contigs[0] is the number of
+	// contigs n, contigs[1..n+1] are where each starts in the sequence
+	// followed by the length of the sequence (of the first half, for an
+	// FMD index), and contigs[n+2..2n+2] are where each one's name starts in
+	// the names after them followed by their total length; each name ends
+	// in a 0. Like ref, destroy_fmi() leaves it alone
+	const long long *contigs;
+	void *map; // If the index was mmap()ed, the mapping everything's in
+	size_t map_len;
 } fm_index;
 
+// The SA samples and the k-mer table are arrays of bits-bit values packed
+// into 64-bit words. packed_size() is the size of n of them in bytes; there's
+// one extra word at the end so that packed_get() never needs to check
+// whether it's at the end.
+static inline size_t packed_size(size_t n, int bits) {
+  return ((n * bits + 63) / 64 + 1) * sizeof(unsigned long long);
+}
+
+static inline unsigned long long packed_get(const unsigned long long *a,
+					    int bits, size_t i) {
+  unsigned long long bit = (unsigned long long)i * bits;
+  const unsigned long long *w = a + (bit >> 6);
+  int off = bit & 63;
+  // The second shift is split in two so that off == 0 works
+  return ((w[0] >> off) | ((w[1] << 1) << (63 - off))) &
+    ((1ULL << bits) - 1);
+}
+
+#define LCP_MAX 255
+#define LCP_BLOCK 64
+
+static inline size_t lcp_size(bwtint_t len) {
+  return (len + 2) + (len + 2 + LCP_BLOCK - 1) / LCP_BLOCK;
+}
+
+// Number of bits needed for SA samples no bigger than max, and the size of
+// the packed samples for a sequence of length len (both modes keep
+// (len >> shift) + 1 samples)
+static inline int sa_bits(bwtint_t max) {
+  return max ? 64 - __builtin_clzll(max) : 1;
+}
+
+static inline size_t sa_size(bwtint_t len, int shift, int bits) {
+  return packed_size((size_t)(len >> shift) + 1, bits);
+}
+
+// Bits per entry and size of the k-mer table for a sequence of length len
+static inline int kmer_bits(bwtint_t len) {
+  return sa_bits(len + 1) + 4;
+}
+
+static inline size_t kmer_size(bwtint_t len, int k) {
+  return packed_size(((size_t)1 << (2 * k)) + 1, kmer_bits(len));
+}
+
+// Size of sa_mark (in bytes)
+static inline size_t sa_mark_size(bwtint_t len) {
+  return (size_t)((len+1) / 256 + 1) * 5 * sizeof(unsigned long long);
+}
+
+// Size of a contig table (in bytes)
+static inline size_t contig_size(const long long *contigs) {
+  return (2 * contigs[0] + 3) * sizeof(long long) + contigs[2 * contigs[0] + 2];
+}
+
+// Gets the i-th SA sample (i.e. SA[i << sa_shift] for SA_ROWS)
+static inline bwtint_t sa_sample(const fm_index *fmi, bwtint_t i) {
+  return packed_get(fmi->idxs, fmi->sa_bits, i);
+}
+
+// Writes the BWT (without the '$') back out in the packed form returned by
+// sprintcbwt(); out should have at least (len+3)/4 bytes of space
+void unpack_bwt(const fm_index *fmi, char *out);
+
 // As the name suggests; deallocates all memory allocated for fmi, including
-// fmi itself
+// fmi itself (or unmaps it, if it was mapped from a file)
 void destroy_fmi(fm_index *fmi);
 
 // Creates a FM-index from a given sequence using multithreaded histogram
-// sort (allocating memory dynamically)
-fm_index *make_fmi(const char *str, int len);
+// sort (allocating memory dynamically), with a thread per core unless
+// fmi_set_build_threads() says otherwise
+fm_index *make_fmi(const char *str, bwtint_t len, int sa_shift, int sa_mode);
 
 // Creates a FM-inde from a give sequence using SACA-K (allocating memory
-// dynamically)
-fm_index *make_fmi_sacak(const char *str, int len);
+// dynamically). For both, one in every (1 << sa_shift) SA entries is kept,
+// chosen as per sa_mode (normally SA_SHIFT and SA_ROWS)
+fm_index *make_fmi_sacak(const char *str, bwtint_t len, int sa_shift,
+			 int sa_mode);
+
+// Sets the number of threads make_fmi_sacak(), fmi_build_rev() and
+// fmi_build_lcp() build suffix arrays with (1 by default). With more than one
+// they use psuff_arr() (see psort.h) rather than SACA-K, which gives the same
+// index faster but takes three times the memory. The suffix array is then
+// split between that many threads to be put into the index, and so is the
+// occurrence table to have its counts added up.
+void fmi_set_build_threads(int n);
+
+// Makes make_fmi_sacak(), fmi_build_rev() and fmi_build_lcp() use the
+// histogram sort (see histsortcomp.h) instead, with a thread per core or as
+// many as fmi_set_build_threads() says. The index is the same either way; the
+// histogram sort is usually the fastest, and sorts in place, so it takes
+// about as much memory as SACA-K.
+void fmi_set_build_histsort(int on);
+
+// Makes make_fmi_sacak() and fmi_build_rev() go through the suffix array n
+// blocks at a time (see bsuff_arr() in blockwise.h) rather than building it
+// all at once, keeping only the BWT and the SA samples; 0 (the default)
+// turns that off. It's slower, but takes much less memory. fmi_build_lcp()
+// still needs the whole suffix array.
+void fmi_set_build_blocks(int n);
+
+// Makes make_fmi_sacak() and fmi_build_rev() go through the suffix array in
+// as few blocks as will fit in about bytes of memory (overriding
+// fmi_set_build_blocks()); that's just for the sorting, not the sequence or
+// the index itself.
+void fmi_set_build_budget(size_t bytes);
+
+// Makes the big arrays of the indexes built from now on (the BWT while it's
+// being built, the occurrence table, the SA samples and the k-mer table) be
+// mappings of scratch files in dir rather than in memory, so that the
+// kernel can write them out as they're filled in; the files are deleted as
+// soon as they're made, and go when the index is destroyed. NULL (the
+// default) keeps everything in memory. dir has to stay around until then.
+void fmi_set_build_tmpdir(const char *dir);
+
+// Adds a table of the intervals of all k-mers (k from 1 to KMER_MAX) to fmi,
+// so that reverse_search(), locate(), loc_search(), mms() and the batched
+// searches can start k bases into the pattern rather than doing the first k
+// rank() steps (which are the ones most likely to miss the cache, since the
+// intervals are still wide). The results are exactly the same either way.
+void fmi_build_kmers(fm_index *fmi, int k);
+
+// Adds an index of the reversed sequence (str, which fmi was built from,
+// reversed; not the reverse complement) to fmi, so that the bidirectional
+// search functions below can be used
+void fmi_build_rev(fm_index *fmi, const char *str);
+
+// Adds the LCP array to fmi (str is the sequence it was built from), which
+// mms_shift() uses
+void fmi_build_lcp(fm_index *fmi, const char *str);
+
+// Makes the sequence for an FMD index (Li, "Exploring single-sample SNP and
+// INDEL calling with whole-genome de novo assembly", 2012): str (len bases)
+// followed by its reverse complement, packed the same way (so 2 * len bases).
+// A search of this finds matches on both strands at once: a match at
+// position p >= len is a match of the reverse complement at
+// 2 * len - p - (length matched). Since the reverse of the whole thing is
+// its complement, the interval of the reverse complement of a pattern is in
+// the same index, which is all bidirectional search needs; an index built
+// from it should have fmd set.
+char *fmd_seq(const char *str, bwtint_t len);
+
+// Finds the contig the n bases of the sequence from pos are in (by binary
+// search of fmi->contigs), putting where they start in it in off. Returns -1
+// if they run from one contig into the next: there's nothing between them
+// in the sequence, so a match can, but it's not a real one. Without a
+// contig table the whole sequence is contig 0.
+long long fmi_contig(const fm_index *fmi, bwtint_t pos, bwtint_t n,
+		     bwtint_t *off);
+
+// The piece of the indexed sequence that pos is in: its contig or, in an
+// FMD index, the reverse complement of one (or without a contig table, the
+// whole sequence or strand). Puts where the piece starts in start and
+// returns where it ends. Nothing separates one piece from the next, so a
+// search can find a match that runs over from one into the other; only the
+// part of it in one piece is real. Backward searches find the end of a
+// match first, so it's the start of the piece its last base is in that
+// says where to cut it.
+bwtint_t fmi_piece(const fm_index *fmi, bwtint_t pos, bwtint_t *start);
+
+// The name of contig i (from its FASTA header, up to the first space), or
+// NULL if there's no contig table
+const char *fmi_contig_name(const fm_index *fmi, long long i);
+
+// Whether fmi can do bidirectional search
+static inline int fmi_bidir(const fm_index *fmi) {
+  return fmi->rev || fmi->fmd;
+}
 
 // Calculates the rank of a given symbol at a given index (i.e. the number
 // of times the symbol has appeared up to that point) using the FM-index
 // (Roughly constant time; this depends on implementation)
-int rank(const fm_index *fmi, char c, int idx);
+bwtint_t rank(const fm_index *fmi, char c, bwtint_t idx);
+
+// Calculates the ranks of all four bases at idx at once (out[c] is
+// rank(fmi, c, idx)); this only visits the one block, so it's about as cheap
+// as a single call to rank()
+void occ4(const fm_index *fmi, bwtint_t idx, bwtint_t out[4]);
+
+// The same for both ends of the interval [sp, ep), sharing the work when they
+// fall in the same block; the interval for c prepended to the current one is
+// then [C[c] + osp[c], C[c] + oep[c])
+void occ4_range(const fm_index *fmi, bwtint_t sp, bwtint_t ep,
+		bwtint_t osp[4], bwtint_t oep[4]);
+
+// Bidirectional search: with fmi->rev, a pattern P's interval in fmi and the
+// reversed pattern's interval in fmi->rev are kept in step (they always have
+// the same size), which lets P be extended at either end. In an FMD index
+// the second interval is that of P's reverse complement, in fmi itself. extend_left() gives
+// the interval of cP and extend_right() that of Pc; each is one occ4_range()
+// on one of the two indexes (Lam et al., "High throughput short read alignment
+// via bi-directional BWT", 2009). So a seed can be grown out in both
+// directions from wherever it starts, rather than only leftwards and from the
+// end of the pattern as with backward search. Rows in fsp are rows of fmi, so
+// positions are found with unc_sa(fmi, ...) as usual.
+typedef struct _bi_interval {
+	bwtint_t fsp; // Start of the interval of P in fmi
+	bwtint_t rsp; // Start of the interval of reversed P in fmi->rev (or of
+		      // P's reverse complement, in an FMD index)
+	bwtint_t size;
+} bi_interval;
+
+// The interval of the empty pattern (i.e. every row)
+static inline void bi_init(const fm_index *fmi, bi_interval *iv) {
+  iv->fsp = iv->rsp = 0;
+  iv->size = fmi->len + 1;
+}
+
+// Both return the size of the new interval (0 if the extended pattern doesn't
+// occur, in which case out is no use for anything)
+bwtint_t extend_left(const fm_index *fmi, const bi_interval *iv, char c,
+		     bi_interval *out);
+
+bwtint_t extend_right(const fm_index *fmi, const bi_interval *iv, char c,
+		      bi_interval *out);
+
+// A super-maximal exact match (SMEM): pattern[start, end) occurs in the
+// sequence, can't be extended either way, and isn't contained in any other
+// match which can't
+typedef struct _smem {
+	int start, end;
+	bi_interval iv; // iv.rsp is only filled in with fmi_bidir()
+} smem;
+
+// Finds the SMEMs of pattern (which is in 0-3 form; anything else, such as
+// an N, doesn't match anywhere) which are at least min_len long, in order of
+// start, returning how many there are; out needs room for len of them. Every
+// base of the pattern that's in any exact match at all is covered by one of
+// them. With fmi_bidir() this takes time linear in len (it's the algorithm
+// BWA uses); otherwise every position is searched back from separately, which is
+// linear in len times the length of the matches.
+int find_smems(const fm_index *fmi, const char *pattern, int len, int min_len,
+	       smem *out);
 
 // Calculates the LF column mapping using the FM-index (constant time)
-int lf(const fm_index *fmi, int idx);
+bwtint_t lf(const fm_index *fmi, bwtint_t idx);
 
 // Searches for an exact pattern over the indexed sequence; returns
 // the "first" (in this context, this means the rotation which appears
@@ -47,23 +363,102 @@ int lf(const fm_index *fmi, int idx);
 // are multiple matches.
 // pattern should be given uncompressed but in 0-3 form.
 // Linear time in len * complexity of rank()
-int reverse_search(const fm_index *fmi, const char *pattern, int len);
+bwtint_t reverse_search(const fm_index *fmi, const char *pattern, int len);
 
 // Calculates SA[idx] from the FM-index
-int unc_sa(const fm_index *fmi, int idx);
+bwtint_t unc_sa(const fm_index *fmi, bwtint_t idx);
+
+// The number of LF() steps unc_sa(fmi, idx) takes (for benchmarking)
+int unc_sa_steps(const fm_index *fmi, bwtint_t idx);
+
+// A small cache of SA[i] values, for when the same rows are likely to be
+// looked up more than once (e.g. while aligning one read); it's direct mapped
+// on the row, so it never needs more than a compare to check. Clear it before
+// each read.
+#define SA_MEMO_SIZE 256
+
+typedef struct _sa_memo {
+	bwtint_t row[SA_MEMO_SIZE];
+	bwtint_t pos[SA_MEMO_SIZE];
+} sa_memo;
+
+static inline void sa_memo_clear(sa_memo *m) {
+  for (int i = 0; i < SA_MEMO_SIZE; ++i)
+    m->row[i] = -1;
+}
+
+// Calculates SA[i] for every i in [sp, ep), putting it in out[i - sp]. The
+// LF() walks for all the rows are done together (BATCH_WIDTH at a time, as
+// in search_batch()), so their cache misses overlap rather than one walk
+// waiting on each in turn. memo can be NULL; if not, rows found in it aren't
+// walked at all, and the rest are added to it.
+void locate_range(const fm_index *fmi, bwtint_t sp, bwtint_t ep,
+		  bwtint_t *out, sa_memo *memo);
+
+// The same for n rows which aren't next to each other (out[k] is
+// SA[rows[k]])
+void locate_rows(const fm_index *fmi, int n, const bwtint_t *rows,
+		 bwtint_t *out, sa_memo *memo);
+
+// unc_sa(), going through memo first
+bwtint_t unc_sa_memo(const fm_index *fmi, sa_memo *memo, bwtint_t idx);
 
 // Same as reverse_search
-int locate(const fm_index *fmi, const char *pattern, int len);
+bwtint_t locate(const fm_index *fmi, const char *pattern, int len);
 
 // Same as locate, but returns the indices all matches (in the BWT; this means
 // that you need to retrieve their indices using unc_sa) via sp and ep
-void loc_search(const fm_index *fmi, const char *pattern, int len, int *sp, int *ep);
+void loc_search(const fm_index *fmi, const char *pattern, int len, bwtint_t *sp, bwtint_t *ep);
 
 // Finds the maximum mappable suffix of a given pattern; returns the number
 // of bases matched, storing matches in sp and ep as per loc_search
-int mms(const fm_index *fmi, const char *pattern, int len, int *sp, int *ep);
+int mms(const fm_index *fmi, const char *pattern, int len, bwtint_t *sp, bwtint_t *ep);
+
+// A match of a pattern with differences: rows [sp, ep) of the index start
+// with it, and it takes up glen bases of the sequence
+typedef struct _mm_hit {
+	bwtint_t sp, ep;
+	int diffs;
+	int glen;
+} mm_hit;
+
+// Finds the matches of pattern with at most max_diffs mismatches (or, if
+// edits is nonzero, mismatches and single-base insertions and deletions),
+// backtracking over the index and giving up on a branch as soon as a lower
+// bound on the differences the rest of the pattern needs says it can't
+// work. Puts at most max_hits of them into hits, fewest differences first,
+// and returns how many it found. Quickest with fmi_bidir(), which the bound
+// is worked out with.
+int mismatch_search(const fm_index *fmi, const char *pattern, int len,
+		    int max_diffs, int edits, mm_hit *hits, int max_hits);
+
+// The same as mms(fmi, pattern, len, sp, ep), given that mms(fmi, pattern,
+// len + shift, sp, ep) just matched matched bases, with that interval in sp
+// and ep: i.e. for when a search gave up on a match and is trying again from
+// shift bases further left. The bases in common with the last match needn't
+// be searched for again; with fmi->lcp their interval can be found by
+// widening the last one (as long as there are at most LCP_MAX of them), so
+// only the new bases are. Otherwise it just calls mms().
+int mms_shift(const fm_index *fmi, const char *pattern, int len, int shift,
+	      int matched, bwtint_t *sp, bwtint_t *ep);
+
+// Batched versions of reverse_search(), loc_search() and mms(): these search
+// for n patterns at once, keeping BATCH_WIDTH of them in flight so that
+// their cache misses overlap (see search_batch() in seqindex.c). The results
+// for pattern k (which has length lens[k]) are exactly what the scalar
+// function would give; for mms_batch(), matched[k] is mms()'s return value.
+#define BATCH_WIDTH 32
+
+void reverse_search_batch(const fm_index *fmi, int n, const char **patterns,
+			  const int *lens, bwtint_t *counts);
+
+void loc_search_batch(const fm_index *fmi, int n, const char **patterns,
+		      const int *lens, bwtint_t *sp, bwtint_t *ep);
+
+void mms_batch(const fm_index *fmi, int n, const char **patterns,
+	       const int *lens, bwtint_t *sp, bwtint_t *ep, int *matched);
 
 // Prints part of a compressed sequence in human-readable form
-void printseq(const char *seq, int startidx, int len);
+void printseq(const char *seq, bwtint_t startidx, int len);
 
 #endif /* _SEQINDEX_H */
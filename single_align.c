@@ -2,7 +2,19 @@
 // file, assuming that they are not spliced reads
 // This, of course, requires that we put another function together.
 
-// usage: single_align seqfile indexfile readfile
+// usage: single_align [-m] [seqfile] indexfile readfile
+// -m picks anchors from the SMEMs of each read (see find_anchors_smem()) rather
+// than searching back from the end of the read again and again; it's
+// quickest with an index built with build_index -b.
+// -d diffs retries the reads which still don't align, looking for them with
+// up to diffs mismatches.
+// With an index built with build_index -f, which has both strands, each read
+// is only tried once; the position of one on the reverse strand is given
+// just as if its reverse complement had been tried.
+// With an index of a FASTA file with a contig table (see build_index.c),
+// each position is given as the contig's name and the position in it,
+// separated by a tab. A read which runs off the end of a contig is aligned
+// up to it, with the rest of it as an insertion (see fmi_piece()).
 
 #include <stdio.h>
 #include <string.h>
@@ -16,15 +28,16 @@
 #include "smw.h"
 #include "stack.h"
 
-unsigned char getbase(const char *str, int idx) {
+unsigned char getbase(const char *str, bwtint_t idx) {
   if (idx<0) idx=0;
 	// Gets the base at the appropriate index
 	return ((str[idx>>2])>>(2*(3-(idx&3)))) & 3;
 }
 
 // Continues a MMS search
-int mms_continue(const fm_index *fmi, const char *pattern, int len, int *sp, int *ep) {
-  int start, end, i;
+int mms_continue(const fm_index *fmi, const char *pattern, int len, bwtint_t *sp, bwtint_t *ep) {
+  bwtint_t start, end;
+  int i;
   start = *sp;
   end = *ep;
   for (i = len-1; i >= 0; --i) {
@@ -33,8 +46,23 @@ int mms_continue(const fm_index *fmi, const char *pattern, int len, int *sp, int
     }
     *sp = start;
     *ep = end;
-    start = fmi->C[pattern[i]] + rank(fmi, pattern[i], start);
-    end = fmi->C[pattern[i]] + rank(fmi, pattern[i], end);
+    char c = pattern[i];
+    if (c == 5) {
+      // N; take whichever base has the most matches, as mms() does
+      bwtint_t osp[4], oep[4], max = -1;
+      occ4_range(fmi, start, end, osp, oep);
+      for (char d = 0; d < 4; ++d) {
+	if (oep[d] - osp[d] > max) {
+	  max = oep[d] - osp[d];
+	  c = d;
+	}
+      }
+      start = fmi->C[c] + osp[c];
+      end = fmi->C[c] + oep[c];
+      continue;
+    }
+    start = fmi->C[c] + rank(fmi, c, start);
+    end = fmi->C[c] + rank(fmi, c, end);
   }
   if (end <= start) // Didn't finish matching
     return len - i - 2;
@@ -47,21 +75,27 @@ int mms_continue(const fm_index *fmi, const char *pattern, int len, int *sp, int
 
 // Tries continuing a mms search with mismatch; returns upon finding any continuation with at least 6 matching nts
 // Last argument is the difference between the return value and the number of nts on the genome matched (from -3 to 3).
-int mms_mismatch(const fm_index *fmi, const char *seq, const char *pattern, int len, int *sp, int *ep, int *genomeskips) {
+int mms_mismatch(const fm_index *fmi, const char *seq, const char *pattern, int len, bwtint_t *sp, bwtint_t *ep, int *genomeskips) {
   // If there are too many matches, don't even bother
   //  if (*ep - *sp > 10)
   //    return -1;
+  // The genome's base before row i is BWT[i], so "substitute whatever the
+  // genome has there" is just LF(i); there's no need to go through unc_sa()
+  // and the sequence for it. Rather than calling lf() for each row we keep
+  // the counts of all four bases up to the current row with occ4(): the one
+  // which goes up at the next row is BWT[i], and its count is the rank LF(i)
+  // needs, so each row only takes one occ4() (one block visit)
   if (len < 2) { // nothing to do, really
-    int loc = unc_sa(fmi, *sp);
-    char sub_c = getbase(seq, loc-1);
-    *sp = fmi->C[sub_c] + rank(fmi, sub_c, *sp);
+    *sp = lf(fmi, *sp);
     *ep = *sp + 1;
     *genomeskips = 0;
     return 1;
   }
   int best_align = 0;
-  int best_pos = -1;
-  for (int i = *sp; i < *ep; ++i) {
+  bwtint_t best_pos = -1;
+  bwtint_t cnt[4], next[4];
+  occ4(fmi, *sp, cnt);
+  for (bwtint_t i = *sp; i < *ep; ++i) {
     // Reads the start and end from sp and ep instead of using the last
     // character of the sequence. It assumes that we have a mismatch at that
     // point (mms returns if that happens or it finished)
@@ -70,10 +104,18 @@ int mms_mismatch(const fm_index *fmi, const char *seq, const char *pattern, int
     // 1) Assume that there was a substitution at that point. Use LF() to skip
     // to the next nt and decrement len, then try aligning
     {
-      int loc = unc_sa(fmi, i);
-      char sub_c = getbase(seq, loc-1);
-      int sub_idx = fmi->C[sub_c] + rank(fmi, sub_c, i), ins_idx = sub_idx;
-      int sub_end = sub_idx + 1, sub_align;
+      // No count goes up at the '$' (it isn't counted), which LF() sends to
+      // row 0
+      bwtint_t sub_idx = 0;
+      occ4(fmi, i + 1, next);
+      for (int c = 0; c < 4; ++c) {
+	if (next[c] != cnt[c])
+	  sub_idx = fmi->C[c] + cnt[c];
+	cnt[c] = next[c];
+      }
+      bwtint_t ins_idx = sub_idx;
+      bwtint_t sub_end = sub_idx + 1;
+      int sub_align;
       sub_align = mms_continue(fmi, pattern, len-1, &sub_idx, &sub_end) + 1;
       best_align = sub_align;
       best_pos = sub_idx;
@@ -84,9 +126,10 @@ int mms_mismatch(const fm_index *fmi, const char *seq, const char *pattern, int
 
       // 1.5) Assume that there was an insertion (on the genome) at that point of up to three nts
       // Use LF() to skip one, two, and three nts and _don't_ decrement len, then try aligning for each of those
-      int bleh = ins_idx;
+      bwtint_t bleh = ins_idx;
 
-      int ins_end = ins_idx + 1, ins_align;
+      bwtint_t ins_end = ins_idx + 1;
+      int ins_align;
       ins_align = mms_continue(fmi, pattern, len, &ins_idx, &ins_end);
       if (ins_align > 5 || ins_align == len) {
 	best_align = sub_align;
@@ -96,9 +139,8 @@ int mms_mismatch(const fm_index *fmi, const char *seq, const char *pattern, int
       }
 
       // two!
-      sub_c = getbase(seq, loc-2);
-      ins_idx = fmi->C[sub_c] + rank(fmi, sub_c, bleh);
-      int blah = ins_idx;
+      ins_idx = lf(fmi, bleh);
+      bwtint_t blah = ins_idx;
       ins_align = mms_continue(fmi, pattern, len, &ins_idx, &ins_end);
       if (ins_align > 5 || ins_align == len) {
 	best_align = sub_align;
@@ -108,8 +150,7 @@ int mms_mismatch(const fm_index *fmi, const char *seq, const char *pattern, int
       }
 
       // three!
-      sub_c = getbase(seq, loc-3);
-      ins_idx = fmi->C[sub_c] + rank(fmi, sub_c, blah);
+      ins_idx = lf(fmi, blah);
       ins_align = mms_continue(fmi, pattern, len, &ins_idx, &ins_end);
       if (ins_align > 5 || ins_align == len) {
 	best_align = sub_align;
@@ -124,7 +165,8 @@ int mms_mismatch(const fm_index *fmi, const char *seq, const char *pattern, int
     {
       // This one is a lot simpler because we don't actually need to
       // figure out the character
-      int del_idx = i, del_end = del_idx + 1, del_align;
+      bwtint_t del_idx = i, del_end = del_idx + 1;
+      int del_align;
       del_align = mms_continue(fmi, pattern, len-1, &del_idx, &del_end) + 1;
       if (del_align > 6 || del_align == len) {
 	best_align = del_align;
@@ -159,37 +201,178 @@ int mms_mismatch(const fm_index *fmi, const char *seq, const char *pattern, int
   return best_align;
 }
 
+// Where the first anchor search of align_read_anchored() got to: the
+// remaining read length and anchor misses, and the last mms() result
+// (seglen is 0 if no anchor was found)
+typedef struct _anchor {
+  int len;
+  int anchmisses;
+  int seglen;
+  bwtint_t sp, ep;
+} anchor;
+
+// Runs the first anchor search loop of align_read_anchored() for n reads at
+// once. The searches for different reads don't depend on each other (unlike
+// the rest of the alignment), so they can go through mms_batch() together.
+void find_anchors(const fm_index *fmi, int n, char **patterns, const int *lens, int anchor_len, anchor *a) {
+  int *active = malloc(n * sizeof(int)), *plens = malloc(n * sizeof(int));
+  bwtint_t *sp = malloc(n * sizeof(bwtint_t)), *ep = malloc(n * sizeof(bwtint_t));
+  int *matched = malloc(n * sizeof(int));
+  const char **pats = malloc(n * sizeof(char *));
+  int nactive = 0;
+  for (int k = 0; k < n; ++k) {
+    a[k].len = lens[k];
+    a[k].anchmisses = lens[k]/10;
+    a[k].seglen = 0;
+    if (a[k].len > anchor_len && a[k].anchmisses > 0)
+      active[nactive++] = k;
+  }
+  while (nactive) {
+    for (int j = 0; j < nactive; ++j) {
+      pats[j] = patterns[active[j]];
+      plens[j] = a[active[j]].len;
+    }
+    mms_batch(fmi, nactive, pats, plens, sp, ep, matched);
+    int still = 0;
+    for (int j = 0; j < nactive; ++j) {
+      int k = active[j];
+      // With an LCP array a failed search can be carried on from 3 bases
+      // further left straight away (see mms_shift())
+      while (fmi->lcp && (matched[j] < anchor_len || ep[j] - sp[j] > 1) &&
+	     a[k].len - 3 > anchor_len && a[k].anchmisses > 1) {
+	a[k].anchmisses--;
+	a[k].len -= 3;
+	matched[j] = mms_shift(fmi, patterns[k], a[k].len, 3, matched[j],
+			       &sp[j], &ep[j]);
+      }
+      a[k].sp = sp[j];
+      a[k].ep = ep[j];
+      if (matched[j] < anchor_len || ep[j] - sp[j] > 1) {
+	a[k].anchmisses--;
+	a[k].len -= 3;
+	if (a[k].len > anchor_len && a[k].anchmisses > 0)
+	  active[still++] = k;
+      }
+      else
+	a[k].seglen = matched[j];
+    }
+    nactive = still;
+  }
+  free(active);
+  free(plens);
+  free(sp);
+  free(ep);
+  free(matched);
+  free(pats);
+}
+
+// The same, but taking the anchor from the SMEMs of each read (see
+// find_smems()): the one which ends furthest right out of those which are at
+// least anchor_len long and unique. That's one pass over the read, where the
+// loop above does a new search every time it gives up on an anchor and skips
+// back 3 bases. The anchor won't always be the same one; anchmisses is set
+// as if the loop above had skipped back to it.
+void find_anchors_smem(const fm_index *fmi, int n, char **patterns, const int *lens, int anchor_len, anchor *a) {
+  int maxlen = 0;
+  for (int k = 0; k < n; ++k)
+    if (lens[k] > maxlen)
+      maxlen = lens[k];
+  smem *m = malloc((maxlen + 1) * sizeof(smem));
+  for (int k = 0; k < n; ++k) {
+    int ns = find_smems(fmi, patterns[k], lens[k], anchor_len, m);
+    // No anchor (which is where the loop above ends up in that case)
+    a[k].len = anchor_len;
+    a[k].anchmisses = 0;
+    a[k].seglen = 0;
+    for (int j = ns - 1; j >= 0; --j) {
+      if (m[j].iv.size != 1)
+	continue;
+      a[k].len = m[j].end;
+      a[k].seglen = m[j].end - m[j].start;
+      a[k].anchmisses = lens[k]/10 - (lens[k] - m[j].end + 2)/3;
+      if (a[k].anchmisses < 1)
+	a[k].anchmisses = 1;
+      a[k].sp = m[j].iv.fsp;
+      a[k].ep = m[j].iv.fsp + 1;
+      break;
+    }
+  }
+  free(m);
+}
+
 // Pass in the required anchor length. No mismatch will be allowed.
-int align_read_anchored(const fm_index *fmi, const char *seq, const char *pattern, int len, int anchor_len, stack *s) {
+// If first isn't NULL, it's the result of find_anchors() for this read, and
+// is used instead of searching for the first anchor again.
+bwtint_t align_read_anchored(const fm_index *fmi, const char *seq, const char *pattern, int len, int anchor_len, stack *s, const anchor *first) {
   const int olen = len;
   int anchmisses = len/10, nmisses;
   // Here we require an anchor to start in the last 20% of the read
   int curgap = 0;
-  int curpos = -1;
-  int endpos;
+  bwtint_t curpos = -1;
+  bwtint_t endpos;
   int anchlen;
+  // The piece of the sequence the anchor is in (see fmi_piece()), which the
+  // rest of the alignment has to stay inside
+  bwtint_t pstart = 0, pend = fmi->len;
+  // The same rows tend to come up again (the anchor, and the candidates
+  // for extending it), so remember where they were
+  sa_memo memo;
+  sa_memo_clear(&memo);
   // Look for an anchor of length at least anchor_len (try 20 or so, or maybe
   // log_4(fmi->len)+1)
   while (len > anchor_len && anchmisses > 0) {
+    // What the last search which didn't give an anchor matched (if it was
+    // the one just before)
+    int lastseg = -1;
     nmisses = 0;
     while ((len > anchor_len) && (anchmisses > 0)) {
-      int seglen = mms(fmi, pattern, len, &curpos, &endpos);
+      int seglen;
+      if (first) {
+	// Pick up where the batched search left off
+	len = first->len;
+	anchmisses = first->anchmisses;
+	seglen = first->seglen;
+	curpos = first->sp;
+	endpos = first->ep;
+	first = NULL;
+	if (!seglen)
+	  break;
+      }
+      else if (lastseg >= 0)
+	seglen = mms_shift(fmi, pattern, len, 3, lastseg, &curpos, &endpos);
+      else
+	seglen = mms(fmi, pattern, len, &curpos, &endpos);
       if (seglen < anchor_len || endpos - curpos > 1) {
 	anchmisses--;
 	len -= 3;
+	lastseg = seglen;
 	continue;
       }
       else {
+	bwtint_t pos = unc_sa_memo(fmi, &memo, curpos);
+	// Only the part of the anchor in the same piece as its last base is a
+	// real match; the rest of the read is left for the extension below
+	pend = fmi_piece(fmi, pos + seglen - 1, &pstart);
+	if (pstart > pos) {
+	  seglen -= pstart - pos;
+	  pos = pstart;
+	  if (seglen < anchor_len) {
+	    anchmisses--;
+	    len -= 3;
+	    lastseg = -1;
+	    continue;
+	  }
+	}
 	len -= seglen;
 	anchlen = seglen;
 	nmisses = olen/5;
-	curpos = unc_sa(fmi, curpos);
+	curpos = pos;
 	//fprintf(stderr, "%d %d %d\n", anchlen, olen, len);
 
 	// And use N-W to align the "tail" of the read
 	int buflen = 10 + (olen - (len + seglen));
-	if (buflen + curpos + seglen > fmi->len)
-	  buflen = fmi->len - curpos - seglen;
+	if (buflen + curpos + seglen > pend)
+	  buflen = pend - curpos - seglen;
 	char *buf = malloc(buflen);
 	for (int i = 0; i < buflen; ++i)
 	  buf[i] = getbase(seq, curpos + seglen + i);
@@ -208,14 +391,31 @@ int align_read_anchored(const fm_index *fmi, const char *seq, const char *patter
     if (nmisses < 1)
       continue;
 
-    // In the second loop we try to extend our anchor backwards
-    while ((len > nmisses) && (len > 4) && (nmisses > 0)) {
+    // In the second loop we try to extend our anchor backwards, unless it
+    // starts at a join already (see fmi_piece()), in which case whatever's
+    // left of the read hangs off the start of the piece
+    int at_join = pstart && curpos == pstart;
+    while ((len > nmisses) && (len > 4) && (nmisses > 0) && !at_join) {
+      bwtint_t start, end;
+      int seglen = 0;
       for (curgap = 1; curgap < 10; ++curgap) {
-	int start, end;
-	int seglen = mms(fmi, pattern, len-curgap, &start, &end);
+	// Each try is one base further left than the last
+	if (curgap == 1 || len - curgap < 1)
+	  seglen = mms(fmi, pattern, len-curgap, &start, &end);
+	else
+	  seglen = mms_shift(fmi, pattern, len-curgap, 1, seglen, &start, &end);
 	int matched = 0;
-	for (int i = start; i < end; ++i) {
-	  if (abs(unc_sa(fmi, i) + seglen - curpos) - curgap <= 3) {
+	// Locate the candidates BATCH_WIDTH at a time; usually one of the
+	// first few is close enough, so there's no point doing all of them
+	bwtint_t pos[BATCH_WIDTH];
+	for (bwtint_t i = start; i < end; ++i) {
+	  bwtint_t p;
+	  if ((i - start) % BATCH_WIDTH == 0)
+	    locate_range(fmi, i, end - i > BATCH_WIDTH ? i + BATCH_WIDTH : end,
+			 pos, &memo);
+	  p = pos[(i - start) % BATCH_WIDTH];
+	  // It has to be in the same piece as the anchor, too
+	  if (llabs(p + seglen - curpos) - curgap <= 3 && p >= pstart) {
 	    // TODO: write proper scoring function, the number of misses
 	    // is not going to be curgap.
 	    nmisses -= curgap;
@@ -224,7 +424,7 @@ int align_read_anchored(const fm_index *fmi, const char *seq, const char *patter
 	    // Align the stuff in between. In this case we don't need to
 	    // copy pattern to a new buffer, but we do still need to copy
 	    // the genome
-	    int buflen = curpos - (unc_sa(fmi, i) + seglen);
+	    int buflen = curpos - (p + seglen);
 	    // There's a semi-theoretical problem that this might actually
 	    // be negative, but that's easy to resolve
 	    if (buflen < 0) {
@@ -233,13 +433,13 @@ int align_read_anchored(const fm_index *fmi, const char *seq, const char *patter
 	    else {
 	      char *buf = malloc(buflen);
 	      for (int j = 0; j < buflen; ++j)
-		buf[j] = getbase(seq, unc_sa(fmi, i) + seglen + j);
+		buf[j] = getbase(seq, p + seglen + j);
 	      // And compare
 	      sw_fast(pattern + (len - curgap), curgap, buf, buflen, s);
 	      free(buf);
 	    }
 	    stack_push(s, 'M', seglen);
-	    curpos = unc_sa(fmi, i);
+	    curpos = p;
 	    len -= seglen + curgap;
 	    curgap = 0;
 	    break;
@@ -247,17 +447,20 @@ int align_read_anchored(const fm_index *fmi, const char *seq, const char *patter
 	}
 	if (matched)
 	  break;
-	else
-	  continue;
       }
       if (curgap)
 	nmisses = 0;
     }
     if (nmisses > 0) {
+      if (at_join) {
+	if (len)
+	  stack_push(s, 'I', len);
+	return curpos;
+      }
       // Set up matrix for N-W alignment
       int buflen = len + 10;
-      if (buflen > curpos)
-	buflen = curpos;
+      if (buflen > curpos - pstart)
+	buflen = curpos - pstart;
       char *buf = malloc(buflen);
       for (int i = 0; i < buflen; ++i)
 	buf[i] = getbase(seq, curpos - 1 - i);
@@ -283,8 +486,8 @@ int align_read_anchored(const fm_index *fmi, const char *seq, const char *patter
   }
 
   int buflen = len + 10;
-  if (buflen > curpos)
-    buflen = curpos;
+  if (buflen > curpos - pstart)
+    buflen = curpos - pstart;
   char *buf = malloc(buflen);
   for (int i = 0; i < buflen; ++i)
     buf[i] = getbase(seq, curpos - 1 - i);
@@ -297,15 +500,16 @@ int align_read_anchored(const fm_index *fmi, const char *seq, const char *patter
   return curpos - len;
 }
 
-int align_read(const fm_index *fmi, const char *seq, const char *pattern, int len, int thresh) {
-  int starts[10], lens[10], nsegments;
+bwtint_t align_read(const fm_index *fmi, const char *seq, const char *pattern, int len, int thresh) {
+  bwtint_t starts[10];
+  int lens[10], nsegments;
   int penalty;
   int nmisses = len/10;
   int olen = len;
   for (nsegments = 0; nsegments < 10; nsegments++) {
     if (len < 10)
       break;
-    int start, end;
+    bwtint_t start, end;
     int seglen = mms(fmi, pattern, len, &start, &end);
     if (seglen < thresh) {
       int mlen = mms_mismatch(fmi, seq, pattern, len - seglen, &start, &end, &penalty);
@@ -338,13 +542,14 @@ int align_read(const fm_index *fmi, const char *seq, const char *pattern, int le
     lens[nsegments] = seglen + mlen;
   }
   int totlen = lens[0];
+  bwtint_t pos[10];
   if (nsegments == 10)
     return 0; // Too many segments
   else {
     // For each segment check whether it's within 6 nts of the next
-    
+    locate_rows(fmi, nsegments, starts, pos, NULL);
     for (int i = 0; i < nsegments - 1; ++i) {
-      if (abs(unc_sa(fmi, starts[i+1]) + lens[i+1] - unc_sa(fmi, starts[i])) < 7) {
+      if (llabs(pos[i+1] + lens[i+1] - pos[i]) < 7) {
 	totlen += lens[i+1];
 	continue;
       } 
@@ -352,72 +557,105 @@ int align_read(const fm_index *fmi, const char *seq, const char *pattern, int le
 	return 0; // Gapped
     }
   }
-  if (3 * totlen > 2 * olen)
-    return unc_sa(fmi, starts[nsegments-1]) - len;
+  if (nsegments && 3 * totlen > 2 * olen)
+    return pos[nsegments-1] - len;
   return 0;
 }
 
+// Looks for read (or its reverse complement, rev) with at most diffs
+// mismatches (see mismatch_search(); rev is NULL for an FMD index, which
+// has both strands already), returning its position as
+// align_read_anchored() does if it matches exactly one place with the fewest
+// of them. Gaps are left to the anchored alignment; allowing them here as
+// well would cost a lot more for the reads which really don't align.
+bwtint_t rescue_read(const fm_index *fmi, const char *read, const char *rev,
+		     int len, int diffs, stack *s) {
+  mm_hit hits[2];
+  int n = mismatch_search(fmi, read, len, diffs, 0, hits, 2);
+  if (!n && rev)
+    n = mismatch_search(fmi, rev, len, diffs, 0, hits, 2);
+  if (!n || hits[0].ep - hits[0].sp > 1 ||
+      (n > 1 && hits[1].diffs == hits[0].diffs))
+    return 0;
+  // Nor can it run over from one piece of the sequence into the next (see
+  // fmi_piece())
+  bwtint_t pos = unc_sa(fmi, hits[0].sp), start;
+  if (fmi_piece(fmi, pos, &start) < pos + len)
+    return 0;
+  s->size = 0;
+  stack_push(s, 'M', len);
+  return pos;
+}
+
+// The number of bases of the sequence an alignment takes up
+bwtint_t aligned_length(const stack *s) {
+  bwtint_t glen = 0;
+  for (int i = 0; i < s->size; ++i)
+    if (s->chars[i] != 'I')
+      glen += s->counts[i];
+  return glen;
+}
+
+// In an FMD index (see fmd_seq()) a read which aligned to the second half,
+// i.e. the reverse complement, is reported as its reverse complement aligned
+// to the first half, which is what aligning that would have given; the
+// alignment in s is turned around to match. align_read_anchored() keeps to
+// one half, but if one did straddle the two it wouldn't really have aligned
+// at all, so that gives 0.
+bwtint_t fmd_position(const fm_index *fmi, bwtint_t pos, stack **s) {
+  bwtint_t half = fmi->len / 2, glen = aligned_length(*s);
+  stack *t;
+  if (pos + glen <= half)
+    return pos;
+  if (pos < half)
+    return 0;
+  t = stack_make();
+  stack_flip(*s, t);
+  *s = t;
+  return 2*half - pos - glen;
+}
+
 // Reminder to self: buf length (i.e. maximum read length) is currently
 // hardcoded; change to a larger value (to align longer reads) or make it
 // dynamic
 
+// Number of reads aligned together
+#define READ_BATCH 4096
+
 int main(int argc, char **argv) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s seqfile indexfile readfile\n", argv[0]);
-    exit(-1);
+  int use_smem = 0, rescue_diffs = 0;
+  while (argc > 1 && argv[1][0] == '-') {
+    if (!strcmp(argv[1], "-m"))
+      use_smem = 1;
+    else if (!strcmp(argv[1], "-d") && argc > 2) {
+      rescue_diffs = atoi(argv[2]);
+      argv++;
+      argc--;
+    }
+    else
+      break;
+    argv++;
+    argc--;
   }
-  char *seq, *seqfile, *indexfile, *readfile, *buf = malloc(256*256), *revbuf = malloc(256*256), c;
-  fm_index *fmi;
-  int len;
-  int i, j, k, jj;
-  FILE *sfp, *ifp, *rfp;
-  seqfile = argv[1];
-  indexfile = argv[2];
-  readfile = argv[3];
-  sfp = fopen(seqfile, "rb");
-  if (sfp == 0) {
-    fprintf(stderr, "Could not open sequence\n");
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "Usage: %s [-m] [-d diffs] [seqfile] indexfile readfile\n",
+	    argv[0]);
+    fprintf(stderr, "(seqfile can be left out if the index includes the "
+	    "sequence)\n");
     exit(-1);
   }
-  fseek(sfp, 0L, SEEK_END);
-  len = ftell(sfp);
-  rewind(sfp);
-  seq = malloc(len/4+1);
-  for (i = 0; i < len/4 + 1; ++i) {
-    switch(fgetc(sfp)) {
-    case 'C': c = 64; break;
-    case 'G': c = 128; break;
-    case 'T': c = 192; break;
-    default: c = 0;
-    }
-    switch(fgetc(sfp)) {
-    case 'C': c ^= 16; break;
-    case 'G': c ^= 32; break;
-    case 'T': c ^= 48;
-    }
-    switch(fgetc(sfp)) {
-    case 'C': c ^= 4; break;
-    case 'G': c ^= 8; break;
-    case 'T': c ^= 12;
-    }
-    switch(fgetc(sfp)) {
-    case 'C': c ^= 1; break;
-    case 'G': c ^= 2; break;
-    case 'T': c ^= 3;
-    }
-    seq[i] = c;
-  }
-  // Handle the last character (which is at seq[len/4]
-  c = 0;
-  for (i = 0; i < len&3; ++i) {
-    switch(fgetc(sfp)) {
-    case 'C': c ^= 64 >> (2 * i); break;
-    case 'G': c ^= 128 >> (2 * i); break;
-    case 'T': c ^= 192 >> (2 * i);
-    }
-    seq[len/4] = c;
+  char *seq = NULL, *seqfile, *indexfile, *readfile, *buf = malloc(256*256);
+  fm_index *fmi;
+  bwtint_t len;
+  FILE *ifp, *rfp;
+  seqfile = (argc == 4) ? argv[1] : NULL;
+  indexfile = argv[argc-2];
+  readfile = argv[argc-1];
+  if (seqfile) {
+    seq = read_seq(seqfile, &len);
+    if (seq == 0)
+      exit(-1);
   }
-  fclose(sfp);
   
   // Open index file
   ifp = fopen(indexfile, "rb");
@@ -427,6 +665,24 @@ int main(int argc, char **argv) {
   }
   fmi = read_index(seq, ifp);
   fclose(ifp);
+  if (!fmi)
+    exit(-1);
+  if (!seqfile) {
+    // Use the copy of the sequence in the index
+    if (!fmi->ref) {
+      fprintf(stderr, "Index doesn't include the sequence, so it needs to be "
+	      "given\n");
+      exit(-1);
+    }
+    seq = (char *)fmi->ref;
+  }
+  else if (fmi->fmd) {
+    // Everything looked up in seq is in terms of the index, which is of the
+    // sequence and its reverse complement
+    char *both = fmd_seq(seq, len);
+    free(seq);
+    seq = both;
+  }
 
   // And now we go read the index file
   rfp = fopen(readfile, "r");
@@ -438,68 +694,120 @@ int main(int argc, char **argv) {
   
   int naligned = 0;
   int nread = 0;
+  // Reads are aligned READ_BATCH at a time so that their anchor searches can
+  // be run through mms_batch() together
+  char **reads = malloc(READ_BATCH * sizeof(char *));
+  char **revs = malloc(READ_BATCH * sizeof(char *));
+  char **redo_reads = malloc(READ_BATCH * sizeof(char *));
+  int *lens = malloc(READ_BATCH * sizeof(int));
+  int *redo = malloc(READ_BATCH * sizeof(int));
+  int *redo_lens = malloc(READ_BATCH * sizeof(int));
+  bwtint_t *pos = malloc(READ_BATCH * sizeof(bwtint_t));
+  stack **stacks = malloc(READ_BATCH * sizeof(stack *));
+  anchor *anchors = malloc(READ_BATCH * sizeof(anchor));
   while (!feof(rfp)) {
-    // Align the read using mms and mms_mismatch (which is a sort of wrapper
-    // for the correct calls to mms_continue)
-    if (!fgets(buf, 256*256-1, rfp))
-      break;
-    nread++;
-    if (buf[strlen(buf)-1] == '\n')
-      buf[strlen(buf)-1] = 0;
-    int len = strlen(buf);
-    for (int i = 0; i < len; ++i) {
-      // Replace with "compressed" characters
-      switch(buf[i]) {
-      case 'A':
-	buf[i] = 0;
-	revbuf[len-i-1] = 3;
-	break;
-      case 'C':
-	buf[i] = 1;
-	revbuf[len-i-1] = 2;
-	break;
-      case 'T':
-	buf[i] = 3;
-	revbuf[len-i-1] = 0;
-	break;
-      case 'G':
-	buf[i] = 2;
-	revbuf[len-i-1] = 1;
-	break;
-      default: // 'N'
-	buf[i] = 5;
-	revbuf[len-i-1] = 5;
-	break;
+    int nb = 0, nredo = 0;
+    while (nb < READ_BATCH && fgets(buf, 256*256-1, rfp)) {
+      nread++;
+      if (buf[0] && buf[strlen(buf)-1] == '\n')
+	buf[strlen(buf)-1] = 0;
+      int len = strlen(buf);
+      char *read = reads[nb] = malloc(len), *revbuf = revs[nb] = malloc(len);
+      for (int i = 0; i < len; ++i) {
+	// Replace with "compressed" characters
+	switch(buf[i]) {
+	case 'A':
+	  read[i] = 0;
+	  revbuf[len-i-1] = 3;
+	  break;
+	case 'C':
+	  read[i] = 1;
+	  revbuf[len-i-1] = 2;
+	  break;
+	case 'T':
+	  read[i] = 3;
+	  revbuf[len-i-1] = 0;
+	  break;
+	case 'G':
+	  read[i] = 2;
+	  revbuf[len-i-1] = 1;
+	  break;
+	default: // 'N'
+	  read[i] = 5;
+	  revbuf[len-i-1] = 5;
+	  break;
+	}
       }
+      lens[nb++] = len;
     }
+    if (!nb)
+      break;
 
-    int aligned = 0;
-
-    int score = 0;
-    stack *s = stack_make();
-    //    int thresh = (int) (-1.2 * (1+len));
-
+    // Try the reads as given first, then the reverse complements of the ones
+    // which didn't align (unless the index has both strands, in which case
+    // the first try found whichever one the read is on)
     //    int pos = align_read(fmi, seq, buf, len, 10);
-    int pos = align_read_anchored(fmi, seq, buf, len, 12, s);
-    if (pos) {
-      naligned++;
-      printf("%d\n", pos + 1);
-      stack_print_destroy(s);
+    if (use_smem)
+      find_anchors_smem(fmi, nb, reads, lens, 12, anchors);
+    else
+      find_anchors(fmi, nb, reads, lens, 12, anchors);
+    for (int k = 0; k < nb; ++k) {
+      stacks[k] = stack_make();
+      pos[k] = align_read_anchored(fmi, seq, reads[k], lens[k], 12, stacks[k],
+				   &anchors[k]);
+      if (!pos[k] && !fmi->fmd) {
+	stack_destroy(stacks[k]);
+	stacks[k] = stack_make();
+	redo[nredo] = k;
+	redo_reads[nredo] = revs[k];
+	redo_lens[nredo++] = lens[k];
+      }
     }
-    else {
-      stack_destroy(s);
-      s = stack_make();
-      //      pos = align_read(fmi, seq, revbuf, len, 10);
-      pos = align_read_anchored(fmi, seq, revbuf, len, 12, s);
-      if (pos) {
+    //      pos = align_read(fmi, seq, revbuf, len, 10);
+    if (use_smem)
+      find_anchors_smem(fmi, nredo, redo_reads, redo_lens, 12, anchors);
+    else
+      find_anchors(fmi, nredo, redo_reads, redo_lens, 12, anchors);
+    for (int j = 0; j < nredo; ++j) {
+      int k = redo[j];
+      pos[k] = align_read_anchored(fmi, seq, revs[k], lens[k], 12, stacks[k],
+				   &anchors[j]);
+    }
+
+    // Last of all, reads which didn't align either way might still match
+    // with a few mismatches and nothing else
+    for (int k = 0; k < nb && rescue_diffs; ++k)
+      if (!pos[k])
+	pos[k] = rescue_read(fmi, reads[k], fmi->fmd ? NULL : revs[k], lens[k],
+			     rescue_diffs, stacks[k]);
+    if (fmi->fmd)
+      for (int k = 0; k < nb; ++k)
+	if (pos[k])
+	  pos[k] = fmd_position(fmi, pos[k], &stacks[k]);
+
+    for (int k = 0; k < nb; ++k) {
+      long long contig = 0;
+      bwtint_t off = pos[k];
+      // A match running from one contig into the next isn't a real one (see
+      // fmi_contig()); align_read_anchored() shouldn't give one, but check
+      if (pos[k] && fmi->contigs &&
+	  (contig = fmi_contig(fmi, pos[k], aligned_length(stacks[k]),
+			       &off)) < 0)
+	pos[k] = 0;
+      if (pos[k]) {
 	naligned++;
-	printf("%d\n", pos + 1);
-	stack_print_destroy(s);
+	if (fmi->contigs)
+	  printf("%s\t%lld\n", fmi_contig_name(fmi, contig), (long long)off + 1);
+	else
+	  printf("%lld\n", (long long)pos[k] + 1);
+	stack_print_destroy(stacks[k]);
       }
       else {
 	printf("0\n");
-	stack_destroy(s);
+	stack_destroy(stacks[k]);
       }
+      free(reads[k]);
+      free(revs[k]);
     }
 
     /*
@@ -591,8 +899,17 @@ int main(int argc, char **argv) {
   fprintf(stderr, "%d of %d reads aligned\n", naligned, nread);
   
   free(buf);
-  free(revbuf);
+  free(reads);
+  free(revs);
+  free(redo_reads);
+  free(lens);
+  free(redo);
+  free(redo_lens);
+  free(pos);
+  free(stacks);
+  free(anchors);
   destroy_fmi(fmi);
-  free(seq);
+  if (seqfile)
+    free(seq);
   return 0;
 }
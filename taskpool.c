@@ -0,0 +1,195 @@
+// A work-stealing thread pool. Each worker has a deque of tasks: it pushes
+// the tasks it submits onto the back of its own and takes from the back, and
+// when that's empty it steals from the front of the others'. Recursive
+// sorts (histsortcomp.c) split their biggest buckets off first, so a thief
+// gets a big chunk of work rather than a crumb, and nobody sits idle just
+// because the buckets they started with turned out to be small.
+// The deques are just locked arrays; the tasks this is meant for take
+// milliseconds each, so the locking isn't worth being clever about.
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "taskpool.h"
+
+typedef struct {
+  void (*fn)(void *);
+  void *arg;
+} tp_task;
+
+typedef struct {
+  pthread_mutex_t lock;
+  tp_task *tasks;
+  size_t head, tail, cap; // The tasks are [head, tail)
+} tp_deque;
+
+struct taskpool {
+  int nthreads;
+  pthread_t *threads;
+  tp_deque *deques;
+  pthread_mutex_t lock; // Protects everything below
+  pthread_cond_t work, idle;
+  long queued; // Tasks sitting in the deques
+  long pending; // Tasks submitted and not finished yet
+  unsigned int next; // Where the next task from outside the pool goes
+  int quit;
+};
+
+// Which pool the current thread is a worker of (if any), and which worker
+static __thread taskpool *tp_pool;
+static __thread int tp_self;
+
+typedef struct {
+  taskpool *pool;
+  int self;
+} tp_start;
+
+static void tp_push(tp_deque *d, tp_task t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->tail == d->cap) {
+    if (d->head) {
+      size_t i;
+      for (i = d->head; i < d->tail; ++i)
+	d->tasks[i - d->head] = d->tasks[i];
+      d->tail -= d->head;
+      d->head = 0;
+    }
+    if (d->tail == d->cap) {
+      d->cap = d->cap ? 2 * d->cap : 64;
+      d->tasks = realloc(d->tasks, d->cap * sizeof(tp_task));
+    }
+  }
+  d->tasks[d->tail++] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+// Takes a task from the back (own == 1) or the front of d
+static int tp_pop(tp_deque *d, int own, tp_task *t) {
+  int r = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail) {
+    *t = own ? d->tasks[--d->tail] : d->tasks[d->head++];
+    if (d->head == d->tail)
+      d->head = d->tail = 0;
+    r = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return r;
+}
+
+static int tp_take(taskpool *pool, int self, tp_task *t) {
+  int i;
+  if (tp_pop(&pool->deques[self], 1, t))
+    return 1;
+  for (i = 1; i < pool->nthreads; ++i)
+    if (tp_pop(&pool->deques[(self + i) % pool->nthreads], 0, t))
+      return 1;
+  return 0;
+}
+
+static void *tp_worker(void *arg) {
+  tp_start *st = arg;
+  taskpool *pool = st->pool;
+  int self = st->self, quit;
+  tp_task t;
+  free(st);
+  tp_pool = pool;
+  tp_self = self;
+  for (;;) {
+    if (tp_take(pool, self, &t)) {
+      pthread_mutex_lock(&pool->lock);
+      --pool->queued;
+      pthread_mutex_unlock(&pool->lock);
+      t.fn(t.arg);
+      pthread_mutex_lock(&pool->lock);
+      if (--pool->pending == 0)
+	pthread_cond_broadcast(&pool->idle);
+      pthread_mutex_unlock(&pool->lock);
+      continue;
+    }
+    // queued can only be > 0 while there's something in a deque, so if it
+    // isn't there's nothing to do until someone submits a task (and they
+    // have to take the lock to say so, so the wakeup can't get lost)
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued <= 0 && !pool->quit)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    quit = pool->quit && pool->queued <= 0;
+    pthread_mutex_unlock(&pool->lock);
+    if (quit)
+      break;
+  }
+  return NULL;
+}
+
+taskpool *taskpool_create(int nthreads) {
+  taskpool *pool = calloc(1, sizeof(taskpool));
+  int i;
+  if (nthreads < 1)
+    nthreads = 1;
+  pool->nthreads = nthreads;
+  pool->threads = malloc(nthreads * sizeof(pthread_t));
+  pool->deques = calloc(nthreads, sizeof(tp_deque));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  for (i = 0; i < nthreads; ++i)
+    pthread_mutex_init(&pool->deques[i].lock, NULL);
+  for (i = 0; i < nthreads; ++i) {
+    tp_start *st = malloc(sizeof(tp_start));
+    st->pool = pool;
+    st->self = i;
+    pthread_create(&pool->threads[i], NULL, tp_worker, st);
+  }
+  return pool;
+}
+
+void taskpool_submit(taskpool *pool, void (*fn)(void *), void *arg) {
+  tp_task t;
+  int d;
+  t.fn = fn;
+  t.arg = arg;
+  // Counted as pending first, so that pending can't reach 0 while it's
+  // still on its way into a deque
+  pthread_mutex_lock(&pool->lock);
+  ++pool->pending;
+  d = tp_pool == pool ? tp_self : (int)(pool->next++ % pool->nthreads);
+  pthread_mutex_unlock(&pool->lock);
+  tp_push(&pool->deques[d], t);
+  pthread_mutex_lock(&pool->lock);
+  ++pool->queued;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void taskpool_wait(taskpool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0)
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void taskpool_destroy(taskpool *pool) {
+  int i;
+  taskpool_wait(pool);
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->nthreads; ++i)
+    pthread_join(pool->threads[i], NULL);
+  for (i = 0; i < pool->nthreads; ++i) {
+    pthread_mutex_destroy(&pool->deques[i].lock);
+    free(pool->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->deques);
+  free(pool->threads);
+  free(pool);
+}
+
+int taskpool_ncpus(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : (int)n;
+}
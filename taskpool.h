@@ -0,0 +1,31 @@
+#ifndef _TASKPOOL_H
+#define _TASKPOOL_H
+
+// A pool of worker threads which run tasks (a function and its argument).
+// Tasks can submit more tasks; each worker keeps its own queue and runs the
+// newest task on it first (depth first, like a recursive call would), and a
+// worker which runs out steals the oldest from someone else's (the oldest
+// being the biggest, for anything recursive). The pool can be reused for as
+// many batches of tasks as you like.
+
+typedef struct taskpool taskpool;
+
+// Starts nthreads workers (at least 1)
+taskpool *taskpool_create(int nthreads);
+
+// Queues fn(arg) to be run by one of the workers; can be called from anywhere,
+// including from inside a task
+void taskpool_submit(taskpool *pool, void (*fn)(void *), void *arg);
+
+// Waits until every task submitted so far has finished, including any tasks
+// they submitted. Must not be called from inside a task (it'd wait for
+// itself).
+void taskpool_wait(taskpool *pool);
+
+// Waits for the tasks, then stops the workers and frees the pool
+void taskpool_destroy(taskpool *pool);
+
+// The number of cores online, which is a good number of workers to have
+int taskpool_ncpus(void);
+
+#endif /* _TASKPOOL_H */